@@ -0,0 +1,55 @@
+#ifndef COMMON_THREAD_POOL_H_
+#define COMMON_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace common
+{
+
+// Fixed set of worker threads running data parallel loops. The calling thread
+// takes part in every loop, so a pool of one thread runs everything inline.
+class ThreadPool
+{
+public:
+  // 'num_threads' counts the calling thread, 0 for one per hardware thread
+  explicit ThreadPool(const int &num_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Calls 'function(i)' for every i in [0, n) and returns when all calls are
+  // done. Calls for different i may run concurrently. Not reentrant.
+  void ParallelFor(const int &n, const std::function<void(int)> &function);
+
+  int Size() const { return workers_.size() + 1; }
+
+private:
+  void WorkerLoop();
+  // Runs chunks of the current loop until none is left
+  void RunChunks();
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable start_condition_;
+  std::condition_variable done_condition_;
+  // Current loop, 'generation_' is bumped for every one
+  const std::function<void(int)> *function_;
+  int size_;
+  int chunk_size_;
+  std::atomic<int> next_;
+  uint64_t generation_;
+  // Workers which have not finished the current loop yet
+  int pending_;
+  bool stop_;
+};
+
+} // namespace common
+
+#endif // COMMON_THREAD_POOL_H_
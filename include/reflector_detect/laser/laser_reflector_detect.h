@@ -2,6 +2,8 @@
 #define REFLECTOR_DETECT_LASER_LASER_REFLECTOR_DETECT_H
 #include "reflector_detect/reflector_detect_interface.h"
 #include "reflector_detect/pose_extrapolator_interface.h"
+#include <cstdint>
+#include <vector>
 
 namespace reflector_detect
 {
@@ -12,6 +14,10 @@ struct ReflectorDetectOptions
   double reflector_length_error;
   float range_min;
   float range_max;
+  // Segment only the beams around the reflectors given by SetTrackingTargets
+  bool use_tracking;
+  // Every this many scans the whole scan is segmented to find new reflectors
+  int tracking_full_scan_interval;
 };
 
 class LaserReflectorDetect : public ReflectorDetectInterface
@@ -22,12 +28,82 @@ public:
 
   sensor::Observation HandleLaserScan(const sensor_msgs::LaserScanConstPtr &msg) override;
   void HandleOdometryData(const sensor::OdometryData &msg) override;
-  sensor::RangeData GetRangeData() override { return range_data_; }
+  // Built from the last scan on first request
+  sensor::RangeData GetRangeData() override;
+  void SetTrackingTargets(const sensor::PointCloud &reflectors, const float &position_margin,
+                          const float &angle_margin) override;
 
 private:
+  // Unit direction of every beam rotated into base_link, kept while the scan
+  // geometry and the extrinsic do not change
+  struct BeamTable
+  {
+    float angle_min;
+    float angle_increment;
+    int size;
+    // x, y, yaw of sensor in base_link
+    Eigen::Vector3f extrinsic;
+    std::vector<float> cos_angle;
+    std::vector<float> sin_angle;
+  };
+
+  // Beams first..last of one reflector, first > last if it wraps around the
+  // end of a 360 scan
+  struct ReflectorSegment
+  {
+    int first;
+    int last;
+  };
+
+  // Beams [begin, end) segmented in tracking mode
+  struct BeamWindow
+  {
+    int begin;
+    int end;
+  };
+
+  // Per scan buffers, sized from the beam count on the first scan and reused
+  // afterwards so that steady state detection does not allocate
+  struct ScanScratch
+  {
+    // Beam endpoints in base_link
+    std::vector<float> points_x;
+    std::vector<float> points_y;
+    std::vector<uint8_t> valid;
+    // Pose at beam time, only for range data
+    std::vector<Eigen::Isometry2d> poses;
+    std::vector<ReflectorSegment> segments;
+    std::vector<BeamWindow> windows;
+  };
+
+  void UpdateBeamTable(const sensor_msgs::LaserScan &msg, const Eigen::Vector3f &extrinsic);
+  void ResizeScratch(const int &size);
+  // Projects the ranges of beams [begin, end) to base_link in one branch free
+  // pass, valid marks ranges inside the limits of the message
+  void ProjectScan(const sensor_msgs::LaserScan &msg, const int &begin, const int &end);
+  // Sorted disjoint windows around the tracking targets
+  void ComputeTrackingWindows(const sensor_msgs::LaserScan &msg);
+  Eigen::Vector2f BeamPoint(const int &i) const { return {scratch_.points_x[i], scratch_.points_y[i]}; }
+
   const ReflectorDetectOptions options_;
   std::unique_ptr<PoseExtrapolatorInterface> pose_extrapolator_;
   sensor::RangeData range_data_;
+  BeamTable beam_table_;
+  ScanScratch scratch_;
+
+  // Last scan, kept until its range data is requested
+  sensor_msgs::LaserScanConstPtr range_data_scan_;
+  bool range_data_projected_;
+  double range_data_first_point_time_;
+  double range_data_point_delta_t_;
+  transform::Rigid2d range_data_max_time_pose_;
+
+  // Expected reflectors in base_link for the next scan
+  sensor::PointCloud tracking_targets_;
+  float tracking_position_margin_;
+  float tracking_angle_margin_;
+  bool has_tracking_targets_;
+  int scans_since_full_scan_;
 };
 
 } // namespace reflector_detect
@@ -1,27 +1,67 @@
 #ifndef REFLECTOR_DETECT_POSE_EXTRAPOLATOR_H
 #define REFLECTOR_DETECT_POSE_EXTRAPOLATOR_H
 #include "reflector_detect/pose_extrapolator_interface.h"
-#include <deque>
-#include <mutex>
+#include <array>
+#include <atomic>
+#include <cstdint>
 
 namespace reflector_detect
 {
+// Odometry is handed from the odometry thread to the scan thread through a
+// lock free single producer single consumer queue, so neither thread blocks
+// the other. The scan thread moves it into a fixed size history sorted by
+// time which is searched by binary search. The pose of every odometry data
+// is precomputed once, queries only interpolate.
 class PoseExtrapolator : public PoseExtrapolatorInterface
 {
 public:
   PoseExtrapolator();
   ~PoseExtrapolator() override {}
-  void TrimDataByTime(const double &time) override;
+  // Producer, odometry thread only
   void HandleOdometryData(const sensor::OdometryData &msg) override;
+  // Consumer, scan thread only
+  void TrimDataByTime(const double &time) override;
   transform::Rigid2d ExtrapolatorPose(const double &time) override;
+  // One sweep over the history, O(size + odometry data)
+  void ExtrapolatorPoses(const double &start_time, const double &time_step, const int &size,
+                         std::vector<Eigen::Isometry2d> *poses) override;
 
 private:
-  transform::Rigid2d Interpolator(const sensor::OdometryData &start, const sensor::OdometryData &end, const double &time);
-  transform::Rigid2d Interpolator(const sensor::OdometryData &start, const double &time);
+  // Power of two, 2.5s of 100Hz odometry
+  static constexpr int kCapacity = 256;
+
+  struct OdometrySample
+  {
+    double time;
+    double x;
+    double y;
+    double yaw;
+    double cos_yaw;
+    double sin_yaw;
+    double vx;
+    double vy;
+    double w;
+  };
+
+  // Moves the queued odometry into the history
+  void Drain();
+  const OdometrySample &Sample(const int &i) const { return history_[(history_begin_ + i) & (kCapacity - 1)]; }
+  // First sample after 'time', history_size_ if there is none
+  int UpperBound(const double &time) const;
+  // Rotations are built from the precomputed cos and sin of the yaw
+  Eigen::Isometry2d Interpolator(const OdometrySample &start, const OdometrySample &end, const double &time) const;
+  Eigen::Isometry2d Interpolator(const OdometrySample &start, const double &time) const;
+
+  std::array<OdometrySample, kCapacity> queue_;
+  // Written by the consumer and the producer respectively
+  std::atomic<uint64_t> queue_head_;
+  std::atomic<uint64_t> queue_tail_;
+  std::atomic<int> dropped_;
 
-  std::deque<sensor::OdometryData> odometry_data_;
-  std::mutex odometry_data_mutex_;
+  std::array<OdometrySample, kCapacity> history_;
+  int history_begin_;
+  int history_size_;
 };
 } // namespace reflector_detect
 
-#endif // REFLECTOR_DETECT_POSE_EXTRAPOLATOR_H
\ No newline at end of file
+#endif // REFLECTOR_DETECT_POSE_EXTRAPOLATOR_H
@@ -1,6 +1,8 @@
 #ifndef REFLECTOR_DETECT_POSE_EXTRAPOLATOR_INTERFACE_H
 #define REFLECTOR_DETECT_POSE_EXTRAPOLATOR_INTERFACE_H
 
+#include <vector>
+
 #include "common/common.h"
 #include "sensor/sensor_data.h"
 #include "transform/transform.h"
@@ -19,6 +21,16 @@ public:
   virtual void HandleOdometryData(const sensor::OdometryData &msg) {}
   virtual void HandleImuData(const sensor::ImuData &msg) {}
   virtual transform::Rigid2d ExtrapolatorPose(const double &time) = 0;
+  // Poses at the increasing times start_time + i * time_step, i < size, e.g.
+  // every beam of a scan. Implementations should sweep them in one pass. The
+  // poses are matrices, so applying them to every beam needs no cos and sin.
+  virtual void ExtrapolatorPoses(const double &start_time, const double &time_step, const int &size,
+                                 std::vector<Eigen::Isometry2d> *poses)
+  {
+    poses->resize(size);
+    for (int i = 0; i < size; ++i)
+      (*poses)[i] = transform::ToIsometry2D(ExtrapolatorPose(start_time + i * time_step));
+  }
 };
 
 } // namespace reflector_detect
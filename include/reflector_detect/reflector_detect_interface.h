@@ -30,6 +30,11 @@ public:
   virtual sensor::Observation HandlePointCloud(const sensor_msgs::PointCloud2ConstPtr &msg) { return sensor::Observation(); }
   virtual sensor::RangeData GetRangeData() { return {{0., 0.}, {}, {}}; }
 
+  // Reflectors expected in the next scan in base_link, with the position and
+  // heading uncertainty of that prediction. Only used for the next scan.
+  virtual void SetTrackingTargets(const sensor::PointCloud &reflectors, const float &position_margin,
+                                  const float &angle_margin) {}
+
   virtual void HandleOdometryData(const sensor::OdometryData &msg) {}
   virtual void HandleImuData(const sensor::ImuData &msg) {}
 
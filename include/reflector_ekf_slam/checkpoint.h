@@ -0,0 +1,36 @@
+#ifndef REFLECTOR_EKF_SLAM_CHECKPOINT_H
+#define REFLECTOR_EKF_SLAM_CHECKPOINT_H
+
+#include <string>
+
+#include "reflector_ekf_slam/ekf_slam_interface.h"
+#include "sensor/sensor_data.h"
+
+namespace ekf
+{
+// Everything a filter needs to resume after a restart: its state with the full
+// covariance, the prior map and the odometry settings the state was estimated with
+struct Checkpoint
+{
+  State state;
+  sensor::Map map;
+  sensor::OdometryModel odom_model;
+  double linear_velocity_cov;
+  double angular_velocity_cov;
+  double observation_cov;
+};
+
+// Binary checkpoint file, native byte order:
+//   header (magic, version, odometry settings, time, state dimension N, map size M)
+//   mu: N doubles, sigma: N * N doubles in column major
+//   map reflectors: 2 * M floats, map covariances: 4 * M doubles in column major
+// Every array starts 8 byte aligned, so a mapped file can be read in place.
+// The file is written next to 'file' and renamed over it, a crash while
+// writing leaves the previous checkpoint intact.
+bool WriteCheckpoint(const std::string &file, const Checkpoint &checkpoint);
+// Maps 'file' into memory and copies it out. Returns false and leaves
+// 'checkpoint' untouched if the file is missing, of another version or truncated.
+bool LoadCheckpoint(const std::string &file, Checkpoint *checkpoint);
+} // namespace ekf
+
+#endif // REFLECTOR_EKF_SLAM_CHECKPOINT_H
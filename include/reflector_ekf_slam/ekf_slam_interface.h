@@ -3,8 +3,10 @@
 
 #include <Eigen/Core>
 #include <Eigen/Dense>
+#include <algorithm>
 #include <vector>
 #include <fstream>
+#include <functional>
 #include <string>
 #include <memory>
 #include <cstddef>
@@ -25,6 +27,18 @@ struct ReflectorMatchResult
   std::vector<int> new_ids;
 };
 
+// An observation matches a map reflector if sqrt(d^T * (cov + Qt)^-1 * d) is
+// below it, square root of the 99% chi-square quantile with 2 degrees of freedom
+constexpr double kMapMatchGate = 3.035;
+
+// How S^-1 of the innovation covariance is applied in the kalman gain
+enum InnovationSolver
+{
+  INVERSE,
+  LLT,
+  LDLT
+};
+
 struct EKFOptions
 {
   bool use_imu;
@@ -38,6 +52,40 @@ struct EKFOptions
   double angular_velocity_cov;
   // 0.05 * 0.05
   double observation_cov;
+  // Gyro yaw rate variance, replaces angular_velocity_cov when use_imu
+  double imu_angular_velocity_cov;
+  InnovationSolver innovation_solver;
+  // Use (I - KH) * sigma * (I - KH)^T + K * Q * K^T instead of sigma - K * H * sigma
+  bool use_joseph_form;
+  // Full EKF: update with one matched reflector at a time instead of one stacked
+  // innovation, measurements failing the chi-square gate against the partially
+  // updated state are dropped
+  bool use_sequential_update;
+  // Full EKF: keep the landmark-landmark covariance in float, robot rows stay in
+  // double. Falls back to double when the landmark covariance gets badly
+  // conditioned, which is checked every symmetrize_interval updates.
+  bool use_float_landmark_coviarance;
+  // Symmetrize covariance every n updates, 0 to disable, which also disables
+  // the check of the float landmark covariance
+  int symmetrize_interval;
+  // Landmarks to preallocate state storage for, e.g. reflector number of the site
+  int reserved_landmarks;
+  // Compressed EKF: landmarks within radius of robot form the local region,
+  // which is rebuilt when robot moves farther than switch distance from its center
+  double local_region_radius;
+  double local_region_switch_distance;
+  // Cap on landmarks in state, 0 for unbounded. Beyond it, landmarks not observed
+  // in the scan which are farther than marginalize_distance from robot or whose
+  // largest position variance is below marginalize_coviarance move into the map
+  int max_landmarks;
+  double marginalize_distance;
+  double marginalize_coviarance;
+  // Fixed-lag smoother: robot poses kept in the window and Gauss-Newton iterations per scan
+  int smoother_window_size;
+  int smoother_iterations;
+  // Sparse extended information filter: most landmarks linked to the robot,
+  // means are recovered within local_region_radius of the robot
+  int seif_active_landmarks;
 };
 
 struct State
@@ -47,10 +95,99 @@ struct State
   Eigen::MatrixXd sigma;
 };
 
+// Robot part of State
+struct PoseState
+{
+  double time;
+  // x, y, theta
+  Eigen::Vector3d pose;
+  Eigen::Matrix3d coviarance;
+};
+
+// Landmark means and marginal covariances, shared by snapshots until landmarks
+// change. Landmarks are stored by chunks which are never changed once built,
+// so a new snapshot can share the chunks without changed landmarks with the
+// previous one.
+class LandmarkSnapshot
+{
+public:
+  static constexpr int kChunkSize = 256;
+
+  LandmarkSnapshot() : size_(0) {}
+
+  // Snapshot of landmarks [0, size). Chunks of 'previous' which hold none of
+  // the landmarks 'changed' are shared, the others are filled by
+  // landmark(id, &position, &coviarance). A null 'previous' builds all of them.
+  template <typename LandmarkFunction>
+  static std::shared_ptr<LandmarkSnapshot> Build(const LandmarkSnapshot *previous, const int &size,
+                                                 const std::vector<int> &changed, const LandmarkFunction &landmark)
+  {
+    auto snapshot = std::make_shared<LandmarkSnapshot>();
+    snapshot->size_ = size;
+    const int chunk_number = (size + kChunkSize - 1) / kChunkSize;
+    // Only chunks which are full in both snapshots can be shared
+    std::vector<bool> shared(chunk_number, false);
+    if (previous != nullptr)
+    {
+      for (int c = 0; c < chunk_number && (c + 1) * kChunkSize <= std::min(size, previous->size_); ++c)
+        shared[c] = true;
+      for (const int &id : changed)
+      {
+        if (id < size)
+          shared[id / kChunkSize] = false;
+      }
+    }
+    snapshot->chunks_.resize(chunk_number);
+    for (int c = 0; c < chunk_number; ++c)
+    {
+      if (shared[c])
+      {
+        snapshot->chunks_[c] = previous->chunks_[c];
+        continue;
+      }
+      const int begin = c * kChunkSize;
+      const int end = std::min(size, begin + kChunkSize);
+      auto chunk = std::make_shared<Chunk>();
+      chunk->positions.resize(end - begin);
+      chunk->coviarances.resize(end - begin);
+      for (int id = begin; id < end; ++id)
+        landmark(id, &chunk->positions[id - begin], &chunk->coviarances[id - begin]);
+      snapshot->chunks_[c] = chunk;
+    }
+    return snapshot;
+  }
+
+  int size() const { return size_; }
+  const Eigen::Vector2d &position(const int &id) const { return chunks_[id / kChunkSize]->positions[id % kChunkSize]; }
+  const Eigen::Matrix2d &coviarance(const int &id) const
+  {
+    return chunks_[id / kChunkSize]->coviarances[id % kChunkSize];
+  }
+
+private:
+  struct Chunk
+  {
+    std::vector<Eigen::Vector2d> positions;
+    std::vector<Eigen::Matrix2d> coviarances;
+  };
+
+  int size_;
+  std::vector<std::shared_ptr<const Chunk>> chunks_;
+};
+
+// Immutable copy of what publishers need, without the full covariance
+struct StateSnapshot
+{
+  PoseState robot;
+  std::shared_ptr<const LandmarkSnapshot> landmarks;
+  // Changes whenever GetGlobalMap() does, e.g. when landmarks are moved to the map
+  int map_version;
+};
+
 class ReflectorEKFSLAMInterface
 {
 public:
-  ReflectorEKFSLAMInterface() {}
+  ReflectorEKFSLAMInterface() : map_version_(0) {}
   virtual ~ReflectorEKFSLAMInterface() {}
 
   virtual void HandleOdometryMessage(const sensor::OdometryData &odometry) = 0;
@@ -58,12 +195,66 @@ public:
   virtual void HandleObservationMessage(const sensor::Observation &observation) = 0;
 
   virtual State PredictState(const double &time) = 0;
+  // Like PredictState but only robot pose and its covariance, cost does not depend on map size
+  virtual PoseState PredictPose(const double &time) = 0;
 
-  virtual Eigen::VectorXd &GetStateVector() = 0;
-  virtual Eigen::MatrixXd &GetCoviarance() = 0;
+  virtual Eigen::VectorXd GetStateVector() = 0;
+  virtual Eigen::MatrixXd GetCoviarance() = 0;
   virtual double GetLatestTime() = 0;
   virtual State GetState() = 0;
   virtual sensor::Map GetGlobalMap() = 0;
+  // Apply updates deferred by the filter to the whole state, e.g. before saving map
+  virtual void SyncGlobalState() {}
+  // Whole state as GetState() after SyncGlobalState(), without changing the
+  // filter. Only the stored parts are copied here, the returned function builds
+  // the state and may run on another thread, e.g. to write a checkpoint.
+  // Filters which CanRestoreState() override it, others return no function.
+  virtual std::function<State()> CaptureState()
+  {
+    return std::function<State()>();
+  }
+  // Resume from 'state' and prior 'map', e.g. of a checkpoint. Filters which
+  // can not be rebuilt from a State return false from both.
+  virtual bool CanRestoreState() const
+  {
+    return false;
+  }
+  virtual bool RestoreState(const State & /*state*/, const sensor::Map & /*map*/)
+  {
+    return false;
+  }
+
+  // Latest snapshot published by the filter. Safe to call from any thread while
+  // the filter runs, readers never block it and never see a half updated state.
+  std::shared_ptr<const StateSnapshot> GetSnapshot() const
+  {
+    return std::atomic_load(&snapshot_);
+  }
+
+protected:
+  // Swap in a new snapshot, a null 'landmarks' keeps those of the previous one
+  void PublishSnapshot(const PoseState &robot, std::shared_ptr<const LandmarkSnapshot> landmarks)
+  {
+    auto snapshot = std::make_shared<StateSnapshot>();
+    snapshot->robot = robot;
+    snapshot->landmarks = landmarks;
+    snapshot->map_version = map_version_;
+    if (!snapshot->landmarks)
+    {
+      const auto previous = GetSnapshot();
+      snapshot->landmarks = previous ? previous->landmarks : std::make_shared<LandmarkSnapshot>();
+    }
+    std::atomic_store(&snapshot_, std::shared_ptr<const StateSnapshot>(snapshot));
+  }
+  // Called by filters after changing their global map, published with the next snapshot
+  void MapChanged()
+  {
+    ++map_version_;
+  }
+
+private:
+  std::shared_ptr<const StateSnapshot> snapshot_;
+  int map_version_;
 };
 } // namespace ekf
 
@@ -0,0 +1,79 @@
+#ifndef REFLECTOR_EKF_SLAM_EKF_UPDATE_H
+#define REFLECTOR_EKF_SLAM_EKF_UPDATE_H
+
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <vector>
+
+#include "reflector_ekf_slam/ekf_slam_interface.h"
+#include "reflector_ekf_slam/state_buffer.h"
+
+namespace ekf
+{
+// Rows of the observation jacobian belonging to one measurement. A reflector
+// observation only touches the robot pose (x, y, theta) and at most one
+// landmark (mx, my) of the state vector, so H is stored by blocks instead of
+// a dense 2M x N matrix.
+struct ObservationBlock
+{
+  // rows x 3, jacobian w.r.t. robot pose
+  Eigen::MatrixXd robot_jacobian;
+  // First row of the landmark in the state vector, -1 if no landmark is touched
+  int landmark_index;
+  // rows x 2, jacobian w.r.t. landmark
+  Eigen::MatrixXd landmark_jacobian;
+  // z - z_hat
+  Eigen::VectorXd innovation;
+  // rows x rows observation noise
+  Eigen::MatrixXd noise;
+};
+
+// Odometry model policies of odometry_model.h selected at runtime by 'model',
+// for the backends which are not templated on the model. Input covariance of
+// 'model' in the top left corner of a 3x3 matrix, 2x2 for DIFF.
+Eigen::Matrix3d InputCoviarance(const sensor::OdometryModel &model, const double &linear_velocity_cov,
+                                const double &angular_velocity_cov);
+// Robot motion of 'model' with its noise Q = G_u * Qu * G_u^T, 'Qu' from InputCoviarance()
+void RobotMotion(const double &theta, const Eigen::Vector3d &vt, const double &dt,
+                 const sensor::OdometryModel &model, const Eigen::Matrix3d &Qu, Eigen::Vector3d *delta,
+                 Eigen::Matrix3d *G, Eigen::Matrix3d *Q);
+
+// Returns S^-1 * rhs using the solver selected by 'solver'
+Eigen::MatrixXd SolveInnovation(const Eigen::MatrixXd &S, const Eigen::MatrixXd &rhs,
+                                const InnovationSolver &solver);
+
+// EKF update that only gathers the columns of 'sigma' touched by 'blocks',
+// builds the innovation covariance from them and applies the symmetric
+// covariance downdate in place. Equal to the dense update
+//   K = sigma * H^T * (H * sigma * H^T + Q)^-1
+//   mu += K * (z - z_hat), sigma -= K * H * sigma
+// S^-1 is applied as selected by 'options.innovation_solver', and the
+// covariance update is written to the lower triangle only (Joseph form if
+// 'options.use_joseph_form'). Robot heading is not normalized here.
+void SparseUpdate(const std::vector<ObservationBlock> &blocks, const EKFOptions &options,
+                  Eigen::Ref<Eigen::VectorXd> mu, Eigen::Ref<Eigen::MatrixXd> sigma);
+// Same on 'state', in either of its storages. In mixed precision the update is
+// computed in double and the landmark block is rounded to float once.
+void SparseUpdate(const std::vector<ObservationBlock> &blocks, const EKFOptions &options, StateBuffer *state);
+
+// 99% quantile of the chi-square distribution with 'dof' (1 to 3) degrees of freedom
+double ChiSquareGate(const int &dof);
+
+// EKF update that applies 'blocks' one at a time, each as a rank-r update
+// (r = 2 for a reflector) which only needs the r x r inverse of its own
+// innovation covariance. The innovation of a block is corrected by
+// H * (mu - mu_prior) for the updates applied before it, so without gating
+// the result equals SparseUpdate. A block whose squared mahalanobis distance
+// to the partially updated state exceeds ChiSquareGate(r) is dropped.
+// Returns the number of dropped blocks. 'options.innovation_solver' is not
+// used, 'options.use_joseph_form' is.
+int SequentialUpdate(const std::vector<ObservationBlock> &blocks, const EKFOptions &options,
+                     Eigen::Ref<Eigen::VectorXd> mu, Eigen::Ref<Eigen::MatrixXd> sigma);
+int SequentialUpdate(const std::vector<ObservationBlock> &blocks, const EKFOptions &options, StateBuffer *state);
+
+// sigma = (sigma + sigma^T) / 2, removes asymmetry accumulated by rounding
+void Symmetrize(Eigen::Ref<Eigen::MatrixXd> sigma);
+
+} // namespace ekf
+
+#endif // REFLECTOR_EKF_SLAM_EKF_UPDATE_H
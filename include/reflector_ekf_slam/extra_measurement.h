@@ -0,0 +1,30 @@
+#ifndef REFLECTOR_EKF_SLAM_EXTRA_MEASUREMENT_H
+#define REFLECTOR_EKF_SLAM_EXTRA_MEASUREMENT_H
+
+#include <vector>
+
+#include "reflector_ekf_slam/ekf_update.h"
+
+namespace ekf
+{
+// Measurement policies of the filter, adding observation blocks besides the
+// reflector ones to the update of a scan. 'mu' is the state before the update.
+
+struct NoExtraMeasurement
+{
+  static void AddBlocks(const sensor::Observation &observation, const Eigen::Ref<const Eigen::VectorXd> &mu,
+                        std::vector<ObservationBlock> *blocks)
+  {
+  }
+};
+
+// Robot pose from matching the scan against the grid map (observation.gps_pose_),
+// directly observes x, y, theta
+struct GpsPoseMeasurement
+{
+  static void AddBlocks(const sensor::Observation &observation, const Eigen::Ref<const Eigen::VectorXd> &mu,
+                        std::vector<ObservationBlock> *blocks);
+};
+} // namespace ekf
+
+#endif // REFLECTOR_EKF_SLAM_EXTRA_MEASUREMENT_H
@@ -0,0 +1,51 @@
+#ifndef REFLECTOR_EKF_SLAM_IMU_PREINTEGRATION_H
+#define REFLECTOR_EKF_SLAM_IMU_PREINTEGRATION_H
+
+#include <Eigen/Core>
+#include <Eigen/Dense>
+
+#include "sensor/sensor_data.h"
+
+namespace ekf
+{
+// Robot motion since the last filter prediction from odometry linear velocity
+// and gyro yaw rate, folded into one relative pose in the robot frame at the
+// start of the interval and its 3x3 covariance. Every sample only costs 3x3
+// products, the filter applies the whole interval at once with Motion(). Both
+// velocities are held until the next sample of the same kind.
+class ImuPreintegration
+{
+public:
+  // Only vx is used for DIFF. 'angular_velocity_cov' is the variance of the gyro yaw rate.
+  ImuPreintegration(const sensor::OdometryModel &odom_model, const double &linear_velocity_cov,
+                    const double &angular_velocity_cov);
+
+  // Starts an empty interval at 'time', the held velocities are kept
+  void Reset(const double &time);
+  void SetLinearVelocity(const Eigen::Vector2d &velocity) { velocity_ = velocity; }
+  void SetAngularVelocity(const double &yaw_rate) { yaw_rate_ = yaw_rate; }
+  // Extends the interval to 'time' with the held velocities, earlier times are ignored
+  void Integrate(const double &time);
+
+  // Like OdometryModel::Motion for a robot at heading 'theta': pose increment,
+  // jacobian G w.r.t. robot pose and the motion noise of the interval
+  void Motion(const double &theta, Eigen::Vector3d *delta, Eigen::Matrix3d *G, Eigen::Matrix3d *Q) const;
+
+  double time() const { return time_; }
+  // x, y, theta in robot frame at the start of the interval
+  const Eigen::Vector3d &delta() const { return delta_; }
+  const Eigen::Matrix3d &coviarance() const { return coviarance_; }
+
+private:
+  // vx vy w
+  Eigen::Matrix3d Qu_;
+  bool omni_;
+  Eigen::Vector2d velocity_;
+  double yaw_rate_;
+  double time_;
+  Eigen::Vector3d delta_;
+  Eigen::Matrix3d coviarance_;
+};
+} // namespace ekf
+
+#endif // REFLECTOR_EKF_SLAM_IMU_PREINTEGRATION_H
@@ -0,0 +1,54 @@
+#ifndef REFLECTOR_EKF_SLAM_LANDMARK_INDEX_H
+#define REFLECTOR_EKF_SLAM_LANDMARK_INDEX_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Dense>
+
+namespace ekf
+{
+// Largest distance at which an observation is associated with a state landmark
+constexpr double kStateMatchDistance = 0.6;
+
+// Association radius of a landmark: the 99% chi-square gate of 'coviarance', the
+// covariance of the predicted landmark position in global frame (landmark,
+// robot position and observation), capped to kStateMatchDistance
+double LandmarkMatchRadius(const Eigen::Matrix2d &coviarance);
+
+// Uniform grid hash over the means of the landmarks in state. The mean of a
+// landmark is re-indexed only when it moved more than 'slack' from its indexed
+// position, so refreshing after an update is cheap, and queries widen their
+// radius by 'slack' to stay exact.
+class LandmarkIndex
+{
+public:
+  LandmarkIndex(const double &resolution = kStateMatchDistance, const double &slack = 0.1);
+
+  void Clear();
+  // Adds landmark 'id' or moves it to 'position', ids must be added in order
+  void Update(const int &id, const Eigen::Vector2d &position);
+  // Appends landmarks which may lie within 'radius' of 'point'
+  void Query(const Eigen::Vector2d &point, const double &radius, std::vector<int> *ids) const;
+
+  int Size() const { return positions_.size(); }
+  double Slack() const { return slack_; }
+
+private:
+  using KeyType = int64_t;
+
+  KeyType GetCellKey(const Eigen::Vector2d &position) const;
+  static KeyType IndexToKey(const int &x, const int &y);
+  int GetCellIndex(const double &value) const;
+
+  double resolution_;
+  double slack_;
+  std::unordered_map<KeyType, std::vector<int>> cells_;
+  // Indexed position of every landmark
+  std::vector<Eigen::Vector2d> positions_;
+};
+} // namespace ekf
+
+#endif // REFLECTOR_EKF_SLAM_LANDMARK_INDEX_H
@@ -0,0 +1,83 @@
+#ifndef REFLECTOR_EKF_SLAM_ODOMETRY_MODEL_H
+#define REFLECTOR_EKF_SLAM_ODOMETRY_MODEL_H
+
+#include <cmath>
+
+#include <Eigen/Core>
+#include <Eigen/Dense>
+
+namespace ekf
+{
+// Odometry model policies of the filter. Each one gives the robot motion over
+// 'dt' with odometry velocity 'vt' = (vx, vy, w) starting at heading 'theta':
+// the pose increment, the jacobian G w.r.t. robot pose and the jacobian G_u
+// w.r.t. the velocity inputs, all in fixed-size types.
+
+// Differential drive, inputs are (vx, w) and the robot moves along the mean
+// heading of the interval
+struct DiffOdometryModel
+{
+  static constexpr int kInputSize = 2;
+  using InputJacobian = Eigen::Matrix<double, 3, kInputSize>;
+  using InputCoviarance = Eigen::Matrix<double, kInputSize, kInputSize>;
+
+  static InputCoviarance Coviarance(const double &linear_velocity_cov, const double &angular_velocity_cov)
+  {
+    InputCoviarance Qu;
+    Qu << linear_velocity_cov, 0.,
+        0., angular_velocity_cov;
+    return Qu;
+  }
+
+  static void Motion(const double &theta, const Eigen::Vector3d &vt, const double &dt,
+                     Eigen::Vector3d *delta, Eigen::Matrix3d *G, InputJacobian *G_u)
+  {
+    const double delta_theta = vt.z() * dt;
+    const double angular_half_delta = theta + delta_theta / 2;
+    const double cos_theta = std::cos(angular_half_delta);
+    const double sin_theta = std::sin(angular_half_delta);
+    *delta << vt.x() * dt * cos_theta, vt.x() * dt * sin_theta, delta_theta;
+    *G << 1., 0., -vt.x() * dt * sin_theta,
+        0., 1., vt.x() * dt * cos_theta,
+        0., 0., 1.;
+    *G_u << dt * cos_theta, -vt.x() * dt * dt * sin_theta / 2,
+        dt * sin_theta, vt.x() * dt * dt * cos_theta / 2,
+        0., dt;
+  }
+};
+
+// Omnidirectional, inputs are (vx, vy, w) in robot frame
+struct OmniOdometryModel
+{
+  static constexpr int kInputSize = 3;
+  using InputJacobian = Eigen::Matrix<double, 3, kInputSize>;
+  using InputCoviarance = Eigen::Matrix<double, kInputSize, kInputSize>;
+
+  static InputCoviarance Coviarance(const double &linear_velocity_cov, const double &angular_velocity_cov)
+  {
+    InputCoviarance Qu;
+    Qu << linear_velocity_cov, 0., 0.,
+        0., linear_velocity_cov, 0.,
+        0., 0., angular_velocity_cov;
+    return Qu;
+  }
+
+  static void Motion(const double &theta, const Eigen::Vector3d &vt, const double &dt,
+                     Eigen::Vector3d *delta, Eigen::Matrix3d *G, InputJacobian *G_u)
+  {
+    const double cos_theta = std::cos(theta);
+    const double sin_theta = std::sin(theta);
+    *delta << vt.x() * dt * cos_theta - vt.y() * dt * sin_theta,
+        vt.x() * dt * sin_theta + vt.y() * dt * cos_theta,
+        vt.z() * dt;
+    *G << 1., 0., -vt.x() * dt * sin_theta - vt.y() * dt * cos_theta,
+        0., 1., vt.x() * dt * cos_theta - vt.y() * dt * sin_theta,
+        0., 0., 1.;
+    *G_u << dt * cos_theta, -dt * sin_theta, 0.,
+        dt * sin_theta, dt * cos_theta, 0.,
+        0., 0., dt;
+  }
+};
+} // namespace ekf
+
+#endif // REFLECTOR_EKF_SLAM_ODOMETRY_MODEL_H
@@ -0,0 +1,71 @@
+#ifndef REFLECTOR_EKF_SLAM_POSE_HYPOTHESIS_BANK_H
+#define REFLECTOR_EKF_SLAM_POSE_HYPOTHESIS_BANK_H
+
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Dense>
+
+#include "common/thread_pool.h"
+#include "reflector_ekf_slam/ekf_slam_interface.h"
+#include "sensor/reflector_map_index.h"
+#include "sensor/sensor_data.h"
+
+namespace ekf
+{
+struct PoseHypothesis
+{
+  Eigen::Vector3d pose;
+  Eigen::Matrix3d coviarance;
+  // Sum over scans of the log likelihood of the observed reflectors
+  double log_likelihood;
+  // Reflectors matched in the last scan
+  int matched;
+};
+
+// Bank of pose only EKFs localizing against a prior map when the start pose is
+// uncertain or the reflector layout is symmetric. Every hypothesis owns its
+// 3x3 covariance, the map and its index are shared read only, and hypotheses
+// are predicted and updated in parallel on a thread pool. After each scan
+// hypotheses far less likely than the best one are pruned and those which
+// converged to the same pose are merged, until one dominates.
+class PoseHypothesisBank
+{
+public:
+  // 'map' and 'map_index' must outlive the bank, 'num_threads' as in common::ThreadPool
+  PoseHypothesisBank(const EKFOptions &options, const sensor::Map &map, const sensor::ReflectorMapIndex &map_index,
+                     const int &num_threads);
+
+  // Replaces the hypotheses by one at each of 'poses' with 'coviarance' at 'time'
+  void Reset(const double &time, const std::vector<Eigen::Vector3d> &poses, const Eigen::Matrix3d &coviarance);
+  void HandleOdometryMessage(const sensor::OdometryData &odometry);
+  void HandleObservationMessage(const sensor::Observation &observation);
+
+  // Most likely hypothesis if its weight is at least 'dominance' after
+  // 'min_scans' scans and it matched at least 'min_matched' reflectors last scan
+  bool GetDominant(const double &dominance, const int &min_scans, const int &min_matched, PoseState *state) const;
+
+  int Size() const { return hypotheses_.size(); }
+  const std::vector<PoseHypothesis> &hypotheses() const { return hypotheses_; }
+
+private:
+  void Predict(const double &dt);
+  void Update(const sensor::PointCloud &observed, PoseHypothesis *hypothesis) const;
+  // Drops unlikely hypotheses and merges those at the same pose
+  void Prune();
+
+  EKFOptions options_;
+  const sensor::Map &map_;
+  const sensor::ReflectorMapIndex &map_index_;
+  double time_;
+  // include vx vy(maybe not exist) w
+  Eigen::Vector3d vt_;
+  Eigen::MatrixXd Qu_;
+  Eigen::Matrix2d Qt_;
+  std::vector<PoseHypothesis> hypotheses_;
+  int scans_;
+  common::ThreadPool thread_pool_;
+};
+} // namespace ekf
+
+#endif // REFLECTOR_EKF_SLAM_POSE_HYPOTHESIS_BANK_H
@@ -0,0 +1,130 @@
+#ifndef REFLECTOR_EKF_SLAM_REFLECTOR_COMPRESSED_EKF_SLAM_H
+#define REFLECTOR_EKF_SLAM_REFLECTOR_COMPRESSED_EKF_SLAM_H
+
+#include <iostream>
+#include <vector>
+#include <fstream>
+#include <string>
+
+#include "reflector_ekf_slam/ekf_slam_interface.h"
+#include "reflector_ekf_slam/ekf_update.h"
+#include "reflector_ekf_slam/imu_preintegration.h"
+#include "reflector_ekf_slam/landmark_index.h"
+#include "reflector_ekf_slam/state_buffer.h"
+#include "sensor/reflector_map_index.h"
+
+namespace ekf
+{
+// Compressed EKF (Guivant & Nebot): prediction and updates only touch the
+// robot pose and the landmarks of the local region around the robot (A). The
+// effect on the other landmarks (B) is accumulated in
+//   phi:   P_AB = phi * P_A0B
+//   psi:   P_BB = P_BB - P_BA0 * psi * P_A0B
+//   theta: X_B = X_B + P_BA0 * theta
+// and propagated to the whole state only when the robot leaves the region or
+// SyncGlobalState() is called, so per-scan cost depends on the local landmark
+// density instead of the map size.
+class ReflectorCompressedEKFSLAM : public ReflectorEKFSLAMInterface
+{
+public:
+  ReflectorCompressedEKFSLAM(const EKFOptions &options);
+  ReflectorCompressedEKFSLAM() = delete;
+  ~ReflectorCompressedEKFSLAM() override;
+
+  void HandleOdometryMessage(const sensor::OdometryData &odometry) override;
+  void HandleImuMessage(const sensor::ImuData &imu) override;
+  void HandleObservationMessage(const sensor::Observation &observation) override;
+  State PredictState(const double &time) override;
+  PoseState PredictPose(const double &time) override;
+
+  Eigen::VectorXd GetStateVector() override
+  {
+    return GetState().mu;
+  }
+  Eigen::MatrixXd GetCoviarance() override
+  {
+    return GetState().sigma;
+  }
+  double GetLatestTime() override
+  {
+    return state_.time();
+  }
+  // Local region is up to date, other landmarks lag until the next SyncGlobalState()
+  State GetState() override;
+  sensor::Map GetGlobalMap() override
+  {
+    return map_;
+  }
+  void SyncGlobalState() override;
+  // The deferred updates are applied to a copy by the returned function
+  std::function<State()> CaptureState() override;
+  bool CanRestoreState() const override
+  {
+    return true;
+  }
+  bool RestoreState(const State &state, const sensor::Map &map) override;
+
+private:
+  ReflectorMatchResult ReflectorMatch(const sensor::Observation &obs);
+  // Publish robot pose, and landmarks too if they changed since the last snapshot
+  void UpdateSnapshot(const bool &landmarks_changed);
+  void Predict(const double &dt);
+  // Predicts to 'time' with the IMU preintegrated since the last prediction
+  void PredictPreintegrated(const double &time);
+  // Robot motion from the state time to 'time' starting at heading 'theta', by
+  // odometry or by the preintegrated IMU, with motion noise 'Q'
+  void MotionTo(const double &time, const double &theta, Eigen::Vector3d *delta, Eigen::Matrix3d *G,
+                Eigen::Matrix3d *Q) const;
+  void ApplyMotion(const Eigen::Vector3d &delta, const Eigen::Matrix3d &G, const Eigen::Matrix3d &Q);
+  // Select landmarks near robot as local region, 'landmark_ids' are always included.
+  // Global state must be synchronized.
+  void BeginLocalRegion(const std::vector<int> &landmark_ids);
+  void LocalUpdate(const std::vector<ObservationBlock> &blocks);
+  void AddLandmarks(const sensor::Observation &observation, const std::vector<int> &new_ids);
+  Eigen::Vector2d LandmarkPosition(const int &id) const;
+  // Association radius of state landmark 'id'
+  double LandmarkMatchRadius(const int &id) const;
+  void UpdateLandmarkIndex(const std::vector<int> &landmark_ids);
+  // Row in whole state of the 'i'th local row
+  int LocalToGlobalRow(const int &i) const;
+  // LocalToGlobalRow() of every local row
+  std::vector<int> LocalRows() const;
+  int LandmarkNumber() const
+  {
+    return local_slots_.size();
+  }
+
+  EKFOptions options_;
+
+  // include vx vy(maybe not exist) w
+  Eigen::Vector3d vt_;
+
+  // Input covariance of the odometry model, see InputCoviarance()
+  Eigen::Matrix3d Qu_;
+  Eigen::Matrix2d Qt_;
+  // Motion since the state time when use_imu
+  ImuPreintegration preintegration_;
+
+  // Whole state, stale for the local region until synchronized
+  StateBuffer state_;
+  // Local state: robot pose followed by local landmarks
+  Eigen::VectorXd local_mu_;
+  Eigen::MatrixXd local_sigma_;
+  // Landmark ids of local region in local order
+  std::vector<int> local_landmarks_;
+  // Local order of every landmark, -1 if not in local region
+  std::vector<int> local_slots_;
+  // Local dimension when the region began, phi columns correspond to it
+  int anchored_dimension_;
+  Eigen::MatrixXd phi_;
+  Eigen::MatrixXd psi_;
+  Eigen::VectorXd theta_;
+  Eigen::Vector2d region_center_;
+  int update_count_;
+
+  sensor::Map map_;
+  sensor::ReflectorMapIndex map_index_;
+  LandmarkIndex landmark_index_;
+};
+} // namespace ekf
+#endif // REFLECTOR_EKF_SLAM_REFLECTOR_COMPRESSED_EKF_SLAM_H
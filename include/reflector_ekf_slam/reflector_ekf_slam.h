@@ -7,9 +7,21 @@
 #include <string>
 
 #include "reflector_ekf_slam/ekf_slam_interface.h"
+#include "reflector_ekf_slam/extra_measurement.h"
+#include "reflector_ekf_slam/imu_preintegration.h"
+#include "reflector_ekf_slam/landmark_index.h"
+#include "reflector_ekf_slam/odometry_model.h"
+#include "reflector_ekf_slam/state_buffer.h"
+#include "sensor/reflector_map_index.h"
 
 namespace ekf
 {
+// Full EKF SLAM over the robot pose and all landmarks. The robot motion is
+// given by an odometry model policy (odometry_model.h) and other measurements
+// than reflectors by an extra measurement policy (extra_measurement.h), so the
+// robot block math is done with fixed-size types. Instantiated for DIFF and
+// OMNI with and without the scan matching pose, see CreateReflectorEKFSLAM().
+template <typename OdometryModel, typename ExtraMeasurement = NoExtraMeasurement>
 class ReflectorEKFSLAM : public ReflectorEKFSLAMInterface
 {
 public:
@@ -21,46 +33,87 @@ public:
   void HandleImuMessage(const sensor::ImuData &imu) override;
   void HandleObservationMessage(const sensor::Observation &observation) override;
   State PredictState(const double &time) override;
+  PoseState PredictPose(const double &time) override;
 
-  Eigen::VectorXd &GetStateVector() override
+  Eigen::VectorXd GetStateVector() override
   {
-    return state_.mu;
+    return state_.mu();
   }
-  Eigen::MatrixXd &GetCoviarance() override
+  Eigen::MatrixXd GetCoviarance() override
   {
-    return state_.sigma;
+    return GetState().sigma;
   }
   double GetLatestTime() override
   {
-    return state_.time;
-  }
-  State GetState() override
-  {
-    return state_;
+    return state_.time();
   }
+  State GetState() override;
   sensor::Map GetGlobalMap() override
   {
     return map_;
   }
+  // The stored state and the pending motion are copied, the returned function
+  // converts the covariance and applies the motion
+  std::function<State()> CaptureState() override;
+  bool CanRestoreState() const override
+  {
+    return true;
+  }
+  bool RestoreState(const State &state, const sensor::Map &map) override;
 
 private:
-  void LoadMapFromTxtFile(const std::string &file);
-
   ReflectorMatchResult ReflectorMatch(const sensor::Observation &obs);
+  // Publish robot pose, and landmarks too if they changed since the last snapshot
+  void UpdateSnapshot(const bool &landmarks_changed);
   void Predict(const double &dt);
+  // Predicts to 'time' with the IMU preintegrated since the last prediction
+  void PredictPreintegrated(const double &time);
+  // Robot motion from the state time to 'time' starting at heading 'theta', by
+  // odometry or by the preintegrated IMU, as OdometryModel::Motion with noise 'Q'
+  void MotionTo(const double &time, const double &theta, Eigen::Vector3d *delta, Eigen::Matrix3d *G,
+                Eigen::Matrix3d *Q) const;
+  void ApplyMotion(const Eigen::Vector3d &delta, const Eigen::Matrix3d &G, const Eigen::Matrix3d &Q);
+  // Apply the motion composed since the last flush to robot-landmark block of 'sigma'
+  static void ApplyPendingMotion(const Eigen::Matrix3d &pending_motion, Eigen::Ref<Eigen::MatrixXd> sigma);
+  void FlushPendingMotion();
+  // Move mature landmarks into map when state exceeds max_landmarks
+  void MarginalizeLandmarks(const ReflectorMatchResult &result);
+  // Sweep all landmarks, re-indexing those whose means moved and newly added ones
+  void UpdateLandmarkIndex();
+  // Re-index the landmarks matched by 'result' and newly added ones. The others
+  // are only swept once landmark_drift_ exceeds the slack of the index.
+  void UpdateLandmarkIndex(const ReflectorMatchResult &result);
+  // Association radius of state landmark 'id'
+  double LandmarkMatchRadius(const int &id) const;
 
   EKFOptions options_;
 
   // include vx vy(maybe not exist) w
   Eigen::Vector3d vt_;
 
-  Eigen::MatrixXd Qu_;
+  typename OdometryModel::InputCoviarance Qu_;
   Eigen::Matrix2d Qt_;
+  // Motion since the state time when use_imu
+  ImuPreintegration preintegration_;
 
   /* 求解的扩展状态 均值 和 协方差 */
-  State state_;
+  StateBuffer state_;
+  // Robot motion jacobians composed since the last flush, robot-landmark block
+  // of state_.robot_rows() is stale until it is applied
+  Eigen::Matrix3d pending_motion_;
+  // Number of updates, for periodic symmetrization
+  int update_count_;
+  // Bound of how far landmarks moved since the last sweep of landmark_index_,
+  // queries of the index are widened by it
+  double landmark_drift_;
 
   sensor::Map map_;
+  sensor::ReflectorMapIndex map_index_;
+  LandmarkIndex landmark_index_;
 };
+
+// Full EKF for the odometry model of 'options', with the scan matching pose
+// (observation.gps_pose_) as extra measurement if 'use_gps_pose'
+std::unique_ptr<ReflectorEKFSLAMInterface> CreateReflectorEKFSLAM(const EKFOptions &options, const bool &use_gps_pose);
 } // namespace ekf
 #endif // REFLECTOR_EKF_SLAM_REFLECTOR_EKF_SLAM_H
@@ -0,0 +1,181 @@
+#ifndef REFLECTOR_EKF_SLAM_REFLECTOR_FIXED_LAG_SMOOTHER_H
+#define REFLECTOR_EKF_SLAM_REFLECTOR_FIXED_LAG_SMOOTHER_H
+
+#include <deque>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+
+#include "reflector_ekf_slam/ekf_slam_interface.h"
+#include "reflector_ekf_slam/landmark_index.h"
+#include "sensor/reflector_map_index.h"
+
+namespace ekf
+{
+// Fixed-lag square-root information smoother, the sliding window alternative
+// to the EKF backends. The window holds the robot poses of the last
+// 'smoother_window_size' scans and the landmarks they observe. Odometry
+// between two scans is a relative pose factor, and every matched reflector is
+// a pose-landmark factor, or a pose-only factor for map reflectors. Each scan
+// relinearizes the window and solves it by sparse cholesky of its information
+// matrix. The oldest pose is then marginalized into a prior over its
+// neighbours, kept in square-root form || e + R * (x - x_lin) ||^2. Landmarks
+// no longer observed by the window move into the map with their marginal
+// covariance, so per-scan cost depends on the window instead of the map size.
+// State and snapshots hold the latest pose and the landmarks of the window.
+// Motion comes from odometry only, use_imu must be off.
+class ReflectorFixedLagSmoother : public ReflectorEKFSLAMInterface
+{
+public:
+  ReflectorFixedLagSmoother(const EKFOptions &options);
+  ReflectorFixedLagSmoother() = delete;
+  ~ReflectorFixedLagSmoother() override;
+
+  void HandleOdometryMessage(const sensor::OdometryData &odometry) override;
+  void HandleImuMessage(const sensor::ImuData &imu) override;
+  void HandleObservationMessage(const sensor::Observation &observation) override;
+  State PredictState(const double &time) override;
+  PoseState PredictPose(const double &time) override;
+
+  Eigen::VectorXd GetStateVector() override
+  {
+    return GetState().mu;
+  }
+  Eigen::MatrixXd GetCoviarance() override
+  {
+    return GetState().sigma;
+  }
+  double GetLatestTime() override
+  {
+    return time_;
+  }
+  State GetState() override;
+  sensor::Map GetGlobalMap() override
+  {
+    return map_;
+  }
+
+private:
+  // Robot pose by id, or landmark of the window by id
+  struct Variable
+  {
+    bool is_pose;
+    int id;
+  };
+  // Odometry from pose 'pose_id' to pose 'pose_id' + 1 in the frame of the first
+  struct OdometryFactor
+  {
+    int pose_id;
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d sqrt_information;
+  };
+  // Reflector observed at 'observation' in robot frame from pose 'pose_id'
+  struct ReflectorFactor
+  {
+    int pose_id;
+    // Landmark id of the window, or map reflector id if 'map_reflector'
+    int landmark_id;
+    bool map_reflector;
+    Eigen::Vector2d observation;
+  };
+  // || residual + sqrt_information * (x - linearization) ||^2 over 'variables'
+  struct Prior
+  {
+    std::vector<Variable> variables;
+    Eigen::VectorXd linearization;
+    Eigen::MatrixXd sqrt_information;
+    Eigen::VectorXd residual;
+  };
+  // Whitened residual of a factor and its jacobian w.r.t. each of its variables
+  struct Linearization
+  {
+    Eigen::VectorXd residual;
+    std::vector<Variable> variables;
+    std::vector<Eigen::MatrixXd> jacobians;
+  };
+
+  ReflectorMatchResult ReflectorMatch(const sensor::Observation &obs);
+  // Publish robot pose, and landmarks too if they changed since the last snapshot
+  void UpdateSnapshot(const bool &landmarks_changed);
+  // Integrate odometry since the latest pose of the window
+  void Predict(const double &dt);
+  // Latest pose of the window composed with the odometry since then
+  Eigen::Vector3d CurrentPose() const;
+  Eigen::Matrix3d CurrentPoseCoviarance() const;
+  // Jacobians of CurrentPose() w.r.t. the latest pose and the odometry since then
+  void CompositionJacobians(Eigen::Matrix3d *J_pose, Eigen::Matrix3d *J_delta) const;
+  // Append a pose at CurrentPose() linked to the previous one by odometry
+  void AddPose();
+
+  Linearization LinearizePrior() const;
+  Linearization LinearizeOdometry(const OdometryFactor &factor) const;
+  Linearization LinearizeReflector(const ReflectorFactor &factor) const;
+  // Information matrix J^T * J and gradient J^T * e of the window at the current estimate
+  void BuildInformation(Eigen::SparseMatrix<double> *information, Eigen::VectorXd *gradient) const;
+  // Gauss-Newton on the window
+  void Solve();
+  void UpdateCoviarance();
+  // Schur complement of 'removed' out of 'factors', which replaces the prior
+  void Marginalize(const std::vector<Variable> &removed, const std::vector<Linearization> &factors);
+  // Marginalize the oldest pose, and move landmarks it leaves unobserved into the map
+  void MarginalizeOldestPose();
+  void RemoveLandmarks(const std::vector<int> &landmark_ids);
+  void UpdateLandmarkIndex();
+  // Association radius of window landmark 'id'
+  double LandmarkMatchRadius(const int &id) const;
+
+  int Dimension(const Variable &variable) const
+  {
+    return variable.is_pose ? 3 : 2;
+  }
+  // Column of 'variable' in the window, poses first, oldest first
+  int Column(const Variable &variable) const;
+  Eigen::VectorXd Value(const Variable &variable) const;
+  int PoseNumber() const
+  {
+    return poses_.size();
+  }
+  int LandmarkNumber() const
+  {
+    return landmarks_.size();
+  }
+  int WindowDimension() const
+  {
+    return 3 * PoseNumber() + 2 * LandmarkNumber();
+  }
+
+  EKFOptions options_;
+  double time_;
+
+  // include vx vy(maybe not exist) w
+  Eigen::Vector3d vt_;
+
+  // Input covariance of the odometry model, see InputCoviarance()
+  Eigen::Matrix3d Qu_;
+  Eigen::Matrix2d Qt_;
+  Eigen::Matrix2d observation_sqrt_information_;
+
+  // Poses of the window, oldest first, the oldest has id 'first_pose_id_'
+  std::deque<Eigen::Vector3d> poses_;
+  int first_pose_id_;
+  std::vector<Eigen::Vector2d> landmarks_;
+  // Both in increasing pose id
+  std::deque<OdometryFactor> odometry_factors_;
+  std::deque<ReflectorFactor> reflector_factors_;
+  Prior prior_;
+  // Covariance of the window at the last solve, in Column() order
+  Eigen::MatrixXd coviarance_;
+
+  // Odometry since the latest pose of the window, in its frame
+  Eigen::Vector3d odometry_delta_;
+  Eigen::Matrix3d odometry_coviarance_;
+
+  sensor::Map map_;
+  sensor::ReflectorMapIndex map_index_;
+  LandmarkIndex landmark_index_;
+};
+} // namespace ekf
+
+#endif // REFLECTOR_EKF_SLAM_REFLECTOR_FIXED_LAG_SMOOTHER_H
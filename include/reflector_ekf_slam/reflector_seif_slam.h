@@ -0,0 +1,129 @@
+#ifndef REFLECTOR_EKF_SLAM_REFLECTOR_SEIF_SLAM_H
+#define REFLECTOR_EKF_SLAM_REFLECTOR_SEIF_SLAM_H
+
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Dense>
+
+#include "reflector_ekf_slam/ekf_slam_interface.h"
+#include "reflector_ekf_slam/landmark_index.h"
+#include "sensor/reflector_map_index.h"
+
+namespace ekf
+{
+// Sparse extended information filter (Thrun et al.) for maps too large for a
+// dense covariance. The state is kept as information matrix omega and vector
+// xi = omega * mu, stored by 2x2 and 3x2 blocks, so memory grows with the
+// links between variables instead of the square of the map size:
+// - motion only changes the robot and the landmarks linked to it (active),
+// - a reflector observation adds information to the robot and one landmark,
+// - the weakest robot-landmark links are removed when more than
+//   'seif_active_landmarks' landmarks are active (sparsification),
+// - after every scan the means of the robot, the active landmarks and the
+//   landmarks within 'local_region_radius' are recovered by solving their
+//   block with the other means fixed, which also gives the approximate
+//   covariances used for association and snapshots.
+// GetState() inverts the whole information matrix and is only meant for
+// small maps, SyncGlobalState() recovers all means exactly. Motion comes from
+// odometry only, use_imu must be off.
+class ReflectorSEIFSLAM : public ReflectorEKFSLAMInterface
+{
+public:
+  ReflectorSEIFSLAM(const EKFOptions &options);
+  ReflectorSEIFSLAM() = delete;
+  ~ReflectorSEIFSLAM() override;
+
+  void HandleOdometryMessage(const sensor::OdometryData &odometry) override;
+  void HandleImuMessage(const sensor::ImuData &imu) override;
+  void HandleObservationMessage(const sensor::Observation &observation) override;
+  State PredictState(const double &time) override;
+  PoseState PredictPose(const double &time) override;
+
+  Eigen::VectorXd GetStateVector() override
+  {
+    return GetState().mu;
+  }
+  Eigen::MatrixXd GetCoviarance() override
+  {
+    return GetState().sigma;
+  }
+  double GetLatestTime() override
+  {
+    return time_;
+  }
+  State GetState() override;
+  sensor::Map GetGlobalMap() override
+  {
+    return map_;
+  }
+  void SyncGlobalState() override;
+
+private:
+  using RobotLandmarkBlock = Eigen::Matrix<double, 3, 2>;
+
+  ReflectorMatchResult ReflectorMatch(const sensor::Observation &obs);
+  // Publish robot pose, and landmarks too if they changed since the last snapshot
+  void UpdateSnapshot(const bool &landmarks_changed);
+  void Predict(const double &dt);
+  // Adds the information of reflector 'observed' in robot frame, linearized at
+  // 'position' of landmark 'id', or of a fixed map reflector if 'id' is -1
+  void AddReflectorInformation(const Eigen::Vector2d &observed, const int &id, const Eigen::Vector2d &position);
+  // New landmark at 'observed' in robot frame, returns its id
+  int AddLandmark(const Eigen::Vector2d &observed);
+  // Deactivate the weakest robot links until at most 'seif_active_landmarks' stay,
+  // landmarks in 'observed' are kept
+  void Sparsify(const std::vector<int> &observed);
+  void RecoverLocalMeans();
+  // Dense information, information vector and mean of robot followed by landmarks 'ids'
+  Eigen::MatrixXd BlockInformation(const std::vector<int> &ids) const;
+  Eigen::VectorXd BlockInformationVector(const std::vector<int> &ids) const;
+  Eigen::VectorXd BlockMean(const std::vector<int> &ids) const;
+  // Writes back the blocks of BlockInformation(ids), zero links are removed
+  void SetBlockInformation(const std::vector<int> &ids, const Eigen::MatrixXd &omega);
+  void SetBlockInformationVector(const std::vector<int> &ids, const Eigen::VectorXd &xi);
+  std::vector<int> ActiveLandmarks() const;
+  // Association radius of landmark 'id'
+  double LandmarkMatchRadius(const int &id) const;
+  int LandmarkNumber() const
+  {
+    return mu_m_.size();
+  }
+
+  EKFOptions options_;
+  double time_;
+
+  // include vx vy(maybe not exist) w
+  Eigen::Vector3d vt_;
+
+  // Input covariance of the odometry model, see InputCoviarance()
+  Eigen::Matrix3d Qu_;
+  Eigen::Matrix2d Qt_;
+  Eigen::Matrix2d Qt_inverse_;
+
+  // Information matrix by blocks: robot, robot-landmark links of active
+  // landmarks, landmark diagonal and landmark-landmark links, stored both ways
+  Eigen::Matrix3d omega_xx_;
+  std::map<int, RobotLandmarkBlock> omega_xm_;
+  std::vector<Eigen::Matrix2d> omega_mm_;
+  std::vector<std::unordered_map<int, Eigen::Matrix2d>> omega_links_;
+  Eigen::Vector3d xi_x_;
+  std::vector<Eigen::Vector2d> xi_m_;
+  // Means, only those of the last local recovery are up to date
+  Eigen::Vector3d mu_x_;
+  std::vector<Eigen::Vector2d> mu_m_;
+  // Covariances of the local block at its last recovery, robot one is propagated by motion
+  Eigen::Matrix3d robot_coviarance_;
+  std::vector<Eigen::Matrix2d> landmark_coviarances_;
+  // Landmarks recovered or added since the last snapshot of landmarks
+  std::vector<int> changed_landmarks_;
+
+  sensor::Map map_;
+  sensor::ReflectorMapIndex map_index_;
+  LandmarkIndex landmark_index_;
+};
+} // namespace ekf
+
+#endif // REFLECTOR_EKF_SLAM_REFLECTOR_SEIF_SLAM_H
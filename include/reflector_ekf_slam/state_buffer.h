@@ -0,0 +1,89 @@
+#ifndef REFLECTOR_EKF_SLAM_STATE_BUFFER_H
+#define REFLECTOR_EKF_SLAM_STATE_BUFFER_H
+
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <vector>
+
+#include "reflector_ekf_slam/ekf_slam_interface.h"
+
+namespace ekf
+{
+// Storage of the extended state [x, y, theta, m1x, m1y, ...] with reserved
+// capacity. mu and sigma are the active top-left part of larger buffers which
+// grow geometrically, so adding landmarks only writes the new rows and columns
+// and the old covariance is copied only when the capacity is exceeded.
+// In mixed precision the landmark-landmark block of sigma is kept in float,
+// the robot rows (robot and robot-landmark terms) stay in double, which halves
+// the memory traffic of the dense covariance update. sigma() is then not
+// available, use robot_rows(), landmark_sigma() and LandmarkCoviarance().
+class StateBuffer
+{
+public:
+  StateBuffer();
+
+  // Drops all landmarks and sets the state to the given robot pose
+  void Reset(const double &time, const Eigen::Vector3d &pose, const Eigen::Matrix3d &pose_coviarance);
+  // Replaces the whole state, keeping the storage precision
+  void Assign(const State &state);
+  // Make sure 'dimension' state rows fit without reallocation
+  void Reserve(const int &dimension);
+  // Append 'extra' rows and columns, initialized to zero
+  void Augment(const int &extra);
+  // Drop the rows and columns of the given landmarks, which is their
+  // marginalization. Later landmarks move forward, capacity is kept.
+  void RemoveLandmarks(const std::vector<int> &landmark_ids);
+  // Write rows [row, row + rows.rows()) of sigma and the mirrored columns,
+  // 'rows' spans all Dimension() columns
+  void SetRows(const int &row, const Eigen::MatrixXd &rows);
+  // Copy robot_rows() into the robot columns, needed after writing them in double storage
+  void MirrorRobotRows();
+  // sigma = (sigma + sigma^T) / 2
+  void Symmetrize();
+
+  // Converts the covariance to and from mixed precision storage
+  void SetMixedPrecision(const bool &mixed_precision);
+  bool IsMixedPrecision() const { return mixed_precision_; }
+  // In mixed precision, switch back to double if the landmark covariance is
+  // too close to singular for float rounding, see the definition. Factorizes
+  // the whole landmark block, O(landmarks^3). Returns false if it switched.
+  bool CheckMixedPrecision();
+
+  Eigen::VectorBlock<Eigen::VectorXd> mu() { return mu_.head(dimension_); }
+  Eigen::VectorBlock<const Eigen::VectorXd> mu() const { return mu_.head(dimension_); }
+  Eigen::Block<Eigen::MatrixXd> sigma() { return sigma_.topLeftCorner(dimension_, dimension_); }
+  Eigen::Block<const Eigen::MatrixXd> sigma() const { return sigma_.topLeftCorner(dimension_, dimension_); }
+  // 3 x Dimension() rows of the robot pose in sigma, in both storages
+  Eigen::Block<Eigen::MatrixXd> robot_rows() { return sigma_.topLeftCorner(3, dimension_); }
+  Eigen::Block<const Eigen::MatrixXd> robot_rows() const { return sigma_.topLeftCorner(3, dimension_); }
+  // Landmark-landmark block of sigma, mixed precision only
+  Eigen::Block<Eigen::MatrixXf> landmark_sigma() { return landmark_sigma_.topLeftCorner(dimension_ - 3, dimension_ - 3); }
+  Eigen::Matrix3d RobotCoviarance() const { return sigma_.topLeftCorner<3, 3>(); }
+  Eigen::Matrix2d LandmarkCoviarance(const int &id) const;
+
+  double time() const { return time_; }
+  void SetTime(const double &time) { time_ = time; }
+
+  // Used and reserved state rows
+  int Dimension() const { return dimension_; }
+  int Capacity() const { return mu_.rows(); }
+
+  State ToState() const;
+  // Copy of the used rows in the same storage precision, without the reserved
+  // capacity. Cheaper than ToState() in mixed precision, which converts to double.
+  StateBuffer Compacted() const;
+
+private:
+  void Reallocate(const int &capacity);
+
+  double time_;
+  int dimension_;
+  bool mixed_precision_;
+  Eigen::VectorXd mu_;
+  // Whole sigma, or only its robot rows in mixed precision
+  Eigen::MatrixXd sigma_;
+  Eigen::MatrixXf landmark_sigma_;
+};
+} // namespace ekf
+
+#endif // REFLECTOR_EKF_SLAM_STATE_BUFFER_H
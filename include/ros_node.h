@@ -8,9 +8,13 @@
 #include <deque>
 #include <mutex>
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
 #include <geometry_msgs/QuaternionStamped.h>
 #include <nav_msgs/Odometry.h>
 #include <sensor_msgs/LaserScan.h>
+#include <sensor_msgs/Imu.h>
 #include <nav_msgs/Path.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <sensor_msgs/PointCloud.h>
@@ -25,12 +29,13 @@
 #include "io/image.h"
 #include "mapping/map_limits.h"
 
+#include "reflector_ekf_slam/checkpoint.h"
 #include "reflector_ekf_slam/ekf_slam_interface.h"
+#include "reflector_ekf_slam/pose_hypothesis_bank.h"
 #include "reflector_ekf_slam/reflector_ekf_slam.h"
-
-#ifdef USE_GPS
-#include "reflector_ekf_slam/reflector_ekf_slam_gps.h"
-#endif
+#include "reflector_ekf_slam/reflector_compressed_ekf_slam.h"
+#include "reflector_ekf_slam/reflector_fixed_lag_smoother.h"
+#include "reflector_ekf_slam/reflector_seif_slam.h"
 
 #include "reflector_detect/reflector_detect_interface.h"
 #include "reflector_detect/laser/laser_reflector_detect.h"
@@ -38,6 +43,8 @@
 #include "common/common.h"
 #include "common/time.h"
 #include "sensor/sensor_data.h"
+#include "sensor/reflector_constellation_index.h"
+#include "sensor/reflector_map_index.h"
 #include "transform/rigid_transform.h"
 #include "mapping/map_builder.h"
 
@@ -53,12 +60,31 @@ private:
   void ScanCallback(const sensor_msgs::LaserScanConstPtr &msg);
   void PointCloudCallback(const sensor_msgs::PointCloud2ConstPtr &msg);
   void OdometryCallback(const nav_msgs::OdometryConstPtr &msg);
-  visualization_msgs::MarkerArray ReflectorToRosMarkers(const ekf::State &state, const double &scale = 3.5);
+  void ImuCallback(const sensor_msgs::ImuConstPtr &msg);
+  visualization_msgs::MarkerArray ReflectorToRosMarkers(const ekf::StateSnapshot &state, const double &scale = 3.5);
   visualization_msgs::MarkerArray ReflectorToRosMarkers(const sensor::Map &map, const double &scale = 3.5);
-  geometry_msgs::PoseWithCovarianceStamped StatePosetoRosPose(const ekf::State &state);
+  geometry_msgs::PoseWithCovarianceStamped StatePosetoRosPose(const ekf::PoseState &state);
   sensor::OdometryData ToOdometryData(const nav_msgs::Odometry &msg);
+  sensor::ImuData ToImuData(const sensor_msgs::Imu &msg);
   sensor_msgs::PointCloud ToPointCloud(const sensor::RangeData &range_data);
+  ekf::EKFOptions CreateEKFOptions(const double &time);
+  // Resumes from the checkpoint loaded at start, null if there is none or the
+  // filter can not be restored from it
+  std::unique_ptr<ekf::ReflectorEKFSLAMInterface> ResumeSLAM(const double &time);
+  // Starts from the start pose
+  std::unique_ptr<ekf::ReflectorEKFSLAMInterface> CreateSLAM(const double &time);
+  std::unique_ptr<ekf::ReflectorEKFSLAMInterface> CreateFilter(const ekf::EKFOptions &options);
+  // Sets start pose from reflectors of the first scans by the constellation
+  // index, or by the hypothesis bank if that is ambiguous or not used, false
+  // until a pose is found
+  bool LocalizeStartPose(const sensor::Observation &observation);
+  bool HandOffStartPose(const Eigen::Vector3d &pose, const std::chrono::steady_clock::time_point &start);
+  void ReleaseStartPoseLocalization();
+  // Hands the known reflectors around the pose predicted for 'scan' to the detector
+  void SetTrackingTargets(const sensor_msgs::LaserScan &scan);
   void PublishMap(const ros::WallTimerEvent &timer_event);
+  // Copies the state and writes it on a background thread
+  void SaveCheckpoint(const ros::WallTimerEvent &timer_event);
   bool HandleSaveMap(
       reflector_ekf_slam::save_map::Request &request,
       reflector_ekf_slam::save_map::Response &response);
@@ -86,19 +112,61 @@ private:
     std::string scan_topic_name;
     std::string points_topic_name;
     std::string odom_topic_name;
+    std::string imu_topic_name;
     Eigen::Vector3d initial_pose;
+    // Find start pose in the prior map instead of using start_pose
+    bool use_global_localization;
+    // Longest side of reflector triangles used, about the detection range
+    double global_localization_max_side_length;
+    int global_localization_min_inliers;
+    // Track a bank of pose hypotheses until one dominates, seeded on a grid of
+    // range/step around start_pose, or by the constellation index if it is ambiguous
+    bool use_multi_hypothesis;
+    int hypothesis_threads;
+    double hypothesis_position_range;
+    double hypothesis_position_step;
+    double hypothesis_angle_range;
+    double hypothesis_angle_step;
     std::string map_path;
     std::string result_path;
+    // txt or binary, format of the saved reflector map, both can be loaded
+    std::string map_format;
+    // Empty to disable checkpoints
+    std::string checkpoint_path;
+    double checkpoint_period_sec;
     sensor::OdometryModel odom_model;
     double linear_velocity_cov;
     double angular_velocity_cov;
     double observation_cov;
+    double imu_angular_velocity_cov;
+    ekf::InnovationSolver innovation_solver;
+    bool use_joseph_form;
+    bool use_sequential_update;
+    bool use_float_landmark_coviarance;
+    int symmetrize_interval;
+    int reserved_landmarks;
+    // full, compressed, smoother or seif
+    std::string ekf_type;
+    double local_region_radius;
+    double local_region_switch_distance;
+    int max_landmarks;
+    double marginalize_distance;
+    double marginalize_coviarance;
+    int smoother_window_size;
+    int smoother_iterations;
+    int seif_active_landmarks;
     double intensity_min;
     double reflector_min_length;
     double reflector_length_error;
     double map_publish_period_sec;
     float range_min;
     float range_max;
+    // Segment only beams around reflectors expected from the predicted pose
+    bool use_reflector_tracking;
+    int reflector_tracking_full_scan_interval;
+    double reflector_tracking_margin;
+    // Scans between two scans added to the map builder, 0 follows the tracking full scan interval
+    int map_builder_scan_interval;
     transform::Rigid3d sensor_to_base_link;
     mapping::MapBuilderOptions map_builder_options;
   };
@@ -112,12 +180,17 @@ private:
   ros::Publisher matched_point_cloud_publisher_;
 
   ros::Subscriber odometry_subscriber_;
+  ros::Subscriber imu_subscriber_;
   ros::Subscriber laser_subscriber_;
   ros::Subscriber point_cloud_subscriber_;
 
   ros::ServiceServer save_map_service_;
 
   ros::WallTimer wall_timer_;
+  ros::WallTimer checkpoint_timer_;
+  std::thread checkpoint_thread_;
+  std::atomic<bool> checkpoint_writing_;
+  int scans_since_map_builder_;
 
   nav_msgs::Path ekf_path_;
   visualization_msgs::MarkerArray global_reflector_markers_;
@@ -129,6 +202,20 @@ private:
 
   NodeOptions options_;
   std::unique_ptr<ekf::ReflectorEKFSLAMInterface> slam_;
+  // Options slam_ was created with
+  ekf::EKFOptions slam_options_;
+  // Checkpoint loaded at start, released with the first scan
+  std::unique_ptr<ekf::Checkpoint> start_checkpoint_;
+  // Prior map used by global localization, released once the filter starts
+  sensor::Map localization_map_;
+  sensor::ReflectorMapIndex localization_map_index_;
+  std::unique_ptr<sensor::ReflectorConstellationIndex> constellation_index_;
+  std::unique_ptr<ekf::PoseHypothesisBank> hypothesis_bank_;
+  // Global map of the filter at map version tracking_map_version_ and the nearby
+  // reflectors in base_link for tracking
+  sensor::Map tracking_map_;
+  int tracking_map_version_;
+  sensor::PointCloud tracking_targets_;
   std::unique_ptr<reflector_detect::ReflectorDetectInterface> laser_reflector_detector_;
   std::unique_ptr<reflector_detect::ReflectorDetectInterface> point_cloud_reflector_detector_;
   std::unique_ptr<mapping::MapBuilder> map_builder_;
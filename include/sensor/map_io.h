@@ -0,0 +1,40 @@
+#ifndef SENSOR_MAP_IO_H
+#define SENSOR_MAP_IO_H
+
+#include <string>
+
+#include "sensor/reflector_map_index.h"
+#include "sensor/sensor_data.h"
+
+namespace sensor
+{
+
+// Loads reflector map saved by the node, which has 2 lines:
+// x1,y1,x2,y2,...
+// cov1(0,0),cov1(0,1),cov1(1,0),cov1(1,1),...
+// Returns false and leaves 'map' untouched if the file is missing or broken.
+bool LoadMapFromTxtFile(const std::string &file, Map *map);
+bool SaveMapToTxtFile(const std::string &file, const Map &map);
+
+// Binary reflector map, native byte order:
+//   header (magic, version, reflector number M, parameters and size of the index)
+//   reflectors: 2 * M floats, covariances: 4 * M doubles in column major
+//   cells of 'index' if given, see ReflectorMapIndex::Cells
+// Every array starts aligned to its type. The file is written next to 'file'
+// and renamed over it.
+bool SaveMapToBinaryFile(const std::string &file, const Map &map, const ReflectorMapIndex *index);
+// Maps 'file' into memory and copies the arrays out in bulk. 'index' is
+// restored if the file has one, and left untouched otherwise. Returns false
+// and leaves both untouched if the file is missing, of another version or truncated.
+bool LoadMapFromBinaryFile(const std::string &file, Map *map, ReflectorMapIndex *index, bool *has_index);
+bool IsBinaryMapFile(const std::string &file);
+
+// Loads 'file' in either format and makes 'index' ready for 'gate' and
+// 'noise', from the file if it was saved with them, by building it otherwise.
+// The index is built over an empty map if the file can not be loaded.
+bool LoadMap(const std::string &file, const double &gate, const Eigen::Matrix2d &noise,
+             Map *map, ReflectorMapIndex *index);
+
+} // namespace sensor
+
+#endif // SENSOR_MAP_IO_H
@@ -0,0 +1,74 @@
+#ifndef SENSOR_REFLECTOR_CONSTELLATION_INDEX_H
+#define SENSOR_REFLECTOR_CONSTELLATION_INDEX_H
+
+#include <cstdint>
+#include <vector>
+
+#include "sensor/reflector_map_index.h"
+#include "sensor/sensor_data.h"
+#include "transform/rigid_transform.h"
+
+namespace sensor
+{
+
+// Geometric hash of the reflector triangles of a prior map for global
+// localization without a start pose. A triangle is keyed by its sorted side
+// lengths, which fix its angles, and its orientation, so a mirrored triangle
+// never matches. Only triangles whose sides lie in [min, max] side length and
+// which are not close to collinear are hashed, each once.
+//
+// Candidates() looks up the triangles of the observed reflectors, aligns every
+// candidate correspondence and counts the observed reflectors which pass the
+// gate of the map index at that pose. Sides of about equal length may be sorted
+// the other way in the map, so every vertex order they allow is looked up.
+class ReflectorConstellationIndex
+{
+public:
+  // 'side_tolerance' is the largest error of a side length that still matches,
+  // observed triangles are only looked up with sides up to 'max_side_length',
+  // which should cover the reflectors seen in one scan
+  ReflectorConstellationIndex(const double &min_side_length, const double &max_side_length,
+                              const double &side_tolerance);
+
+  void Build(const Map &map);
+
+  struct Candidate
+  {
+    transform::Rigid2d pose;
+    // Observed reflectors passing the gate at 'pose' and the sum of their distances
+    int inliers;
+    double cost;
+  };
+  // Distinct poses of the robot in 'map' explaining at least 'min_inliers' of
+  // reflectors 'observed' in robot frame, best first, each refined with all
+  // reflectors it explains. 'map_index' must be built over 'map'.
+  std::vector<Candidate> Candidates(const Map &map, const ReflectorMapIndex &map_index, const PointCloud &observed,
+                                    const int &min_inliers) const;
+  // Best of Candidates(), false if there is none or if the next one explains as many reflectors
+  bool Localize(const Map &map, const ReflectorMapIndex &map_index, const PointCloud &observed,
+                const int &min_inliers, transform::Rigid2d *pose, int *inliers) const;
+
+  int Size() const { return triangles_.size(); }
+
+private:
+  struct Triangle
+  {
+    uint64_t key;
+    // Vertex i is opposite to the i-th shortest side
+    int32_t ids[3];
+  };
+  // Vertices ordered as in Triangle, false if the triangle is not hashed
+  bool Canonicalize(const Eigen::Vector2d points[3], int order[3], double sides[3], bool *ccw) const;
+  uint64_t Key(const int &s0, const int &s1, const int &s2, const bool &ccw) const;
+  int Quantize(const double &side) const;
+
+  double min_side_length_;
+  double max_side_length_;
+  double side_tolerance_;
+  // Sorted by key
+  std::vector<Triangle> triangles_;
+};
+
+} // namespace sensor
+
+#endif // SENSOR_REFLECTOR_CONSTELLATION_INDEX_H
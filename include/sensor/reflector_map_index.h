@@ -0,0 +1,73 @@
+#ifndef SENSOR_REFLECTOR_MAP_INDEX_H
+#define SENSOR_REFLECTOR_MAP_INDEX_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "sensor/sensor_data.h"
+
+namespace sensor
+{
+
+// Uniform grid hash over the reflectors of a prior map for the gated match
+// sqrt(d^T * (cov + noise)^-1 * d) < gate. Every reflector is registered in all
+// cells its gate region can reach, so a lookup only checks the reflectors of
+// one cell and the cost does not grow with the map size. Reflectors whose gate
+// region is too large are always checked.
+class ReflectorMapIndex
+{
+public:
+  // 'resolution' is the length of a cell edge
+  explicit ReflectorMapIndex(const double &resolution = 1.);
+
+  // Rebuilds the index over all reflectors of 'map', 'noise' is the observation
+  // covariance added to every reflector covariance
+  void Build(const Map &map, const double &gate, const Eigen::Matrix2d &noise);
+  // Registers reflector 'id' of 'map', used when reflectors are appended after Build
+  void Insert(const Map &map, const int &id);
+
+  // Nearest reflector of 'map' to 'point' passing the gate and its distance,
+  // -1 if none
+  int Match(const Map &map, const Eigen::Vector2f &point, double *distance) const;
+
+  int Size() const { return information_.size(); }
+  double resolution() const { return resolution_; }
+  double gate() const { return gate_; }
+  const Eigen::Matrix2d &noise() const { return noise_; }
+
+  // Flat form of the cells for map files: sorted cell keys, reflector ids of
+  // cell i in ids[offsets[i], offsets[i + 1]), and the always checked reflectors
+  struct Cells
+  {
+    std::vector<int64_t> keys;
+    std::vector<uint32_t> offsets;
+    std::vector<int32_t> ids;
+    std::vector<int32_t> unbounded;
+  };
+  Cells ExportCells() const;
+  // Restores the index of 'map' from cells exported by an index with the same
+  // resolution, built with 'gate' and 'noise', without registering reflectors again
+  void ImportCells(const Map &map, const double &gate, const Eigen::Matrix2d &noise, const Cells &cells);
+
+private:
+  using KeyType = int64_t;
+
+  // cov + noise of reflector 'id', noise only if that is not positive definite
+  Eigen::Matrix2d GateCoviarance(const Map &map, const int &id) const;
+  static KeyType IndexToKey(const int &x, const int &y);
+  int GetCellIndex(const double &value) const;
+
+  double resolution_;
+  double gate_;
+  Eigen::Matrix2d noise_;
+  // (cov + noise)^-1 of every reflector
+  std::vector<Eigen::Matrix2d> information_;
+  std::unordered_map<KeyType, std::vector<int>> cells_;
+  // Reflectors checked by every lookup
+  std::vector<int> unbounded_;
+};
+
+} // namespace sensor
+
+#endif // SENSOR_REFLECTOR_MAP_INDEX_H
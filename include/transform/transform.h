@@ -107,6 +107,16 @@ Rigid3<T> Embed3D(const Rigid2<T> &transform)
                           Eigen::Matrix<T, 3, 1>::UnitZ()));
 }
 
+// Returns 'transform' as a matrix, applying it to points needs no cos and sin.
+template <typename T>
+Eigen::Transform<T, 2, Eigen::Isometry> ToIsometry2D(const Rigid2<T> &transform)
+{
+  Eigen::Transform<T, 2, Eigen::Isometry> isometry;
+  isometry.linear() = transform.rotation().toRotationMatrix();
+  isometry.translation() = transform.translation();
+  return isometry;
+}
+
 } // namespace transform
 
 #endif // TRANSFORM_TRANSFORM_H_
@@ -0,0 +1,92 @@
+#include "common/thread_pool.h"
+
+#include <algorithm>
+#include <glog/logging.h>
+
+namespace common
+{
+
+ThreadPool::ThreadPool(const int &num_threads)
+    : function_(nullptr), size_(0), chunk_size_(1), next_(0), generation_(0), pending_(0), stop_(false)
+{
+    CHECK(num_threads >= 0);
+    const int threads = num_threads > 0 ? num_threads : std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < threads; ++i)
+        workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    start_condition_.notify_all();
+    for (auto &worker : workers_)
+        worker.join();
+}
+
+void ThreadPool::ParallelFor(const int &n, const std::function<void(int)> &function)
+{
+    if (n <= 0)
+        return;
+    if (workers_.empty() || n == 1)
+    {
+        for (int i = 0; i < n; ++i)
+            function(i);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        function_ = &function;
+        size_ = n;
+        // A few chunks per thread balance uneven calls without much contention
+        chunk_size_ = std::max(1, n / (4 * Size()));
+        next_ = 0;
+        pending_ = workers_.size();
+        ++generation_;
+    }
+    start_condition_.notify_all();
+    RunChunks();
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_condition_.wait(lock, [this] { return pending_ == 0; });
+    function_ = nullptr;
+}
+
+void ThreadPool::RunChunks()
+{
+    for (;;)
+    {
+        const int begin = next_.fetch_add(chunk_size_);
+        if (begin >= size_)
+            return;
+        const int end = std::min(size_, begin + chunk_size_);
+        for (int i = begin; i < end; ++i)
+            (*function_)(i);
+    }
+}
+
+void ThreadPool::WorkerLoop()
+{
+    uint64_t generation = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            start_condition_.wait(lock, [&] { return stop_ || generation_ != generation; });
+            if (stop_)
+                return;
+            generation = generation_;
+        }
+        RunChunks();
+        bool done;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done = --pending_ == 0;
+        }
+        if (done)
+            done_condition_.notify_one();
+    }
+}
+
+} // namespace common
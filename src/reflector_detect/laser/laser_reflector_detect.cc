@@ -3,16 +3,212 @@
 #include "common/common.h"
 #include "sensor/sensor_data.h"
 
-#include <deque>
+#include <algorithm>
+#include <cmath>
 #include <vector>
 #include <glog/logging.h>
 
 namespace reflector_detect
 {
+namespace
+{
+// Segmentation joins high intensity beams up to this many beams apart
+constexpr int kGapBeams = 4;
+} // namespace
 
 LaserReflectorDetect::LaserReflectorDetect(const ReflectorDetectOptions &options) : options_(options),
-                                                                                    pose_extrapolator_(common::make_unique<PoseExtrapolator>())
+                                                                                    pose_extrapolator_(common::make_unique<PoseExtrapolator>()),
+                                                                                    range_data_projected_(false),
+                                                                                    range_data_first_point_time_(0.),
+                                                                                    range_data_point_delta_t_(0.),
+                                                                                    tracking_position_margin_(0.f),
+                                                                                    tracking_angle_margin_(0.f),
+                                                                                    has_tracking_targets_(false),
+                                                                                    scans_since_full_scan_(0)
+{
+    beam_table_.size = -1;
+}
+
+void LaserReflectorDetect::UpdateBeamTable(const sensor_msgs::LaserScan &msg, const Eigen::Vector3f &extrinsic)
+{
+    const int size = msg.ranges.size();
+    if (beam_table_.size == size && beam_table_.angle_min == msg.angle_min &&
+        beam_table_.angle_increment == msg.angle_increment && beam_table_.extrinsic == extrinsic)
+        return;
+    beam_table_.angle_min = msg.angle_min;
+    beam_table_.angle_increment = msg.angle_increment;
+    beam_table_.size = size;
+    beam_table_.extrinsic = extrinsic;
+    beam_table_.cos_angle.resize(size);
+    beam_table_.sin_angle.resize(size);
+    // Rotating by the extrinsic yaw only shifts the beam angle
+    for (int i = 0; i < size; ++i)
+    {
+        const double angle = static_cast<double>(msg.angle_min) + i * static_cast<double>(msg.angle_increment) +
+                             extrinsic.z();
+        beam_table_.cos_angle[i] = std::cos(angle);
+        beam_table_.sin_angle[i] = std::sin(angle);
+    }
+    LOG(INFO) << "Rebuild beam table of " << size << " beams";
+}
+
+void LaserReflectorDetect::ResizeScratch(const int &size)
+{
+    // Only grows on the first scan or when the beam count grows
+    if (static_cast<int>(scratch_.valid.capacity()) < size)
+    {
+        scratch_.points_x.reserve(size);
+        scratch_.points_y.reserve(size);
+        scratch_.valid.reserve(size);
+        scratch_.poses.reserve(size);
+        scratch_.segments.reserve(size);
+        scratch_.windows.reserve(std::max<size_t>(scratch_.windows.capacity(), 1));
+        range_data_.returns.reserve(size);
+        LOG(INFO) << "Resize scan scratch to " << size << " beams";
+    }
+    scratch_.points_x.resize(size);
+    scratch_.points_y.resize(size);
+    scratch_.valid.resize(size);
+    scratch_.poses.resize(size);
+    scratch_.segments.clear();
+}
+
+void LaserReflectorDetect::ProjectScan(const sensor_msgs::LaserScan &msg, const int &begin, const int &end)
+{
+    // Plain arrays without branches, the compiler vectorizes this loop
+    const float *ranges = msg.ranges.data();
+    const float *cos_angle = beam_table_.cos_angle.data();
+    const float *sin_angle = beam_table_.sin_angle.data();
+    float *x = scratch_.points_x.data();
+    float *y = scratch_.points_y.data();
+    uint8_t *valid = scratch_.valid.data();
+    const float tx = beam_table_.extrinsic.x();
+    const float ty = beam_table_.extrinsic.y();
+    const float range_min = msg.range_min;
+    const float range_max = msg.range_max;
+    for (int i = begin; i < end; ++i)
+    {
+        const float range = ranges[i];
+        x[i] = tx + range * cos_angle[i];
+        y[i] = ty + range * sin_angle[i];
+        valid[i] = (range >= range_min) & (range <= range_max);
+    }
+}
+
+void LaserReflectorDetect::SetTrackingTargets(const sensor::PointCloud &reflectors, const float &position_margin,
+                                              const float &angle_margin)
+{
+    if (!options_.use_tracking)
+        return;
+    tracking_targets_ = reflectors;
+    tracking_position_margin_ = position_margin;
+    tracking_angle_margin_ = angle_margin;
+    has_tracking_targets_ = true;
+    // A target wrapping around the end of a 360 scan gives two windows
+    scratch_.windows.reserve(2 * reflectors.size());
+}
+
+void LaserReflectorDetect::ComputeTrackingWindows(const sensor_msgs::LaserScan &msg)
 {
+    const int size = msg.ranges.size();
+    const double field_of_view = size * static_cast<double>(msg.angle_increment);
+    const bool full_circle = field_of_view > 2 * M_PI - 1.5 * msg.angle_increment;
+    std::vector<BeamWindow> &windows = scratch_.windows;
+    windows.clear();
+    const Eigen::Vector2f sensor_position = beam_table_.extrinsic.head<2>();
+    // Half of the longest accepted reflector and the uncertainty of its predicted position
+    const float half_length =
+        0.5f * (options_.reflector_min_length + options_.reflector_length_error) + tracking_position_margin_;
+    for (const auto &target : tracking_targets_)
+    {
+        const Eigen::Vector2f direction = target - sensor_position;
+        const float range = direction.norm();
+        if (range + half_length < options_.range_min || range - half_length > options_.range_max)
+            continue;
+        if (range <= half_length)
+        {
+            windows.clear();
+            windows.push_back({0, size});
+            return;
+        }
+        const double half_width = std::asin(half_length / range) + tracking_angle_margin_;
+        // Angle from angle_min, within half a turn of the middle of the scan
+        double offset = std::atan2(direction.y(), direction.x()) - beam_table_.extrinsic.z() - msg.angle_min;
+        offset = std::remainder(offset - field_of_view / 2, 2 * M_PI) + field_of_view / 2;
+        int begin = static_cast<int>(std::floor((offset - half_width) / msg.angle_increment)) - kGapBeams;
+        int end = static_cast<int>(std::ceil((offset + half_width) / msg.angle_increment)) + kGapBeams + 1;
+        if (end - begin >= size)
+        {
+            windows.clear();
+            windows.push_back({0, size});
+            return;
+        }
+        if (full_circle && begin < 0)
+        {
+            windows.push_back({begin + size, size});
+            begin = 0;
+        }
+        if (full_circle && end > size)
+        {
+            windows.push_back({0, end - size});
+            end = size;
+        }
+        begin = std::max(begin, 0);
+        end = std::min(end, size);
+        if (begin < end)
+            windows.push_back({begin, end});
+    }
+    if (windows.empty())
+        return;
+    // Windows closer than a gap are merged, so a reflector never bridges beams outside the windows
+    std::sort(windows.begin(), windows.end(),
+              [](const BeamWindow &lhs, const BeamWindow &rhs) { return lhs.begin < rhs.begin; });
+    int merged = 0;
+    for (size_t i = 1; i < windows.size(); ++i)
+    {
+        if (windows[i].begin <= windows[merged].end + kGapBeams)
+            windows[merged].end = std::max(windows[merged].end, windows[i].end);
+        else
+            windows[++merged] = windows[i];
+    }
+    windows.resize(merged + 1);
+}
+
+sensor::RangeData LaserReflectorDetect::GetRangeData()
+{
+    if (!range_data_scan_)
+        return range_data_;
+    const sensor_msgs::LaserScan &msg = *range_data_scan_;
+    const int points_number = msg.ranges.size();
+    // Tracking scans only projected the beams around the reflectors
+    if (!range_data_projected_)
+        ProjectScan(msg, 0, points_number);
+    const std::vector<uint8_t> &valid = scratch_.valid;
+    range_data_.origin = sensor_to_base_link_transform_.translation().head<2>().cast<float>();
+    range_data_.returns.clear();
+    range_data_.misses.clear();
+    if (pose_extrapolator_)
+    {
+        std::vector<Eigen::Isometry2d> &poses = scratch_.poses;
+        pose_extrapolator_->ExtrapolatorPoses(range_data_first_point_time_, range_data_point_delta_t_, points_number,
+                                              &poses);
+        const Eigen::Isometry2d last_pose_inverse = transform::ToIsometry2D(range_data_max_time_pose_.inverse());
+        for (int i = 0; i < points_number; ++i)
+        {
+            if (valid[i])
+                range_data_.returns.push_back((last_pose_inverse * poses[i]).cast<float>() * BeamPoint(i));
+        }
+    }
+    else
+    {
+        for (int i = 0; i < points_number; ++i)
+        {
+            if (valid[i])
+                range_data_.returns.push_back(BeamPoint(i));
+        }
+    }
+    range_data_scan_.reset();
+    return range_data_;
 }
 
 /*  Add 2 new feature:
@@ -36,170 +232,134 @@ sensor::Observation LaserReflectorDetect::HandleLaserScan(const sensor_msgs::Las
         LOG(ERROR) << "Scan message angle min and max and angle increment is wrong";
         exit(-1);
     }
-    // All reflector points
-    std::deque<sensor::TimedPointCloud> reflector_points;
-    std::deque<std::vector<int>> reflector_ids;
-    // Now reflector points, ids and center
-    sensor::TimedPointCloud reflector;
-    std::vector<int> reflector_id;
-    // All laser scan points in base_link frame
-    sensor::TimedPointCloud point_cloud;
+    const int points_number = msg->ranges.size();
+    ResizeScratch(points_number);
+    // All good reflectors
+    std::vector<ReflectorSegment> &reflectors = scratch_.segments;
+    // Now reflector, empty while first < 0
+    ReflectorSegment reflector{-1, -1};
 
     const double last_point_time = msg->header.stamp.toSec();
     const double point_delta_t = msg->scan_time / msg->ranges.size();
     const double first_point_time = last_point_time - msg->scan_time;
-    float angle = msg->angle_min;
     if (pose_extrapolator_)
         pose_extrapolator_->TrimDataByTime(first_point_time);
     const transform::Rigid2f sensor_to_base_link = transform::Project2D(sensor_to_base_link_transform_).cast<float>();
+    UpdateBeamTable(*msg, Eigen::Vector3f(sensor_to_base_link.translation().x(), sensor_to_base_link.translation().y(),
+                                          sensor_to_base_link.rotation().angle()));
     const bool is_circle_scan = (msg->angle_max - msg->angle_min - 2 * M_PI) < 1e-6;
+    // Tracking mode only segments the beams around the expected reflectors,
+    // with a full scan now and then to find new ones
+    const bool full_scan = !options_.use_tracking || !has_tracking_targets_ ||
+                           scans_since_full_scan_ + 1 >= options_.tracking_full_scan_interval;
+    has_tracking_targets_ = false;
+    std::vector<BeamWindow> &windows = scratch_.windows;
+    if (full_scan)
+    {
+        windows.clear();
+        windows.push_back({0, points_number});
+        scans_since_full_scan_ = 0;
+    }
+    else
+    {
+        ComputeTrackingWindows(*msg);
+        ++scans_since_full_scan_;
+    }
+    for (const auto &window : windows)
+        ProjectScan(*msg, window.begin, window.end);
 
     // Detect reflectors and motion distortion correction hear
     // 反光板点云提取部分
-    const int points_number = msg->ranges.size();
-    for (int i = 0; i < points_number; ++i)
+    for (const auto &window : windows)
     {
-        // Get range data
-        const float range = msg->ranges[i];
-
-        if (range >= msg->range_min && range <= msg->range_max)
+        for (int i = window.begin; i < window.end; ++i)
         {
-            // Get now point xy value in sensor frame
-            const Eigen::Vector2f now_point(range * std::cos(angle), range * std::sin(angle));
-            // Transform sensor point to base link
-            const auto postion_in_base_link = sensor_to_base_link * now_point;
-            point_cloud.push_back({postion_in_base_link.x(), postion_in_base_link.y(),
-                                   first_point_time + i * point_delta_t});
-        }
+            // Get range data
+            const float range = msg->ranges[i];
 
-        // 只处理距离在[range_min_,range_max_]范围用内的点云
-        // 因为当反光板距离激光较远时,激光能扫到的反光板点云数量很少,极不稳定。所以只考虑近距离内的反光板点云
-        if (options_.range_min <= range && range <= options_.range_max)
-        {
-            // Detect reflector
-            const double intensity = msg->intensities[i];
-            // 通过强度阈值来提取来自反光板的点云
-            if (intensity > options_.intensity_min)
+            // 只处理距离在[range_min_,range_max_]范围用内的点云
+            // 因为当反光板距离激光较远时,激光能扫到的反光板点云数量很少,极不稳定。所以只考虑近距离内的反光板点云
+            if (options_.range_min <= range && range <= options_.range_max)
             {
-                // Add the first point
-                if (reflector.empty())
-                {
-                    reflector.push_back(point_cloud.back());
-                    reflector_id.push_back(i);
-                    // now_center += point_cloud.back();
-                }
-                else
+                // Detect reflector
+                const double intensity = msg->intensities[i];
+                // 通过强度阈值来提取来自反光板的点云
+                if (intensity > options_.intensity_min)
                 {
-                    const int last_id = reflector_id.back(); // 取得上一个点云的id
-                    // Add connected points
-                    // 若点云强度是连续很高,则认为是来自同一块反光板的点云(这里假定反光板反射回的点云总是大于强度阈值且连续成片)
-                    if (i - last_id == 1)
+                    // Add the first point
+                    if (reflector.first < 0)
                     {
-                        reflector.push_back(point_cloud.back());
-                        reflector_id.push_back(i);
-                        // now_center += point_cloud.back();// 累加点云,用于求和取平均
+                        reflector.first = i;
+                        reflector.last = i;
                     }
-                    // 反光板间隙点云检测部分
-                    // 因为点云的强度值影响因素很多,有可能一条反光板点云的中间会有某几个点强度较低
-                    // 这样会造成1块反光板检测为多块 或者 1块反光板检测出来缺失一部分,从而影响同一反光板的中心点计算
                     else
                     {
-                        // 间隙点云是否存在的标志位
-                        bool detected_gap = false;
+                        const int last_id = reflector.last; // 取得上一个点云的id
+                        // Add connected points
+                        // 若点云强度是连续很高,则认为是来自同一块反光板的点云(这里假定反光板反射回的点云总是大于强度阈值且连续成片)
+                        if (i - last_id == 1)
+                        {
+                            reflector.last = i;
+                        }
+                        // 反光板间隙点云检测部分
+                        // 因为点云的强度值影响因素很多,有可能一条反光板点云的中间会有某几个点强度较低
+                        // 这样会造成1块反光板检测为多块 或者 1块反光板检测出来缺失一部分,从而影响同一反光板的中心点计算
                         // 若与上一个反光板点云相差最多3个点 且 当前点与之前的点在同一平面 且 当前点的下一个点也是高强度点云
-                        // 则认为是反光板中间部分的弱强度点云,即间隙点云
-                        if (i - last_id < 4 && fabs(msg->ranges[i] - msg->ranges[last_id]) < 0.3 && msg->intensities[i + 1 < points_number ? i + 1 : i] > options_.intensity_min)
+                        // 则认为是反光板中间部分的弱强度点云,即间隙点云,间隙点云(inf值除外)随反光板的id范围一起保留
+                        else if (i - last_id < kGapBeams && fabs(msg->ranges[i] - msg->ranges[last_id]) < 0.3 &&
+                                 msg->intensities[i + 1 < points_number ? i + 1 : i] > options_.intensity_min)
                         {
-                            detected_gap = true;
-                            // 存储反光板中的间隙点云
-                            int j = last_id + 1;
-                            for (; j < i; ++j)
-                            {
-                                const float range_gap = msg->ranges[j];
-                                const float angle_gap = angle - msg->angle_increment * (i - j);
-                                if (std::isinf(range_gap)) // scan中很可能存在inf值
-                                    continue;
-                                // std::cout << "\n!!!!!!!!!!!!\n"<< "points_number=" << points_number << " i=" << i << " j=" << j << "\n";
-                                // std::cout << range_gap << " -- " << angle_gap;
-                                const Eigen::Vector2f gap_point = sensor_to_base_link *
-                                                                  Eigen::Vector2f(range_gap * std::cos(angle_gap), range_gap * std::sin(angle_gap));
-                                reflector.push_back({gap_point.x(), gap_point.y(),
-                                                     first_point_time + j * point_delta_t});
-                                reflector_id.push_back(j);
-                                // now_center += gap_point;
-                            }
-                            // 存储当前反光板中正常的高强度点云
-
-                            // std::cout << "\n>>>gap_points of reflector detected! now add it back.";
                             LOG(INFO) << "Detect gap points of reflector! now add it back.";
-                            reflector.push_back(point_cloud.back());
-                            reflector_id.push_back(i);
-                            // now_center += point_cloud.back();
+                            reflector.last = i;
                         }
-
-                        if (!detected_gap)
+                        else
                         {
-
                             // Calculate reflector length
                             // 当下一帧高强度点云不是连续的,表明一块反光板上的点云已经检索完毕
-                            // 此时,front和back的点云代表这块反光板的第一个点和最后一个点
+                            // 此时,first和last的点云代表这块反光板的第一个点和最后一个点
                             // 求取位移差=检测到的反光板宽度
-                            const float reflector_length = std::hypotf(reflector.front().x() - reflector.back().x(),
-                                                                       reflector.front().y() - reflector.back().y());
-                            // Add good reflector and its center
+                            const float reflector_length = (BeamPoint(reflector.first) - BeamPoint(reflector.last)).norm();
+                            // Add good reflector
                             // 允许检测出的反光板宽度误差在 reflector_length_error 设定的误差范围内
-                            if ((is_circle_scan && reflector_id.front() == 0) || fabs(reflector_length - options_.reflector_min_length) < options_.reflector_length_error)
+                            if ((is_circle_scan && reflector.first == 0) || fabs(reflector_length - options_.reflector_min_length) < options_.reflector_length_error)
                             {
-                                reflector_points.push_back(reflector); // 存入反光板点云
-                                reflector_ids.push_back(reflector_id);
-                                // centers.push_back(now_center / reflector.size());// 求平均 获得反光板点云的中心点位置
+                                reflectors.push_back(reflector);
                             }
                             // Update now reflector
-                            // 清除缓存,准备下一个反光板点云的存储
-                            reflector.clear();
-                            reflector_id.clear();
-                            // now_center.setZero(2);
                             // 当前反光板点云就是 下一个反光板的第一个点
-                            reflector_id.push_back(i);
-                            reflector.push_back(point_cloud.back());
-                            // now_center += point_cloud.back();
-                            // point_cloud.clear();// 防止内存占用一直增加
-                            // std::cout << "\n reflector +1";
+                            reflector.first = i;
+                            reflector.last = i;
                             LOG(INFO) << "Add a new reflector";
                         }
                     }
                 }
             }
         }
-        // 一个点云判断完毕,下一个点云角度按照角度分辨率增加
-        angle += msg->angle_increment;
     }
     // Process last reflector and first reflector
-    if (!reflector.empty())
+    if (reflector.first >= 0)
     {
-        if (reflector_points.size() > 0)
+        if (!reflectors.empty())
         {
-            const int first_reflector_first_point_id = reflector_ids.front().front();
-            const int last_reflector_last_point_id = reflector_id.back();
-            const auto first_point = reflector_points.front().front().head<2>();
-            const auto first_reflector_last_point = reflector_points.front().back().head<2>();
-            const auto last_point = reflector.back().head<2>();
-            const auto last_reflector_first_point = reflector.front().head<2>();
+            const int first_reflector_first_point_id = reflectors.front().first;
+            const int last_reflector_last_point_id = reflector.last;
+            const Eigen::Vector2f first_point = BeamPoint(reflectors.front().first);
+            const Eigen::Vector2f first_reflector_last_point = BeamPoint(reflectors.front().last);
+            const Eigen::Vector2f last_point = BeamPoint(reflector.last);
+            const Eigen::Vector2f last_reflector_first_point = BeamPoint(reflector.first);
             if (is_circle_scan && first_reflector_first_point_id == 0 &&
                 last_reflector_last_point_id == points_number - 1 &&
                 (last_point - first_point).norm() < 0.1)
             {
-                // Union last and first reflector
-                auto &first_points = reflector_points.front();
-                first_points.insert(first_points.end(), reflector.begin(), reflector.end());
+                // Union last and first reflector, the first one now wraps around the scan end
+                reflectors.front().first = reflector.first;
             }
             else
             {
-                const float reflector_length = std::hypotf(reflector.front().x() - reflector.back().x(),
-                                                           reflector.front().y() - reflector.back().y());
+                const float reflector_length = (last_reflector_first_point - last_point).norm();
                 if (fabs(reflector_length - options_.reflector_min_length) < options_.reflector_length_error)
                 {
-                    reflector_points.push_back(reflector);
+                    reflectors.push_back(reflector);
                 }
             }
             if (is_circle_scan && last_reflector_last_point_id == 0)
@@ -209,104 +369,95 @@ sensor::Observation LaserReflectorDetect::HandleLaserScan(const sensor_msgs::Las
                 // Delete first reflector
                 if (fabs(first_reflector_length - options_.reflector_min_length) >= options_.reflector_length_error)
                 {
-                    reflector_points.pop_front();
+                    reflectors.erase(reflectors.begin());
                 }
             }
         }
         else
         {
-            const float reflector_length = std::hypotf(reflector.front().x() - reflector.back().x(),
-                                                       reflector.front().y() - reflector.back().y());
+            const float reflector_length = (BeamPoint(reflector.first) - BeamPoint(reflector.last)).norm();
             if (fabs(reflector_length - options_.reflector_min_length) < options_.reflector_length_error)
             {
-                reflector_points.push_back(reflector);
+                reflectors.push_back(reflector);
             }
         }
     }
-    else if (is_circle_scan && reflector_ids.front().front() == 0)
+    else if (is_circle_scan && !reflectors.empty() && reflectors.front().first == 0)
     {
         // Only process first reflector
         const float first_reflector_length =
-            (reflector_points.front().front().head<2>() - reflector_points.back().front().head<2>()).norm();
+            (BeamPoint(reflectors.front().first) - BeamPoint(reflectors.back().first)).norm();
         // Delete first reflector
         if (fabs(first_reflector_length - options_.reflector_min_length) >= options_.reflector_length_error)
         {
-            reflector_points.pop_front();
+            reflectors.erase(reflectors.begin());
         }
     }
 
     // Correct motion distortion by pose extrapolator
-    double max_time_stamp = point_cloud.back().z();
+    int last_valid_id = points_number - 1;
+    while (last_valid_id >= 0 &&
+           !(msg->ranges[last_valid_id] >= msg->range_min && msg->ranges[last_valid_id] <= msg->range_max))
+        --last_valid_id;
     transform::Rigid2d max_time_pose;
     if (pose_extrapolator_)
     {
-        range_data_.origin = sensor_to_base_link_transform_.translation().head<2>().cast<float>();
-        range_data_.returns.clear();
-        range_data_.misses.clear();
-        std::vector<transform::Rigid2d> poses;
-        for (const auto &p : point_cloud)
-        {
-            poses.push_back(pose_extrapolator_->ExtrapolatorPose(p.z()));
-        }
-        CHECK(poses.size() == point_cloud.size() && point_cloud.size() > 0);
-        max_time_pose = poses.back();
-        const auto last_pose_inverse = poses.back().inverse();
-        for (size_t i = 0; i < poses.size(); ++i)
-        {
-            range_data_.returns.push_back(
-                (last_pose_inverse * poses[i]).cast<float>() * point_cloud[i].head<2>());
-        }
+        CHECK(last_valid_id >= 0);
+        max_time_pose = pose_extrapolator_->ExtrapolatorPose(first_point_time + last_valid_id * point_delta_t);
     }
-    else
+    // Range data is only built if it is requested
+    range_data_scan_ = msg;
+    range_data_projected_ = full_scan;
+    range_data_first_point_time_ = first_point_time;
+    range_data_point_delta_t_ = point_delta_t;
+    range_data_max_time_pose_ = max_time_pose;
+
+    if (!full_scan && reflectors.empty())
     {
-        range_data_.origin = sensor_to_base_link_transform_.translation().head<2>().cast<float>();
-        range_data_.returns.clear();
-        range_data_.misses.clear();
-        max_time_pose = transform::Rigid2d();
-        for (auto &point : point_cloud)
-        {
-            range_data_.returns.push_back(point.head<2>());
-        }
+        LOG(INFO) << "No tracked reflector, search the whole next scan";
+        scans_since_full_scan_ = options_.tracking_full_scan_interval;
     }
 
-    if (reflector_points.empty())
+    if (reflectors.empty())
     {
         return observation;
     }
 
-    std::vector<sensor::PointCloud> all_points_in_odom;
-    for (auto &points : reflector_points)
+    // Reflector points to odom at their own time and back to base_link at the last point time
+    const Eigen::Isometry2f max_time_pose_inverse = transform::ToIsometry2D(max_time_pose.inverse()).cast<float>();
+    observation.cloud_.reserve(reflectors.size());
+    std::vector<Eigen::Isometry2d> &poses = scratch_.poses;
+    for (const auto &segment : reflectors)
     {
-        sensor::PointCloud pts_in_odom;
-        for (auto &p : points)
+        Eigen::Vector2f center(0., 0.);
+        int count = 0;
+        // A segment wrapping around the scan end is two beam ranges, each increasing in time
+        const BeamWindow ranges[2] = {{segment.first, segment.first <= segment.last ? segment.last + 1 : points_number},
+                                      {0, segment.first <= segment.last ? 0 : segment.last + 1}};
+        for (const auto &range : ranges)
         {
-            const double point_time = p.z();
-            transform::Rigid2d pose;
+            if (range.begin >= range.end)
+                continue;
             if (pose_extrapolator_)
+                pose_extrapolator_->ExtrapolatorPoses(first_point_time + range.begin * point_delta_t, point_delta_t,
+                                                      range.end - range.begin, &poses);
+            for (int j = range.begin; j < range.end; ++j)
             {
-                pose = pose_extrapolator_->ExtrapolatorPose(point_time);
-            }
-            else
-            {
-                pose = transform::Rigid2d();
+                // scan中很可能存在inf值
+                if (!std::isinf(msg->ranges[j]))
+                {
+                    const Eigen::Vector2f point_in_odom =
+                        pose_extrapolator_ ? poses[j - range.begin].cast<float>() * BeamPoint(j) : BeamPoint(j);
+                    center += max_time_pose_inverse * point_in_odom;
+                    ++count;
+                }
             }
-            pts_in_odom.push_back(pose.cast<float>() * p.head<2>());
-        }
-        all_points_in_odom.push_back(pts_in_odom);
-    }
-    for (const auto &points : all_points_in_odom)
-    {
-        const auto pts_in_base_link = sensor::TransformPointCloud(points, max_time_pose.inverse().cast<float>());
-        Eigen::Vector2f center(0., 0.);
-        for (const auto &p : pts_in_base_link)
-        {
-            center += p;
         }
-        observation.cloud_.push_back(center / pts_in_base_link.size());
+        observation.cloud_.push_back(center / count);
     }
 
 #ifdef USE_CORRECT_TIME
-    observation.time_ = max_time_stamp;
+    observation.time_ = first_point_time + last_valid_id * point_delta_t;
 #endif
     // 输出检测到的反光板个数
     // std::cout << "\n detected " << observation.cloud_.size() << " reflectors" << std::endl;
@@ -1,131 +1,211 @@
 #include "reflector_detect/laser/pose_extrapolator.h"
 
+#include <algorithm>
 #include <cmath>
+#include <glog/logging.h>
 
 namespace reflector_detect
 {
+namespace
+{
+// cos and sin of the heading change of an extrapolation, a series for the
+// small changes within a scan
+void DeltaCosSin(const double &angle, double *c, double *s)
+{
+    if (std::abs(angle) > 0.1)
+    {
+        *c = std::cos(angle);
+        *s = std::sin(angle);
+        return;
+    }
+    const double angle2 = angle * angle;
+    *c = 1. - angle2 / 2. * (1. - angle2 / 12.);
+    *s = angle * (1. - angle2 / 6. * (1. - angle2 / 20.));
+}
+
+// Pose with heading 'start' turned by 'delta', both given by cos and sin
+Eigen::Isometry2d Pose(const double &x, const double &y, const double &cos_start, const double &sin_start,
+                       const double &cos_delta, const double &sin_delta)
+{
+    const double cos_yaw = cos_start * cos_delta - sin_start * sin_delta;
+    const double sin_yaw = sin_start * cos_delta + cos_start * sin_delta;
+    Eigen::Isometry2d pose;
+    pose.linear() << cos_yaw, -sin_yaw, sin_yaw, cos_yaw;
+    pose.translation() << x, y;
+    return pose;
+}
+
+// Single queries return Rigid2d, which keeps only the angle
+transform::Rigid2d ToRigid2(const Eigen::Isometry2d &pose)
+{
+    return transform::Rigid2d(pose.translation(), std::atan2(pose.linear()(1, 0), pose.linear()(0, 0)));
+}
+} // namespace
 
 PoseExtrapolator::PoseExtrapolator()
+    : queue_head_(0), queue_tail_(0), dropped_(0), history_begin_(0), history_size_(0)
 {
 }
 
+void PoseExtrapolator::HandleOdometryData(const sensor::OdometryData &msg)
+{
+    const uint64_t tail = queue_tail_.load(std::memory_order_relaxed);
+    if (tail - queue_head_.load(std::memory_order_acquire) == kCapacity)
+    {
+        // No scan for a while, the consumer reports it
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    OdometrySample &sample = queue_[tail & (kCapacity - 1)];
+    sample.time = msg.time;
+    sample.x = msg.position.x();
+    sample.y = msg.position.y();
+    sample.yaw = 2 * std::atan2(msg.orientation.z(), msg.orientation.w());
+    sample.cos_yaw = std::cos(sample.yaw);
+    sample.sin_yaw = std::sin(sample.yaw);
+    sample.vx = msg.linear_velocity.x();
+    sample.vy = msg.linear_velocity.y();
+    sample.w = msg.angular_velocity.z();
+    queue_tail_.store(tail + 1, std::memory_order_release);
+}
+
+void PoseExtrapolator::Drain()
+{
+    uint64_t head = queue_head_.load(std::memory_order_relaxed);
+    const uint64_t tail = queue_tail_.load(std::memory_order_acquire);
+    for (; head != tail; ++head)
+    {
+        const OdometrySample &sample = queue_[head & (kCapacity - 1)];
+        // Keep the history sorted for the binary search
+        if (history_size_ > 0 && sample.time <= Sample(history_size_ - 1).time)
+            continue;
+        if (history_size_ == kCapacity)
+        {
+            ++history_begin_;
+            --history_size_;
+        }
+        history_[(history_begin_ + history_size_) & (kCapacity - 1)] = sample;
+        ++history_size_;
+    }
+    queue_head_.store(tail, std::memory_order_release);
+    const int dropped = dropped_.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0)
+        LOG(WARNING) << "Odometry queue is full, dropped " << dropped << " odometry data";
+}
+
 void PoseExtrapolator::TrimDataByTime(const double &time)
 {
-    std::lock_guard<std::mutex> lock(odometry_data_mutex_);
+    Drain();
 #ifdef USE_UNIFORM_VELOCITY
-    while (odometry_data_.size() > 2 && odometry_data_[1].time <= time)
+    while (history_size_ > 2 && Sample(1).time <= time)
     {
-        odometry_data_.pop_front();
+        ++history_begin_;
+        --history_size_;
     }
 #else
-    while (odometry_data_.size() > 1 && odometry_data_.front().time < time)
+    while (history_size_ > 1 && Sample(0).time < time)
     {
-        odometry_data_.pop_front();
+        ++history_begin_;
+        --history_size_;
     }
 #endif
 }
 
-void PoseExtrapolator::HandleOdometryData(const sensor::OdometryData &msg)
+int PoseExtrapolator::UpperBound(const double &time) const
 {
-    std::lock_guard<std::mutex> lock(odometry_data_mutex_);
-    odometry_data_.push_back(msg);
+    int first = 0;
+    int count = history_size_;
+    while (count > 0)
+    {
+        const int step = count / 2;
+        if (Sample(first + step).time <= time)
+        {
+            first += step + 1;
+            count -= step + 1;
+        }
+        else
+        {
+            count = step;
+        }
+    }
+    return first;
 }
 
 transform::Rigid2d PoseExtrapolator::ExtrapolatorPose(const double &time)
 {
-    std::lock_guard<std::mutex> lock(odometry_data_mutex_);
-    if (odometry_data_.empty())
+    Drain();
+    if (history_size_ == 0)
         return transform::Rigid2d();
 #ifdef USE_UNIFORM_VELOCITY
-    if (odometry_data_.size() < 2)
+    if (history_size_ < 2)
         return transform::Rigid2d();
-    const double start_time = odometry_data_.front().time;
-    const double end_time = odometry_data_.back().time;
-    if (time <= start_time)
-        return Interpolator(odometry_data_[0], odometry_data_[1], time);
-    if (time >= end_time)
-    {
-        const auto end_data = odometry_data_.back();
-        odometry_data_.pop_front();
-        const auto start_data = odometry_data_.back();
-        odometry_data_.push_back(end_data);
-        return Interpolator(start_data, end_data, time);
-    }
-    std::deque<sensor::OdometryData> temp_data;
-    sensor::OdometryData start_data;
-    while (!odometry_data_.empty() && odometry_data_.front().time <= time)
+    // Data bracketing 'time', the first or last two outside the history
+    const int start = std::max(0, std::min(history_size_ - 2, UpperBound(time) - 1));
+    return ToRigid2(Interpolator(Sample(start), Sample(start + 1), time));
+#else
+    // Extrapolate from the first data not before 'time', or the newest one
+    const int end = std::min(history_size_ - 1, UpperBound(time));
+    if (end > 0 && Sample(end - 1).time == time)
+        return ToRigid2(Interpolator(Sample(end - 1), time));
+    return ToRigid2(Interpolator(Sample(end), time));
+#endif
+}
+
+void PoseExtrapolator::ExtrapolatorPoses(const double &start_time, const double &time_step, const int &size,
+                                         std::vector<Eigen::Isometry2d> *poses)
+{
+    poses->resize(size);
+    Drain();
+#ifdef USE_UNIFORM_VELOCITY
+    if (history_size_ < 2)
+#else
+    if (history_size_ == 0)
+#endif
     {
-        start_data = odometry_data_.front();
-        odometry_data_.pop_front();
-        temp_data.push_back(start_data);
+        std::fill(poses->begin(), poses->end(), Eigen::Isometry2d::Identity());
+        return;
     }
-    const auto end_data = odometry_data_.front();
-    while (!temp_data.empty())
+    // Same data as ExtrapolatorPose, found by one forward sweep since times increase
+    int index = 0;
+    for (int i = 0; i < size; ++i)
     {
-        odometry_data_.push_front(temp_data.back());
-        temp_data.pop_back();
-    }
-    return Interpolator(start_data, end_data, time);
+        const double time = start_time + i * time_step;
+#ifdef USE_UNIFORM_VELOCITY
+        while (index + 2 < history_size_ && Sample(index + 1).time <= time)
+            ++index;
+        (*poses)[i] = Interpolator(Sample(index), Sample(index + 1), time);
 #else
-    const double start_time = odometry_data_.front().time;
-    const double end_time = odometry_data_.back().time;
-    if (time <= start_time)
-        return Interpolator(odometry_data_.front(), time);
-    if (time >= end_time)
-        return Interpolator(odometry_data_.back(), time);
-    sensor::OdometryData odom_data;
-    for (const auto &data : odometry_data_)
-    {
-        if (data.time >= time)
-            odom_data = data;
-    }
-    return Interpolator(odom_data, time);
+        while (index + 1 < history_size_ && Sample(index).time < time)
+            ++index;
+        (*poses)[i] = Interpolator(Sample(index), time);
 #endif
+    }
 }
 
-transform::Rigid2d PoseExtrapolator::Interpolator(const sensor::OdometryData &start,
-                                                  const sensor::OdometryData &end, const double &time)
+Eigen::Isometry2d PoseExtrapolator::Interpolator(const OdometrySample &start, const OdometrySample &end,
+                                                 const double &time) const
 {
-    assert(end.time > start.time);
-    const double start_time = start.time;
-    const double end_time = end.time;
-    const double ratio = (time - start_time) / (end_time - start_time);
-    const auto translation = start.position + ratio * (end.position - start.position);
-    const auto relative_rotation = end.orientation.inverse() * start.orientation;
-    const auto angular_velocity =
-        transform::RotationQuaternionToAngleAxisVector(relative_rotation) / (end_time - start_time);
-    const double start_yaw = 2 * std::atan2(start.orientation.z(), start.orientation.w());
-    const double now_yaw = start_yaw + (time - start_time) * angular_velocity.z();
-    return transform::Rigid2d(translation.head<2>(), {now_yaw});
+    const double ratio = (time - start.time) / (end.time - start.time);
+    double delta_yaw = end.yaw - start.yaw;
+    if (delta_yaw > M_PI)
+        delta_yaw -= 2 * M_PI;
+    else if (delta_yaw < -M_PI)
+        delta_yaw += 2 * M_PI;
+    double cos_delta, sin_delta;
+    DeltaCosSin(ratio * delta_yaw, &cos_delta, &sin_delta);
+    return Pose(start.x + ratio * (end.x - start.x), start.y + ratio * (end.y - start.y), start.cos_yaw,
+                start.sin_yaw, cos_delta, sin_delta);
 }
 
-transform::Rigid2d PoseExtrapolator::Interpolator(const sensor::OdometryData &start, const double &time)
+Eigen::Isometry2d PoseExtrapolator::Interpolator(const OdometrySample &start, const double &time) const
 {
-    if (start.time <= time)
-    {
-        const double delta_t = start.time - time;
-        const double angular_velocity = start.angular_velocity.z();
-        const double odom_yaw = 2 * std::atan2(start.orientation.z(), start.orientation.w());
-        const double now_yaw = odom_yaw - angular_velocity * delta_t;
-        const double vx = start.linear_velocity.x();
-        const double vy = start.linear_velocity.y();
-        const double odom_x = start.position.x();
-        const double odom_y = start.position.y();
-        const double x = odom_x - vx * delta_t * std::cos(now_yaw) + vy * delta_t * std::sin(now_yaw);
-        const double y = odom_y - vx * delta_t * std::sin(now_yaw) - vy * delta_t * std::cos(now_yaw);
-        return transform::Rigid2d({x, y}, {now_yaw});
-    }
+    // Constant velocity forward or backward from 'start', velocity is in the frame at 'time'
     const double delta_t = time - start.time;
-    const double angular_velocity = start.angular_velocity.z();
-    const double odom_yaw = 2 * std::atan2(start.orientation.z(), start.orientation.w());
-    const double now_yaw = odom_yaw - angular_velocity * delta_t;
-    const double vx = start.linear_velocity.x();
-    const double vy = start.linear_velocity.y();
-    const double odom_x = start.position.x();
-    const double odom_y = start.position.y();
-    const double x = odom_x + vx * delta_t * std::cos(now_yaw) - vy * delta_t * std::sin(now_yaw);
-    const double y = odom_y + vx * delta_t * std::sin(now_yaw) + vy * delta_t * std::cos(now_yaw);
-    return transform::Rigid2d({x, y}, {now_yaw});
+    double cos_delta, sin_delta;
+    DeltaCosSin(start.w * delta_t, &cos_delta, &sin_delta);
+    Eigen::Isometry2d pose = Pose(start.x, start.y, start.cos_yaw, start.sin_yaw, cos_delta, sin_delta);
+    pose.translation() += pose.linear() * Eigen::Vector2d(start.vx, start.vy) * delta_t;
+    return pose;
 }
 
-} // namespace reflector_detect
\ No newline at end of file
+} // namespace reflector_detect
@@ -0,0 +1,174 @@
+#include "reflector_ekf_slam/checkpoint.h"
+#include "common/common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glog/logging.h>
+
+namespace ekf
+{
+namespace
+{
+constexpr char kCheckpointMagic[8] = {'R', 'E', 'F', 'L', 'C', 'K', 'P', 'T'};
+constexpr uint32_t kCheckpointVersion = 1;
+
+struct CheckpointHeader
+{
+  char magic[8];
+  uint32_t version;
+  int32_t odom_model;
+  double time;
+  double linear_velocity_cov;
+  double angular_velocity_cov;
+  double observation_cov;
+  uint64_t state_dimension;
+  uint64_t map_size;
+};
+static_assert(sizeof(CheckpointHeader) == 64, "checkpoint header must keep arrays 8 byte aligned");
+
+// Bytes following the header. Returns false if N and M can not fit in 'size'
+// bytes, which is checked before multiplying so a broken header can not overflow.
+bool PayloadSize(const uint64_t &N, const uint64_t &M, const uint64_t &size, uint64_t *payload_size)
+{
+    const uint64_t values = size / sizeof(double);
+    if (N > std::min<uint64_t>(values, std::numeric_limits<int>::max()) || (N > 0 && N > values / N) ||
+        M > std::min<uint64_t>(values, std::numeric_limits<int>::max()))
+        return false;
+    *payload_size = sizeof(double) * (N + N * N) + sizeof(float) * 2 * M + sizeof(double) * 4 * M;
+    return true;
+}
+} // namespace
+
+bool WriteCheckpoint(const std::string &file, const Checkpoint &checkpoint)
+{
+    const auto &state = checkpoint.state;
+    const auto &map = checkpoint.map;
+    const uint64_t N = state.mu.rows();
+    const uint64_t M = map.reflector_map_.size();
+    CHECK(state.sigma.rows() == N && state.sigma.cols() == N);
+    CHECK(map.reflector_map_coviarance_.size() == M);
+
+    CheckpointHeader header;
+    std::memcpy(header.magic, kCheckpointMagic, sizeof(header.magic));
+    header.version = kCheckpointVersion;
+    header.odom_model = checkpoint.odom_model;
+    header.time = state.time;
+    header.linear_velocity_cov = checkpoint.linear_velocity_cov;
+    header.angular_velocity_cov = checkpoint.angular_velocity_cov;
+    header.observation_cov = checkpoint.observation_cov;
+    header.state_dimension = N;
+    header.map_size = M;
+
+    const std::string temporary = file + ".tmp";
+    {
+        std::ofstream out(temporary.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            LOG(WARNING) << "Can not open checkpoint " << temporary;
+            return false;
+        }
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(state.mu.data()), sizeof(double) * N);
+        out.write(reinterpret_cast<const char *>(state.sigma.data()), sizeof(double) * N * N);
+        for (const auto &reflector : map.reflector_map_)
+            out.write(reinterpret_cast<const char *>(reflector.data()), sizeof(float) * 2);
+        for (const auto &coviarance : map.reflector_map_coviarance_)
+            out.write(reinterpret_cast<const char *>(coviarance.data()), sizeof(double) * 4);
+        if (!out.flush())
+        {
+            LOG(WARNING) << "Failed to write checkpoint " << temporary;
+            return false;
+        }
+    }
+    if (std::rename(temporary.c_str(), file.c_str()) != 0)
+    {
+        LOG(WARNING) << "Failed to move checkpoint " << temporary << " to " << file;
+        return false;
+    }
+    return true;
+}
+
+bool LoadCheckpoint(const std::string &file, Checkpoint *checkpoint)
+{
+    if (file.empty() || !IsFileExist(file))
+        return false;
+    const int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        LOG(WARNING) << "Can not open checkpoint " << file;
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) < sizeof(CheckpointHeader))
+    {
+        LOG(WARNING) << "Checkpoint " << file << " is too short";
+        close(fd);
+        return false;
+    }
+    const size_t size = file_stat.st_size;
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        LOG(WARNING) << "Can not map checkpoint " << file;
+        return false;
+    }
+
+    const char *bytes = static_cast<const char *>(data);
+    CheckpointHeader header;
+    std::memcpy(&header, bytes, sizeof(header));
+    uint64_t payload_size = 0;
+    bool valid = true;
+    if (std::memcmp(header.magic, kCheckpointMagic, sizeof(header.magic)) != 0 || header.version != kCheckpointVersion)
+    {
+        LOG(WARNING) << "Checkpoint " << file << " is not a version " << kCheckpointVersion << " checkpoint";
+        valid = false;
+    }
+    else if (header.state_dimension < 3 || (header.state_dimension - 3) % 2 != 0 ||
+             !PayloadSize(header.state_dimension, header.map_size, size, &payload_size) ||
+             sizeof(header) + payload_size != size)
+    {
+        LOG(WARNING) << "Checkpoint " << file << " is broken, state dimension " << header.state_dimension
+                     << ", map size " << header.map_size << ", file size " << size;
+        valid = false;
+    }
+    if (!valid)
+    {
+        munmap(data, size);
+        return false;
+    }
+
+    const int N = header.state_dimension;
+    const int M = header.map_size;
+    const double *mu = reinterpret_cast<const double *>(bytes + sizeof(header));
+    const double *sigma = mu + N;
+    const float *reflectors = reinterpret_cast<const float *>(sigma + static_cast<size_t>(N) * N);
+    const double *coviarances = reinterpret_cast<const double *>(reflectors + 2 * M);
+
+    checkpoint->state.time = header.time;
+    checkpoint->state.mu = Eigen::Map<const Eigen::VectorXd>(mu, N);
+    checkpoint->state.sigma = Eigen::Map<const Eigen::MatrixXd>(sigma, N, N);
+    checkpoint->map.reflector_map_.resize(M);
+    checkpoint->map.reflector_map_coviarance_.resize(M);
+    for (int i = 0; i < M; ++i)
+    {
+        checkpoint->map.reflector_map_[i] = Eigen::Map<const Eigen::Vector2f>(reflectors + 2 * i);
+        checkpoint->map.reflector_map_coviarance_[i] = Eigen::Map<const Eigen::Matrix2d>(coviarances + 4 * i);
+    }
+    checkpoint->odom_model = static_cast<sensor::OdometryModel>(header.odom_model);
+    checkpoint->linear_velocity_cov = header.linear_velocity_cov;
+    checkpoint->angular_velocity_cov = header.angular_velocity_cov;
+    checkpoint->observation_cov = header.observation_cov;
+    munmap(data, size);
+    return true;
+}
+
+} // namespace ekf
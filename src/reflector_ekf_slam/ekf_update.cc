@@ -0,0 +1,403 @@
+#include "reflector_ekf_slam/ekf_update.h"
+#include "reflector_ekf_slam/odometry_model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <glog/logging.h>
+
+namespace ekf
+{
+
+namespace
+{
+template <typename OdometryModel>
+void PolicyMotion(const double &theta, const Eigen::Vector3d &vt, const double &dt, const Eigen::Matrix3d &Qu,
+                  Eigen::Vector3d *delta, Eigen::Matrix3d *G, Eigen::Matrix3d *Q)
+{
+    constexpr int kInputSize = OdometryModel::kInputSize;
+    typename OdometryModel::InputJacobian G_u;
+    OdometryModel::Motion(theta, vt, dt, delta, G, &G_u);
+    *Q = G_u * Qu.topLeftCorner<kInputSize, kInputSize>() * G_u.transpose();
+}
+} // namespace
+
+Eigen::Matrix3d InputCoviarance(const sensor::OdometryModel &model, const double &linear_velocity_cov,
+                                const double &angular_velocity_cov)
+{
+    Eigen::Matrix3d Qu = Eigen::Matrix3d::Zero();
+    if (model == sensor::OdometryModel::DIFF)
+        Qu.topLeftCorner<2, 2>() = DiffOdometryModel::Coviarance(linear_velocity_cov, angular_velocity_cov);
+    else
+        Qu = OmniOdometryModel::Coviarance(linear_velocity_cov, angular_velocity_cov);
+    return Qu;
+}
+
+void RobotMotion(const double &theta, const Eigen::Vector3d &vt, const double &dt,
+                 const sensor::OdometryModel &model, const Eigen::Matrix3d &Qu, Eigen::Vector3d *delta,
+                 Eigen::Matrix3d *G, Eigen::Matrix3d *Q)
+{
+    if (model == sensor::OdometryModel::DIFF)
+        PolicyMotion<DiffOdometryModel>(theta, vt, dt, Qu, delta, G, Q);
+    else
+        PolicyMotion<OmniOdometryModel>(theta, vt, dt, Qu, delta, G, Q);
+}
+
+Eigen::MatrixXd SolveInnovation(const Eigen::MatrixXd &S, const Eigen::MatrixXd &rhs,
+                                const InnovationSolver &solver)
+{
+    if (solver == InnovationSolver::LLT)
+    {
+        Eigen::LLT<Eigen::MatrixXd> llt(S);
+        if (llt.info() == Eigen::Success)
+            return llt.solve(rhs);
+        LOG(WARNING) << "Innovation covariance is not positive definite, use LDLT instead";
+    }
+    else if (solver == InnovationSolver::INVERSE)
+    {
+        return S.inverse() * rhs;
+    }
+    return S.ldlt().solve(rhs);
+}
+
+namespace
+{
+// Columns of the mixed precision landmark block updated at once
+constexpr int kPanelColumns = 64;
+
+// Whole covariance in double. Updates are applied to the lower triangle at
+// once and mirrored by Commit().
+class DenseCoviarance
+{
+public:
+  explicit DenseCoviarance(Eigen::Ref<Eigen::MatrixXd> sigma) : sigma_(sigma) {}
+
+  int rows() const { return sigma_.rows(); }
+  // sigma(:, columns)
+  Eigen::MatrixXd Columns(const std::vector<int> &columns) const
+  {
+    Eigen::MatrixXd result(sigma_.rows(), columns.size());
+    for (int k = 0; k < columns.size(); ++k)
+      result.col(k) = sigma_.col(columns[k]);
+    return result;
+  }
+  // lower(sigma) -= U * V^T
+  void SubtractLower(const Eigen::MatrixXd &U, const Eigen::MatrixXd &V)
+  {
+    sigma_.triangularView<Eigen::Lower>() -= U * V.transpose();
+  }
+  // lower(sigma) += alpha * W * W^T
+  void RankUpdate(const Eigen::MatrixXd &W, const double &alpha)
+  {
+    sigma_.selfadjointView<Eigen::Lower>().rankUpdate(W, alpha);
+  }
+  void Commit()
+  {
+    sigma_.triangularView<Eigen::StrictlyUpper>() = sigma_.transpose();
+  }
+
+private:
+  Eigen::Ref<Eigen::MatrixXd> sigma_;
+};
+
+// Robot rows in double and landmark block in float, see StateBuffer. Updates
+// are collected and applied by Commit() in one pass over the landmark block,
+// by panels of columns which are computed in double and rounded once.
+class MixedCoviarance
+{
+public:
+  MixedCoviarance(Eigen::Ref<Eigen::MatrixXd> robot_rows, Eigen::Ref<Eigen::MatrixXf> landmark_sigma)
+      : robot_rows_(robot_rows), landmark_sigma_(landmark_sigma)
+  {
+    CHECK(landmark_sigma_.rows() == robot_rows_.cols() - 3 && landmark_sigma_.cols() == landmark_sigma_.rows());
+  }
+
+  int rows() const { return robot_rows_.cols(); }
+  Eigen::MatrixXd Columns(const std::vector<int> &columns) const
+  {
+    Eigen::MatrixXd result(rows(), columns.size());
+    for (int k = 0; k < columns.size(); ++k)
+    {
+      const int c = columns[k];
+      if (c < 3)
+      {
+        result.col(k) = robot_rows_.row(c).transpose();
+        continue;
+      }
+      result.col(k).head<3>() = robot_rows_.col(c);
+      result.col(k).tail(rows() - 3) = landmark_sigma_.col(c - 3).cast<double>();
+    }
+    return result;
+  }
+  void SubtractLower(const Eigen::MatrixXd &U, const Eigen::MatrixXd &V)
+  {
+    us_.push_back(U);
+    vs_.push_back(V);
+  }
+  void RankUpdate(const Eigen::MatrixXd &W, const double &alpha)
+  {
+    us_.push_back(-alpha * W);
+    vs_.push_back(W);
+  }
+  void Commit()
+  {
+    if (us_.empty())
+      return;
+    const int N = rows();
+    const int M = N - 3;
+    int T = 0;
+    for (const auto &U : us_)
+      T += U.cols();
+    Eigen::MatrixXd U(N, T), V(N, T);
+    for (int i = 0, t = 0; i < us_.size(); t += us_[i].cols(), ++i)
+    {
+      U.middleCols(t, us_[i].cols()) = us_[i];
+      V.middleCols(t, us_[i].cols()) = vs_[i];
+    }
+    us_.clear();
+    vs_.clear();
+
+    // Robot row r holds the lower entries (j, r) for j >= r, the rest of the
+    // robot block is mirrored
+    robot_rows_.noalias() -= V.topRows<3>() * U.transpose();
+    robot_rows_.leftCols<3>().triangularView<Eigen::StrictlyLower>() = robot_rows_.leftCols<3>().transpose();
+
+    // Lower part of each panel, then its transpose above the diagonal
+    Eigen::MatrixXd panel(M, kPanelColumns);
+    for (int j = 0; j < M; j += kPanelColumns)
+    {
+      const int b = std::min(kPanelColumns, M - j);
+      const int h = M - j;
+      auto lower = panel.topLeftCorner(h, b);
+      lower = landmark_sigma_.block(j, j, h, b).cast<double>();
+      lower.noalias() -= U.bottomRows(h) * V.middleRows(3 + j, b).transpose();
+      landmark_sigma_.block(j, j, h, b) = lower.cast<float>();
+      landmark_sigma_.block(j, j + b, b, h - b) = lower.bottomRows(h - b).transpose().cast<float>();
+      auto diagonal = landmark_sigma_.block(j, j, b, b);
+      diagonal.triangularView<Eigen::StrictlyUpper>() = diagonal.transpose();
+    }
+  }
+
+private:
+  Eigen::Ref<Eigen::MatrixXd> robot_rows_;
+  Eigen::Ref<Eigen::MatrixXf> landmark_sigma_;
+  std::vector<Eigen::MatrixXd> us_;
+  std::vector<Eigen::MatrixXd> vs_;
+};
+
+template <typename Coviarance>
+void SparseUpdateImpl(const std::vector<ObservationBlock> &blocks, const EKFOptions &options,
+                      Eigen::Ref<Eigen::VectorXd> mu, Coviarance *sigma)
+{
+    if (blocks.empty())
+        return;
+    const int N = mu.rows();
+    CHECK(sigma->rows() == N);
+
+    // Touched columns of sigma: robot pose first, then every observed landmark once
+    std::vector<int> columns = {0, 1, 2};
+    std::map<int, int> landmark_columns;
+    int rows = 0;
+    for (const auto &block : blocks)
+    {
+        rows += block.innovation.rows();
+        if (block.landmark_index < 0 || landmark_columns.count(block.landmark_index))
+            continue;
+        CHECK(block.landmark_index >= 3 && block.landmark_index + 1 < N);
+        landmark_columns[block.landmark_index] = columns.size();
+        columns.push_back(block.landmark_index);
+        columns.push_back(block.landmark_index + 1);
+    }
+    const int K = columns.size();
+
+    // Compressed jacobian over the touched columns only
+    Eigen::MatrixXd H = Eigen::MatrixXd::Zero(rows, K);
+    Eigen::VectorXd innovation(rows);
+    Eigen::MatrixXd S = Eigen::MatrixXd::Zero(rows, rows);
+    int row = 0;
+    for (const auto &block : blocks)
+    {
+        const int r = block.innovation.rows();
+        H.block(row, 0, r, 3) = block.robot_jacobian;
+        if (block.landmark_index >= 0)
+            H.block(row, landmark_columns[block.landmark_index], r, 2) = block.landmark_jacobian;
+        innovation.segment(row, r) = block.innovation;
+        S.block(row, row, r, r) = block.noise;
+        row += r;
+    }
+
+    // sigma * H^T = sigma(:, columns) * H_c^T
+    const Eigen::MatrixXd sigma_columns = sigma->Columns(columns);
+    const Eigen::MatrixXd PHt = sigma_columns * H.transpose();
+
+    // H * sigma * H^T + Q = H_c * (sigma * H^T)(columns, :) + Q
+    Eigen::MatrixXd PHt_rows(K, rows);
+    for (int k = 0; k < K; ++k)
+        PHt_rows.row(k) = PHt.row(columns[k]);
+    S.noalias() += H * PHt_rows;
+
+    Eigen::LLT<Eigen::MatrixXd> llt;
+    bool use_llt = false;
+    if (options.innovation_solver == InnovationSolver::LLT)
+    {
+        llt.compute(S);
+        use_llt = llt.info() == Eigen::Success;
+        if (!use_llt)
+            LOG(WARNING) << "Innovation covariance is not positive definite, use LDLT instead";
+    }
+
+    if (use_llt && !options.use_joseph_form)
+    {
+        // K * H * sigma = W * W^T with W = sigma * H^T * L^-T, S = L * L^T
+        const Eigen::MatrixXd W = llt.matrixU().solve<Eigen::OnTheRight>(PHt);
+        mu.noalias() += W * llt.matrixL().solve(innovation);
+        sigma->RankUpdate(W, -1.);
+        sigma->Commit();
+        return;
+    }
+
+    // K^T = S^-1 * (sigma * H^T)^T
+    Eigen::MatrixXd K_t;
+    if (use_llt)
+        K_t = llt.solve(PHt.transpose()).transpose();
+    else if (options.innovation_solver == InnovationSolver::INVERSE)
+        K_t = PHt * S.inverse();
+    else
+        K_t = S.ldlt().solve(PHt.transpose()).transpose();
+    mu.noalias() += K_t * innovation;
+
+    // K * H * sigma = K * (sigma * H^T)^T is symmetric: update the lower half and mirror it
+    sigma->SubtractLower(K_t, PHt);
+    if (options.use_joseph_form)
+    {
+        // (I - K * H) * sigma * (I - K * H)^T + K * Q * K^T
+        //   = sigma - K * H * sigma - sigma * H^T * K^T + K * S * K^T
+        sigma->SubtractLower(PHt, K_t);
+        if (use_llt)
+        {
+            const Eigen::MatrixXd KL = K_t * llt.matrixL();
+            sigma->RankUpdate(KL, 1.);
+        }
+        else
+        {
+            const Eigen::MatrixXd SKt = S * K_t.transpose();
+            sigma->SubtractLower(-K_t, SKt.transpose());
+        }
+    }
+    sigma->Commit();
+}
+
+template <typename Coviarance>
+int SequentialUpdateImpl(const std::vector<ObservationBlock> &blocks, const EKFOptions &options,
+                         Eigen::Ref<Eigen::VectorXd> mu, Coviarance *sigma)
+{
+    if (blocks.empty())
+        return 0;
+    const int N = mu.rows();
+    CHECK(sigma->rows() == N);
+
+    // Innovations of the blocks are linearized at the prior mean
+    const Eigen::VectorXd mu_prior = mu;
+    int rejected = 0;
+    for (const auto &block : blocks)
+    {
+        const int r = block.innovation.rows();
+        const int l = block.landmark_index;
+        CHECK(l < 0 || (l >= 3 && l + 1 < N));
+
+        Eigen::VectorXd innovation = block.innovation - block.robot_jacobian * (mu.head<3>() - mu_prior.head<3>());
+        // sigma * H^T, H only has the robot and the landmark columns
+        std::vector<int> columns = {0, 1, 2};
+        if (l >= 0)
+        {
+            columns.push_back(l);
+            columns.push_back(l + 1);
+        }
+        const Eigen::MatrixXd sigma_columns = sigma->Columns(columns);
+        Eigen::MatrixXd PHt = sigma_columns.leftCols<3>() * block.robot_jacobian.transpose();
+        if (l >= 0)
+        {
+            innovation -= block.landmark_jacobian * (mu.segment<2>(l) - mu_prior.segment<2>(l));
+            PHt.noalias() += sigma_columns.rightCols<2>() * block.landmark_jacobian.transpose();
+        }
+        Eigen::MatrixXd S = block.robot_jacobian * PHt.topRows<3>() + block.noise;
+        if (l >= 0)
+            S.noalias() += block.landmark_jacobian * PHt.middleRows<2>(l);
+
+        Eigen::MatrixXd S_inverse;
+        if (r == 2)
+            S_inverse = Eigen::Matrix2d(S).inverse();
+        else
+            S_inverse = S.inverse();
+        if (innovation.dot(S_inverse * innovation) > ChiSquareGate(r))
+        {
+            ++rejected;
+            continue;
+        }
+
+        const Eigen::MatrixXd K = PHt * S_inverse;
+        mu.noalias() += K * innovation;
+        // K * H * sigma = K * (sigma * H^T)^T is symmetric: update the lower half and mirror it
+        sigma->SubtractLower(K, PHt);
+        if (options.use_joseph_form)
+        {
+            // Same expansion as SparseUpdate
+            sigma->SubtractLower(PHt, K);
+            const Eigen::MatrixXd SKt = S * K.transpose();
+            sigma->SubtractLower(-K, SKt.transpose());
+        }
+        sigma->Commit();
+    }
+    return rejected;
+}
+} // namespace
+
+void SparseUpdate(const std::vector<ObservationBlock> &blocks, const EKFOptions &options,
+                  Eigen::Ref<Eigen::VectorXd> mu, Eigen::Ref<Eigen::MatrixXd> sigma)
+{
+    CHECK(sigma.rows() == sigma.cols());
+    DenseCoviarance coviarance(sigma);
+    SparseUpdateImpl(blocks, options, mu, &coviarance);
+}
+
+void SparseUpdate(const std::vector<ObservationBlock> &blocks, const EKFOptions &options, StateBuffer *state)
+{
+    if (!state->IsMixedPrecision())
+    {
+        SparseUpdate(blocks, options, state->mu(), state->sigma());
+        return;
+    }
+    MixedCoviarance coviarance(state->robot_rows(), state->landmark_sigma());
+    SparseUpdateImpl(blocks, options, state->mu(), &coviarance);
+}
+
+double ChiSquareGate(const int &dof)
+{
+    CHECK(dof >= 1 && dof <= 3);
+    static const double kGates[] = {6.635, 9.210, 11.345};
+    return kGates[dof - 1];
+}
+
+int SequentialUpdate(const std::vector<ObservationBlock> &blocks, const EKFOptions &options,
+                     Eigen::Ref<Eigen::VectorXd> mu, Eigen::Ref<Eigen::MatrixXd> sigma)
+{
+    CHECK(sigma.rows() == sigma.cols());
+    DenseCoviarance coviarance(sigma);
+    return SequentialUpdateImpl(blocks, options, mu, &coviarance);
+}
+
+int SequentialUpdate(const std::vector<ObservationBlock> &blocks, const EKFOptions &options, StateBuffer *state)
+{
+    if (!state->IsMixedPrecision())
+        return SequentialUpdate(blocks, options, state->mu(), state->sigma());
+    MixedCoviarance coviarance(state->robot_rows(), state->landmark_sigma());
+    return SequentialUpdateImpl(blocks, options, state->mu(), &coviarance);
+}
+
+void Symmetrize(Eigen::Ref<Eigen::MatrixXd> sigma)
+{
+    const Eigen::MatrixXd symmetric = 0.5 * (sigma + sigma.transpose());
+    sigma = symmetric;
+}
+
+} // namespace ekf
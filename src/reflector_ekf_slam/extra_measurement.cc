@@ -0,0 +1,31 @@
+#include "reflector_ekf_slam/extra_measurement.h"
+#include "transform/transform.h"
+
+namespace ekf
+{
+
+void GpsPoseMeasurement::AddBlocks(const sensor::Observation &observation, const Eigen::Ref<const Eigen::VectorXd> &mu,
+                                   std::vector<ObservationBlock> *blocks)
+{
+    if (!observation.gps_pose_)
+        return;
+    // Pose observation from scan matching, directly observe robot pose
+    ObservationBlock block;
+    block.robot_jacobian = Eigen::Matrix3d::Identity();
+    block.landmark_index = -1;
+    Eigen::Vector3d delta_zt(observation.gps_pose_->translation().x() - mu(0),
+                             observation.gps_pose_->translation().y() - mu(1),
+                             observation.gps_pose_->rotation().angle() - mu(2));
+    const double delta_theta = delta_zt(2);
+    Eigen::Quaterniond dq(std::cos(delta_theta / 2), 0., 0., std::sin(delta_theta / 2));
+    delta_zt(2) = transform::RotationQuaternionToAngleAxisVector(dq)(2);
+    block.innovation = delta_zt;
+    Eigen::Matrix3d pose_coviarance;
+    pose_coviarance << 0.05 * 0.05, 0., 0.,
+        0., 0.05 * 0.05, 0.,
+        0., 0., 0.017 * 0.017;
+    block.noise = pose_coviarance;
+    blocks->push_back(block);
+}
+
+} // namespace ekf
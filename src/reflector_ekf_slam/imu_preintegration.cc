@@ -0,0 +1,73 @@
+#include "reflector_ekf_slam/imu_preintegration.h"
+
+#include <cmath>
+
+namespace ekf
+{
+ImuPreintegration::ImuPreintegration(const sensor::OdometryModel &odom_model, const double &linear_velocity_cov,
+                                     const double &angular_velocity_cov)
+    : omni_(odom_model == sensor::OdometryModel::OMNI), velocity_(Eigen::Vector2d::Zero()), yaw_rate_(0.),
+      time_(0.), delta_(Eigen::Vector3d::Zero()), coviarance_(Eigen::Matrix3d::Zero())
+{
+    Qu_ << linear_velocity_cov, 0., 0.,
+        0., omni_ ? linear_velocity_cov : 0., 0.,
+        0., 0., angular_velocity_cov;
+}
+
+void ImuPreintegration::Reset(const double &time)
+{
+    time_ = time;
+    delta_.setZero();
+    coviarance_.setZero();
+}
+
+void ImuPreintegration::Integrate(const double &time)
+{
+    const double dt = time - time_;
+    if (!(dt > 0.))
+        return;
+    const Eigen::Vector2d velocity(velocity_.x(), omni_ ? velocity_.y() : 0.);
+    // DIFF moves along the mean heading of the step, as DiffOdometryModel
+    const double theta = delta_(2) + (omni_ ? 0. : yaw_rate_ * dt / 2);
+    const double cos_theta = std::cos(theta);
+    const double sin_theta = std::sin(theta);
+    Eigen::Matrix2d R, dR;
+    R << cos_theta, -sin_theta,
+        sin_theta, cos_theta;
+    dR << -sin_theta, -cos_theta,
+        cos_theta, -sin_theta;
+
+    // Error of (position, heading) of the interval w.r.t. its heading and the velocity inputs
+    Eigen::Matrix3d F = Eigen::Matrix3d::Identity();
+    F.block<2, 1>(0, 2) = dR * velocity * dt;
+    Eigen::Matrix3d B = Eigen::Matrix3d::Zero();
+    B.topLeftCorner<2, 2>() = R * dt;
+    if (!omni_)
+        B.block<2, 1>(0, 2) = dR * velocity * dt * dt / 2;
+    B(2, 2) = dt;
+    coviarance_ = F * coviarance_ * F.transpose() + B * Qu_ * B.transpose();
+
+    delta_.head<2>() += R * velocity * dt;
+    delta_(2) += yaw_rate_ * dt;
+    time_ = time;
+}
+
+void ImuPreintegration::Motion(const double &theta, Eigen::Vector3d *delta, Eigen::Matrix3d *G,
+                               Eigen::Matrix3d *Q) const
+{
+    const double cos_theta = std::cos(theta);
+    const double sin_theta = std::sin(theta);
+    Eigen::Matrix2d R, dR;
+    R << cos_theta, -sin_theta,
+        sin_theta, cos_theta;
+    dR << -sin_theta, -cos_theta,
+        cos_theta, -sin_theta;
+    delta->head<2>() = R * delta_.head<2>();
+    (*delta)(2) = delta_(2);
+    G->setIdentity();
+    G->block<2, 1>(0, 2) = dR * delta_.head<2>();
+    Eigen::Matrix3d B = Eigen::Matrix3d::Identity();
+    B.topLeftCorner<2, 2>() = R;
+    *Q = B * coviarance_ * B.transpose();
+}
+} // namespace ekf
@@ -0,0 +1,89 @@
+#include "reflector_ekf_slam/landmark_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <glog/logging.h>
+
+namespace ekf
+{
+
+double LandmarkMatchRadius(const Eigen::Matrix2d &coviarance)
+{
+    // 99% quantile of chi-square with 2 degrees of freedom
+    constexpr double kChiSquareGate = 9.21;
+    const double a = coviarance(0, 0);
+    const double b = 0.5 * (coviarance(0, 1) + coviarance(1, 0));
+    const double c = coviarance(1, 1);
+    const double lambda_max = 0.5 * (a + c) + std::sqrt(0.25 * (a - c) * (a - c) + b * b);
+    if (!(lambda_max > 0.))
+        return 0.;
+    return std::min(kStateMatchDistance, std::sqrt(kChiSquareGate * lambda_max));
+}
+
+LandmarkIndex::LandmarkIndex(const double &resolution, const double &slack)
+    : resolution_(resolution), slack_(slack)
+{
+    CHECK(resolution_ > 0. && slack_ >= 0.);
+}
+
+void LandmarkIndex::Clear()
+{
+    cells_.clear();
+    positions_.clear();
+}
+
+void LandmarkIndex::Update(const int &id, const Eigen::Vector2d &position)
+{
+    CHECK(id >= 0 && id <= positions_.size());
+    if (id == positions_.size())
+    {
+        positions_.push_back(position);
+        cells_[GetCellKey(position)].push_back(id);
+        return;
+    }
+    if ((position - positions_[id]).norm() <= slack_)
+        return;
+    const KeyType old_key = GetCellKey(positions_[id]);
+    const KeyType new_key = GetCellKey(position);
+    positions_[id] = position;
+    if (old_key == new_key)
+        return;
+    auto &old_cell = cells_[old_key];
+    old_cell.erase(std::find(old_cell.begin(), old_cell.end(), id));
+    if (old_cell.empty())
+        cells_.erase(old_key);
+    cells_[new_key].push_back(id);
+}
+
+void LandmarkIndex::Query(const Eigen::Vector2d &point, const double &radius, std::vector<int> *ids) const
+{
+    const double r = radius + slack_;
+    const int min_x = GetCellIndex(point.x() - r), max_x = GetCellIndex(point.x() + r);
+    const int min_y = GetCellIndex(point.y() - r), max_y = GetCellIndex(point.y() + r);
+    for (int x = min_x; x <= max_x; ++x)
+    {
+        for (int y = min_y; y <= max_y; ++y)
+        {
+            const auto it = cells_.find(IndexToKey(x, y));
+            if (it != cells_.end())
+                ids->insert(ids->end(), it->second.begin(), it->second.end());
+        }
+    }
+}
+
+LandmarkIndex::KeyType LandmarkIndex::GetCellKey(const Eigen::Vector2d &position) const
+{
+    return IndexToKey(GetCellIndex(position.x()), GetCellIndex(position.y()));
+}
+
+LandmarkIndex::KeyType LandmarkIndex::IndexToKey(const int &x, const int &y)
+{
+    return (static_cast<KeyType>(x) << 32) | static_cast<uint32_t>(y);
+}
+
+int LandmarkIndex::GetCellIndex(const double &value) const
+{
+    return static_cast<int>(std::floor(value / resolution_));
+}
+
+} // namespace ekf
@@ -0,0 +1,190 @@
+#include "reflector_ekf_slam/pose_hypothesis_bank.h"
+#include "reflector_ekf_slam/odometry_model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <glog/logging.h>
+
+namespace ekf
+{
+namespace
+{
+// Hypotheses less likely than the best one by this log likelihood are dropped
+constexpr double kPruneLogLikelihood = 20.;
+// Hypotheses closer than this to a more likely one are merged into it
+constexpr double kMergeDistance = 0.1;
+constexpr double kMergeAngle = 0.05;
+
+template <typename OdometryModel>
+void PredictHypothesis(const Eigen::Vector3d &vt, const double &dt, const Eigen::MatrixXd &Qu,
+                       PoseHypothesis *hypothesis)
+{
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G;
+    typename OdometryModel::InputJacobian G_u;
+    OdometryModel::Motion(hypothesis->pose(2), vt, dt, &delta, &G, &G_u);
+    hypothesis->coviarance = G * hypothesis->coviarance * G.transpose() + G_u * Qu * G_u.transpose();
+    hypothesis->pose += delta;
+    hypothesis->pose(2) = std::atan2(std::sin(hypothesis->pose(2)), std::cos(hypothesis->pose(2))); //norm
+}
+} // namespace
+
+PoseHypothesisBank::PoseHypothesisBank(const EKFOptions &options, const sensor::Map &map,
+                                       const sensor::ReflectorMapIndex &map_index, const int &num_threads)
+    : options_(options), map_(map), map_index_(map_index), time_(options.init_time),
+      vt_(Eigen::Vector3d::Zero()), scans_(0), thread_pool_(num_threads)
+{
+    switch (options_.odom_model)
+    {
+    case sensor::OdometryModel::DIFF:
+        Qu_ = DiffOdometryModel::Coviarance(options_.linear_velocity_cov, options_.angular_velocity_cov);
+        break;
+    default:
+        Qu_ = OmniOdometryModel::Coviarance(options_.linear_velocity_cov, options_.angular_velocity_cov);
+        break;
+    }
+    Qt_ << options_.observation_cov, 0.,
+        0., options_.observation_cov;
+    LOG(INFO) << "Pose hypothesis bank runs on " << thread_pool_.Size() << " threads";
+}
+
+void PoseHypothesisBank::Reset(const double &time, const std::vector<Eigen::Vector3d> &poses,
+                               const Eigen::Matrix3d &coviarance)
+{
+    time_ = time;
+    scans_ = 0;
+    hypotheses_.clear();
+    hypotheses_.reserve(poses.size());
+    for (const auto &pose : poses)
+        hypotheses_.push_back(PoseHypothesis{pose, coviarance, 0., 0});
+    LOG(INFO) << "Pose hypothesis bank starts with " << Size() << " hypotheses";
+}
+
+void PoseHypothesisBank::Predict(const double &dt)
+{
+    if (options_.odom_model == sensor::OdometryModel::DIFF)
+        thread_pool_.ParallelFor(Size(), [&](const int &i) {
+            PredictHypothesis<DiffOdometryModel>(vt_, dt, Qu_, &hypotheses_[i]);
+        });
+    else
+        thread_pool_.ParallelFor(Size(), [&](const int &i) {
+            PredictHypothesis<OmniOdometryModel>(vt_, dt, Qu_, &hypotheses_[i]);
+        });
+}
+
+void PoseHypothesisBank::HandleOdometryMessage(const sensor::OdometryData &odometry)
+{
+    // drop old data
+    if (odometry.time < time_)
+        return;
+    vt_ = Eigen::Vector3d(odometry.linear_velocity.x(), odometry.linear_velocity.y(), odometry.angular_velocity.z());
+    Predict(odometry.time - time_);
+    time_ = odometry.time;
+}
+
+void PoseHypothesisBank::HandleObservationMessage(const sensor::Observation &observation)
+{
+    if (observation.time_ < time_)
+        return;
+    Predict(observation.time_ - time_);
+    time_ = observation.time_;
+    if (hypotheses_.empty())
+        return;
+    thread_pool_.ParallelFor(Size(), [&](const int &i) { Update(observation.cloud_, &hypotheses_[i]); });
+    ++scans_;
+    Prune();
+}
+
+void PoseHypothesisBank::Update(const sensor::PointCloud &observed, PoseHypothesis *hypothesis) const
+{
+    // An unmatched reflector counts as if it were observed at the gate
+    const double unmatched_log_likelihood = -0.5 * (kMapMatchGate * kMapMatchGate + std::log(Qt_.determinant()));
+    Eigen::Vector3d &mu = hypothesis->pose;
+    Eigen::Matrix3d &sigma = hypothesis->coviarance;
+    hypothesis->matched = 0;
+    for (const auto &point : observed)
+    {
+        const Eigen::Vector2d z = point.cast<double>();
+        const double c = std::cos(mu(2)), s = std::sin(mu(2));
+        Eigen::Matrix2d R;
+        R << c, -s,
+            s, c;
+        double distance;
+        const int id = map_index_.Match(map_, (R * z + mu.head<2>()).cast<float>(), &distance);
+        if (id < 0)
+        {
+            hypothesis->log_likelihood += unmatched_log_likelihood;
+            continue;
+        }
+        // z = R^T * (m - t), map reflector uncertainty is rotated into robot frame
+        const Eigen::Vector2d delta = map_.reflector_map_[id].cast<double>() - mu.head<2>();
+        const Eigen::Vector2d innovation = z - R.transpose() * delta;
+        Eigen::Matrix<double, 2, 3> H;
+        H << -c, -s, -s * delta.x() + c * delta.y(),
+            s, -c, -c * delta.x() - s * delta.y();
+        const Eigen::Matrix2d S = H * sigma * H.transpose() + Qt_ +
+                                  R.transpose() * map_.reflector_map_coviarance_[id] * R;
+        const Eigen::LLT<Eigen::Matrix2d> llt(S);
+        const double d2 = innovation.dot(llt.solve(innovation));
+        if (llt.info() != Eigen::Success || d2 > kMapMatchGate * kMapMatchGate)
+        {
+            hypothesis->log_likelihood += unmatched_log_likelihood;
+            continue;
+        }
+        hypothesis->log_likelihood += -0.5 * (d2 + std::log(S.determinant()));
+        ++hypothesis->matched;
+
+        const Eigen::Matrix<double, 3, 2> K = llt.solve(H * sigma).transpose();
+        mu += K * innovation;
+        mu(2) = std::atan2(std::sin(mu(2)), std::cos(mu(2))); //norm
+        sigma = (Eigen::Matrix3d::Identity() - K * H) * sigma;
+        sigma = 0.5 * (sigma + sigma.transpose());
+    }
+}
+
+void PoseHypothesisBank::Prune()
+{
+    std::sort(hypotheses_.begin(), hypotheses_.end(), [](const PoseHypothesis &lhs, const PoseHypothesis &rhs) {
+        return lhs.log_likelihood > rhs.log_likelihood;
+    });
+    const double best = hypotheses_.front().log_likelihood;
+    std::vector<PoseHypothesis> kept;
+    for (auto &hypothesis : hypotheses_)
+    {
+        if (hypothesis.log_likelihood < best - kPruneLogLikelihood)
+            break;
+        const bool merged = std::any_of(kept.begin(), kept.end(), [&](const PoseHypothesis &other) {
+            const double angle = hypothesis.pose(2) - other.pose(2);
+            return (hypothesis.pose.head<2>() - other.pose.head<2>()).norm() < kMergeDistance &&
+                   std::abs(std::atan2(std::sin(angle), std::cos(angle))) < kMergeAngle;
+        });
+        if (merged)
+            continue;
+        // Only differences matter, keep the sums bounded
+        hypothesis.log_likelihood -= best;
+        kept.push_back(hypothesis);
+    }
+    if (kept.size() != hypotheses_.size())
+        LOG(INFO) << "Pose hypothesis bank keeps " << kept.size() << " of " << hypotheses_.size() << " hypotheses";
+    hypotheses_.swap(kept);
+}
+
+bool PoseHypothesisBank::GetDominant(const double &dominance, const int &min_scans, const int &min_matched,
+                                     PoseState *state) const
+{
+    if (hypotheses_.empty() || scans_ < min_scans)
+        return false;
+    const auto best = std::max_element(
+        hypotheses_.begin(), hypotheses_.end(),
+        [](const PoseHypothesis &lhs, const PoseHypothesis &rhs) { return lhs.log_likelihood < rhs.log_likelihood; });
+    double weight_sum = 0.;
+    for (const auto &hypothesis : hypotheses_)
+        weight_sum += std::exp(hypothesis.log_likelihood - best->log_likelihood);
+    if (1. / weight_sum < dominance || best->matched < min_matched)
+        return false;
+    state->time = time_;
+    state->pose = best->pose;
+    state->coviarance = best->coviarance;
+    return true;
+}
+} // namespace ekf
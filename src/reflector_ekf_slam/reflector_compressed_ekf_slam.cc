@@ -0,0 +1,604 @@
+#include "reflector_ekf_slam/reflector_compressed_ekf_slam.h"
+#include "sensor/map_io.h"
+#include <limits>
+#include <glog/logging.h>
+
+namespace ekf
+{
+namespace
+{
+// Applies the deferred updates of a local region to whole state 'mu' and
+// 'sigma', 'rows' are the rows of the local state in the whole state and the
+// first 'A0' of them the anchored ones
+void FoldLocalRegion(const std::vector<int> &rows, const int &A0, const Eigen::VectorXd &local_mu,
+                     const Eigen::MatrixXd &local_sigma, const Eigen::MatrixXd &phi, const Eigen::MatrixXd &psi,
+                     const Eigen::VectorXd &theta, Eigen::Ref<Eigen::VectorXd> mu, Eigen::Ref<Eigen::MatrixXd> sigma)
+{
+    const int N = mu.rows();
+    const int A = rows.size();
+
+    // P_A0B at the beginning of the region, columns of the region are zeroed so
+    // that the corrections below only touch B
+    Eigen::MatrixXd R(A0, N);
+    for (int i = 0; i < A0; ++i)
+        R.row(i) = sigma.row(rows[i]);
+    for (int i = 0; i < A; ++i)
+        R.col(rows[i]).setZero();
+
+    // P_BB -= P_BA0 * psi * P_A0B, X_B += P_BA0 * theta
+    const Eigen::MatrixXd psi_R = psi * R;
+    sigma.triangularView<Eigen::Lower>() -= R.transpose() * psi_R;
+    sigma.triangularView<Eigen::StrictlyUpper>() = sigma.transpose();
+    mu.noalias() += R.transpose() * theta;
+
+    // P_AB = phi * P_A0B, then the local region itself
+    const Eigen::MatrixXd cross = phi * R;
+    for (int i = 0; i < A; ++i)
+    {
+        sigma.row(rows[i]) = cross.row(i);
+        sigma.col(rows[i]) = cross.row(i).transpose();
+    }
+    for (int i = 0; i < A; ++i)
+    {
+        mu(rows[i]) = local_mu(i);
+        for (int j = 0; j < A; ++j)
+            sigma(rows[i], rows[j]) = local_sigma(i, j);
+    }
+}
+} // namespace
+
+ReflectorCompressedEKFSLAM::ReflectorCompressedEKFSLAM(const EKFOptions &options)
+    : options_(options), vt_(Eigen::Vector3d::Zero()),
+      preintegration_(options.odom_model, options.linear_velocity_cov, options.imu_angular_velocity_cov),
+      anchored_dimension_(3), region_center_(Eigen::Vector2d::Zero()), update_count_(0)
+{
+    state_.Reset(options_.init_time, options_.init_pose, Eigen::Matrix3d::Zero());
+    preintegration_.Reset(options_.init_time);
+    state_.Reserve(3 + 2 * options_.reserved_landmarks);
+
+    Qu_ = InputCoviarance(options_.odom_model, options_.linear_velocity_cov, options_.angular_velocity_cov);
+    Qt_ << options_.observation_cov, 0.f,
+        0.f, options_.observation_cov;
+    // Load map
+    sensor::LoadMap(options_.map_path, kMapMatchGate, Qt_, &map_, &map_index_);
+    BeginLocalRegion({});
+    UpdateSnapshot(true);
+}
+
+ReflectorCompressedEKFSLAM::~ReflectorCompressedEKFSLAM()
+{
+}
+
+int ReflectorCompressedEKFSLAM::LocalToGlobalRow(const int &i) const
+{
+    if (i < 3)
+        return i;
+    return 3 + 2 * local_landmarks_[(i - 3) / 2] + (i - 3) % 2;
+}
+
+Eigen::Vector2d ReflectorCompressedEKFSLAM::LandmarkPosition(const int &id) const
+{
+    const int slot = local_slots_[id];
+    if (slot >= 0)
+        return local_mu_.segment<2>(3 + 2 * slot);
+    return state_.mu().segment<2>(3 + 2 * id);
+}
+
+double ReflectorCompressedEKFSLAM::LandmarkMatchRadius(const int &id) const
+{
+    const int slot = local_slots_[id];
+    Eigen::Matrix2d coviarance = local_sigma_.topLeftCorner<2, 2>() + Qt_;
+    if (slot >= 0)
+        coviarance += local_sigma_.block<2, 2>(3 + 2 * slot, 3 + 2 * slot);
+    else
+        coviarance += state_.sigma().block<2, 2>(3 + 2 * id, 3 + 2 * id);
+    return ekf::LandmarkMatchRadius(coviarance);
+}
+
+void ReflectorCompressedEKFSLAM::UpdateLandmarkIndex(const std::vector<int> &landmark_ids)
+{
+    for (const int &id : landmark_ids)
+        landmark_index_.Update(id, LandmarkPosition(id));
+}
+
+void ReflectorCompressedEKFSLAM::BeginLocalRegion(const std::vector<int> &landmark_ids)
+{
+    region_center_ = state_.mu().head<2>();
+    const int L = (state_.Dimension() - 3) / 2;
+    local_landmarks_.clear();
+    local_slots_.assign(L, -1);
+    const auto add_landmark = [&](const int &id) {
+        if (local_slots_[id] >= 0)
+            return;
+        local_slots_[id] = local_landmarks_.size();
+        local_landmarks_.push_back(id);
+    };
+    for (int id = 0; id < L; ++id)
+    {
+        if ((state_.mu().segment<2>(3 + 2 * id) - region_center_).norm() <= options_.local_region_radius)
+            add_landmark(id);
+    }
+    for (const int &id : landmark_ids)
+        add_landmark(id);
+
+    const int A = 3 + 2 * local_landmarks_.size();
+    local_mu_.resize(A);
+    local_sigma_.resize(A, A);
+    for (int i = 0; i < A; ++i)
+    {
+        local_mu_(i) = state_.mu()(LocalToGlobalRow(i));
+        for (int j = 0; j < A; ++j)
+            local_sigma_(i, j) = state_.sigma()(LocalToGlobalRow(i), LocalToGlobalRow(j));
+    }
+    anchored_dimension_ = A;
+    phi_ = Eigen::MatrixXd::Identity(A, A);
+    psi_ = Eigen::MatrixXd::Zero(A, A);
+    theta_ = Eigen::VectorXd::Zero(A);
+    LOG(INFO) << "Local region has " << local_landmarks_.size() << " of " << L << " reflectors";
+}
+
+std::vector<int> ReflectorCompressedEKFSLAM::LocalRows() const
+{
+    std::vector<int> rows(local_mu_.rows());
+    for (int i = 0; i < rows.size(); ++i)
+        rows[i] = LocalToGlobalRow(i);
+    return rows;
+}
+
+void ReflectorCompressedEKFSLAM::SyncGlobalState()
+{
+    const int N = state_.Dimension();
+    const int A = local_mu_.rows();
+    FoldLocalRegion(LocalRows(), anchored_dimension_, local_mu_, local_sigma_, phi_, psi_, theta_, state_.mu(),
+                    state_.sigma());
+
+    anchored_dimension_ = A;
+    phi_ = Eigen::MatrixXd::Identity(A, A);
+    psi_ = Eigen::MatrixXd::Zero(A, A);
+    theta_ = Eigen::VectorXd::Zero(A);
+
+    // Means out of the region moved as well
+    const int L = (N - 3) / 2;
+    for (int id = 0; id < L; ++id)
+        landmark_index_.Update(id, state_.mu().segment<2>(3 + 2 * id));
+    UpdateSnapshot(true);
+}
+
+bool ReflectorCompressedEKFSLAM::RestoreState(const State &state, const sensor::Map &map)
+{
+    state_.Assign(state);
+    preintegration_.Reset(state.time);
+    map_ = map;
+    map_index_.Build(map_, kMapMatchGate, Qt_);
+    MapChanged();
+    BeginLocalRegion({});
+    landmark_index_.Clear();
+    std::vector<int> landmark_ids(LandmarkNumber());
+    for (int id = 0; id < landmark_ids.size(); ++id)
+        landmark_ids[id] = id;
+    UpdateLandmarkIndex(landmark_ids);
+    UpdateSnapshot(true);
+    return true;
+}
+
+std::function<State()> ReflectorCompressedEKFSLAM::CaptureState()
+{
+    // Stored state and region parts are copied, the conversion and the fold run in the returned function
+    const auto state = std::make_shared<const StateBuffer>(state_.Compacted());
+    const std::vector<int> rows = LocalRows();
+    const int A0 = anchored_dimension_;
+    const Eigen::VectorXd local_mu = local_mu_;
+    const Eigen::MatrixXd local_sigma = local_sigma_;
+    const Eigen::MatrixXd phi = phi_;
+    const Eigen::MatrixXd psi = psi_;
+    const Eigen::VectorXd theta = theta_;
+    return [state, rows, A0, local_mu, local_sigma, phi, psi, theta]() {
+        State result = state->ToState();
+        FoldLocalRegion(rows, A0, local_mu, local_sigma, phi, psi, theta, result.mu, result.sigma);
+        return result;
+    };
+}
+
+State ReflectorCompressedEKFSLAM::GetState()
+{
+    State state = state_.ToState();
+    const int A = local_mu_.rows();
+    for (int i = 0; i < A; ++i)
+    {
+        state.mu(LocalToGlobalRow(i)) = local_mu_(i);
+        for (int j = 0; j < A; ++j)
+            state.sigma(LocalToGlobalRow(i), LocalToGlobalRow(j)) = local_sigma_(i, j);
+    }
+    return state;
+}
+
+State ReflectorCompressedEKFSLAM::PredictState(const double &time)
+{
+    State result = GetState();
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G, Q;
+    MotionTo(time, result.mu(2), &delta, &G, &Q);
+    const Eigen::Matrix3d sigma_xi = G * result.sigma.topLeftCorner(3, 3) * G.transpose() + Q;
+    const Eigen::MatrixXd sigma_x = G * result.sigma.topRows(3);
+    result.sigma.topRows(3) = sigma_x;
+    result.sigma.leftCols(3) = sigma_x.transpose();
+    result.sigma.topLeftCorner(3, 3) = sigma_xi;
+    result.mu.head(3) += delta;
+    result.mu(2) = std::atan2(std::sin(result.mu(2)), std::cos(result.mu(2))); //norm
+    return result;
+}
+
+PoseState ReflectorCompressedEKFSLAM::PredictPose(const double &time)
+{
+    // Same as robot part of PredictState, robot is always in the local region
+    PoseState result;
+    result.time = time;
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G, Q;
+    MotionTo(time, local_mu_(2), &delta, &G, &Q);
+    result.coviarance = G * local_sigma_.topLeftCorner(3, 3) * G.transpose() + Q;
+    result.pose = local_mu_.head(3) + delta;
+    result.pose(2) = std::atan2(std::sin(result.pose(2)), std::cos(result.pose(2))); //norm
+    return result;
+}
+
+void ReflectorCompressedEKFSLAM::MotionTo(const double &time, const double &theta, Eigen::Vector3d *delta,
+                                          Eigen::Matrix3d *G, Eigen::Matrix3d *Q) const
+{
+    if (options_.use_imu)
+    {
+        ImuPreintegration preintegration = preintegration_;
+        preintegration.Integrate(time);
+        preintegration.Motion(theta, delta, G, Q);
+        return;
+    }
+    RobotMotion(theta, vt_, time - state_.time(), options_.odom_model, Qu_, delta, G, Q);
+}
+
+void ReflectorCompressedEKFSLAM::Predict(const double &dt)
+{
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G;
+    Eigen::Matrix3d Q;
+    RobotMotion(local_mu_(2), vt_, dt, options_.odom_model, Qu_, &delta, &G, &Q);
+    ApplyMotion(delta, G, Q);
+}
+
+void ReflectorCompressedEKFSLAM::PredictPreintegrated(const double &time)
+{
+    preintegration_.Integrate(time);
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G, Q;
+    preintegration_.Motion(local_mu_(2), &delta, &G, &Q);
+    ApplyMotion(delta, G, Q);
+    preintegration_.Reset(time);
+}
+
+void ReflectorCompressedEKFSLAM::ApplyMotion(const Eigen::Vector3d &delta, const Eigen::Matrix3d &G,
+                                             const Eigen::Matrix3d &Q)
+{
+    const int A = local_mu_.rows();
+    // Only robot rows change: P_xx = G * P_xx * G^T + Q, P_xm = G * P_xm
+    const Eigen::Matrix3d sigma_xi = local_sigma_.topLeftCorner(3, 3);
+    if (A > 3)
+    {
+        const Eigen::MatrixXd sigma_xm = G * local_sigma_.topRightCorner(3, A - 3);
+        local_sigma_.topRightCorner(3, A - 3) = sigma_xm;
+        local_sigma_.bottomLeftCorner(A - 3, 3) = sigma_xm.transpose();
+    }
+    local_sigma_.topLeftCorner(3, 3) = G * sigma_xi * G.transpose() + Q;
+    // P_AB = G * P_AB
+    const Eigen::MatrixXd phi_x = G * phi_.topRows(3);
+    phi_.topRows(3) = phi_x;
+    local_mu_.head(3) += delta;
+    local_mu_(2) = std::atan2(std::sin(local_mu_(2)), std::cos(local_mu_(2))); //norm
+}
+
+void ReflectorCompressedEKFSLAM::HandleOdometryMessage(const sensor::OdometryData &odometry)
+{
+    // drop old data
+    if (odometry.time < state_.time())
+        return;
+    if (!options_.use_imu)
+    {
+        vt_ = Eigen::Vector3d(odometry.linear_velocity.x(), odometry.linear_velocity.y(), odometry.angular_velocity.z());
+        const double dt = odometry.time - state_.time();
+        Predict(dt);
+        state_.SetTime(odometry.time);
+        UpdateSnapshot(false);
+        return;
+    }
+    // Gyro gives the heading, odometry only the linear velocity
+    preintegration_.Integrate(odometry.time);
+    preintegration_.SetLinearVelocity(odometry.linear_velocity.head<2>());
+    UpdateSnapshot(false);
+}
+
+void ReflectorCompressedEKFSLAM::HandleImuMessage(const sensor::ImuData &imu)
+{
+    if (!options_.use_imu || imu.time < state_.time())
+        return;
+    preintegration_.Integrate(imu.time);
+    preintegration_.SetAngularVelocity(imu.angulear_velocity.z());
+}
+
+void ReflectorCompressedEKFSLAM::LocalUpdate(const std::vector<ObservationBlock> &blocks)
+{
+    const int A = local_mu_.rows();
+    int rows = 0;
+    for (const auto &block : blocks)
+        rows += block.innovation.rows();
+    Eigen::MatrixXd H = Eigen::MatrixXd::Zero(rows, A);
+    Eigen::VectorXd innovation(rows);
+    Eigen::MatrixXd Q = Eigen::MatrixXd::Zero(rows, rows);
+    int row = 0;
+    for (const auto &block : blocks)
+    {
+        const int r = block.innovation.rows();
+        H.block(row, 0, r, 3) = block.robot_jacobian;
+        if (block.landmark_index >= 0)
+            H.block(row, block.landmark_index, r, 2) = block.landmark_jacobian;
+        innovation.segment(row, r) = block.innovation;
+        Q.block(row, row, r, r) = block.noise;
+        row += r;
+    }
+
+    const Eigen::MatrixXd PHt = local_sigma_ * H.transpose();
+    const Eigen::MatrixXd S = H * PHt + Q;
+    const Eigen::MatrixXd H_phi = H * phi_;
+    // S^-1 * [(P * H^T)^T, H * phi, z - z_hat] with one factorization
+    Eigen::MatrixXd rhs(rows, A + H_phi.cols() + 1);
+    rhs << PHt.transpose(), H_phi, innovation;
+    const Eigen::MatrixXd solved = SolveInnovation(S, rhs, options_.innovation_solver);
+    const Eigen::MatrixXd K_t = solved.leftCols(A).transpose();
+
+    // Accumulate the effect on landmarks out of the region
+    psi_.noalias() += H_phi.transpose() * solved.middleCols(A, H_phi.cols());
+    theta_.noalias() += H_phi.transpose() * solved.rightCols(1);
+
+    local_mu_.noalias() += K_t * innovation;
+    local_sigma_.triangularView<Eigen::Lower>() -= K_t * PHt.transpose();
+    local_sigma_.triangularView<Eigen::StrictlyUpper>() = local_sigma_.transpose();
+    phi_.noalias() -= K_t * H_phi;
+}
+
+void ReflectorCompressedEKFSLAM::AddLandmarks(const sensor::Observation &observation, const std::vector<int> &new_ids)
+{
+    const int N2 = new_ids.size();
+    if (N2 == 0)
+        return;
+    LOG(INFO) << "Add " << N2 << " reflectors";
+    const int A = local_mu_.rows();
+    const int L = LandmarkNumber();
+    const double sin_theta = std::sin(local_mu_(2));
+    const double cos_theta = std::cos(local_mu_(2));
+    Eigen::Matrix2d G_zi;
+    G_zi << cos_theta, -sin_theta, sin_theta, cos_theta;
+    Eigen::VectorXd new_mu(2 * N2);
+    Eigen::MatrixXd G_p(2 * N2, 3);
+    Eigen::MatrixXd G_z(2 * N2, 2);
+    for (int i = 0; i < N2; i++)
+    {
+        const double rx = observation.cloud_[new_ids[i]].x();
+        const double ry = observation.cloud_[new_ids[i]].y();
+        new_mu(2 * i) = rx * cos_theta - ry * sin_theta + local_mu_(0);
+        new_mu(2 * i + 1) = rx * sin_theta + ry * cos_theta + local_mu_(1);
+        Eigen::MatrixXd Gp_i(2, 3);
+        Gp_i << 1., 0., -rx * sin_theta - ry * cos_theta, 0., 1., rx * cos_theta - ry * sin_theta;
+        G_p.block(2 * i, 0, 2, 3) = Gp_i;
+        G_z.block(2 * i, 0, 2, 2) = G_zi;
+    }
+    const Eigen::MatrixXd sigma_mm = G_p * local_sigma_.topLeftCorner(3, 3) * G_p.transpose() + G_z * Qt_ * G_z.transpose();
+    const Eigen::MatrixXd sigma_mx = G_p * local_sigma_.topRows(3);
+    // New landmarks join the region, their cross covariance with B is G_p * phi_x * P_A0B
+    const Eigen::MatrixXd phi_m = G_p * phi_.topRows(3);
+
+    state_.Augment(2 * N2);
+    state_.mu().tail(2 * N2) = new_mu;
+
+    local_mu_.conservativeResize(A + 2 * N2);
+    local_mu_.tail(2 * N2) = new_mu;
+    local_sigma_.conservativeResize(A + 2 * N2, A + 2 * N2);
+    local_sigma_.bottomLeftCorner(2 * N2, A) = sigma_mx;
+    local_sigma_.topRightCorner(A, 2 * N2) = sigma_mx.transpose();
+    local_sigma_.bottomRightCorner(2 * N2, 2 * N2) = sigma_mm;
+    phi_.conservativeResize(A + 2 * N2, Eigen::NoChange);
+    phi_.bottomRows(2 * N2) = phi_m;
+    for (int i = 0; i < N2; ++i)
+    {
+        local_slots_.push_back(local_landmarks_.size());
+        local_landmarks_.push_back(L + i);
+    }
+}
+
+void ReflectorCompressedEKFSLAM::HandleObservationMessage(const sensor::Observation &observation)
+{
+    // Predict now pose
+    if (options_.use_imu)
+    {
+        PredictPreintegrated(observation.time_);
+    }
+    else
+    {
+        const double dt = observation.time_ - state_.time();
+        Predict(dt);
+    }
+    state_.SetTime(observation.time_);
+    if (observation.cloud_.empty())
+    {
+        UpdateSnapshot(false);
+        return;
+    }
+    if ((local_mu_.head<2>() - region_center_).norm() > options_.local_region_switch_distance)
+    {
+        LOG(INFO) << "Leave local region, propagate to global state";
+        SyncGlobalState();
+        BeginLocalRegion({});
+    }
+
+    ReflectorMatchResult result = ReflectorMatch(observation);
+    // Observed landmarks out of the region must join it before updating
+    std::vector<int> outside_ids;
+    for (const auto &match : result.state_obs_match_ids)
+    {
+        if (local_slots_[match.second] < 0)
+            outside_ids.push_back(match.second);
+    }
+    if (!outside_ids.empty())
+    {
+        LOG(INFO) << "Observe " << outside_ids.size() << " reflectors out of local region";
+        SyncGlobalState();
+        BeginLocalRegion(outside_ids);
+    }
+
+    const int M_ = result.map_obs_match_ids.size();
+    const int M = result.state_obs_match_ids.size();
+    LOG(INFO) << "Match with old map size is: " << M_;
+    LOG(INFO) << "Match with state vector size is: " << M;
+    if (M + M_ > 0)
+    {
+        std::vector<ObservationBlock> blocks;
+        blocks.reserve(M + M_);
+        const double cos_theta = std::cos(local_mu_(2));
+        const double sin_theta = std::sin(local_mu_(2));
+        Eigen::Matrix2d B;
+        B << cos_theta, sin_theta, -sin_theta, cos_theta;
+        const auto make_block = [&](const Eigen::Vector2f &observed, const Eigen::Vector2d &m) -> ObservationBlock {
+            const double delta_x = m.x() - local_mu_(0);
+            const double delta_y = m.y() - local_mu_(1);
+            ObservationBlock block;
+            block.robot_jacobian.resize(2, 3);
+            block.robot_jacobian << -cos_theta, -sin_theta, -delta_x * sin_theta + delta_y * cos_theta,
+                sin_theta, -cos_theta, -delta_x * cos_theta - delta_y * sin_theta;
+            block.landmark_index = -1;
+            block.innovation = Eigen::Vector2d(observed.x() - (delta_x * cos_theta + delta_y * sin_theta),
+                                               observed.y() - (-delta_x * sin_theta + delta_y * cos_theta));
+            block.noise = Qt_;
+            return block;
+        };
+        for (const auto &match : result.state_obs_match_ids)
+        {
+            ObservationBlock block = make_block(observation.cloud_[match.first], LandmarkPosition(match.second));
+            // Index in local state
+            block.landmark_index = 3 + 2 * local_slots_[match.second];
+            block.landmark_jacobian = B;
+            blocks.push_back(block);
+        }
+        // Global map reflectors are fixed, only robot pose is touched
+        for (const auto &match : result.map_obs_match_ids)
+        {
+            blocks.push_back(make_block(observation.cloud_[match.first],
+                                        map_.reflector_map_[match.second].cast<double>()));
+        }
+        LocalUpdate(blocks);
+        local_mu_(2) = std::atan2(std::sin(local_mu_(2)), std::cos(local_mu_(2)));
+        if (options_.symmetrize_interval > 0 && ++update_count_ % options_.symmetrize_interval == 0)
+            Symmetrize(local_sigma_);
+    }
+
+    AddLandmarks(observation, result.new_ids);
+    // Only means of the region moved, new landmarks are in the region too
+    UpdateLandmarkIndex(local_landmarks_);
+    UpdateSnapshot(true);
+    LOG(INFO) << "Update now pose is: " << local_mu_(0) << "," << local_mu_(1) << "," << local_mu_(2);
+}
+
+void ReflectorCompressedEKFSLAM::UpdateSnapshot(const bool &landmarks_changed)
+{
+    PoseState robot;
+    if (options_.use_imu)
+    {
+        // Including the IMU samples not applied to the state yet
+        robot = PredictPose(preintegration_.time());
+    }
+    else
+    {
+        robot.time = state_.time();
+        robot.pose = local_mu_.head(3);
+        robot.coviarance = local_sigma_.topLeftCorner(3, 3);
+    }
+    std::shared_ptr<LandmarkSnapshot> landmarks;
+    if (landmarks_changed)
+    {
+        // Landmarks out of the region use the global covariance, which is
+        // larger until the next SyncGlobalState()
+        const auto landmark = [this](const int &id, Eigen::Vector2d *position, Eigen::Matrix2d *coviarance) {
+            const int slot = local_slots_[id];
+            *position = LandmarkPosition(id);
+            if (slot >= 0)
+                *coviarance = local_sigma_.block<2, 2>(3 + 2 * slot, 3 + 2 * slot);
+            else
+                *coviarance = state_.sigma().block<2, 2>(3 + 2 * id, 3 + 2 * id);
+        };
+        landmarks = LandmarkSnapshot::Build(nullptr, LandmarkNumber(), {}, landmark);
+    }
+    PublishSnapshot(robot, landmarks);
+}
+
+ReflectorMatchResult ReflectorCompressedEKFSLAM::ReflectorMatch(const sensor::Observation &obs)
+{
+    ReflectorMatchResult ids;
+    if (obs.cloud_.empty())
+    {
+        LOG(ERROR) << "Should never reach here";
+        exit(-1);
+    }
+    const int M = LandmarkNumber();
+    const int M_ = map_.reflector_map_.size();
+    if (M == 0 && M_ == 0)
+    {
+        for (int i = 0; i < obs.cloud_.size(); ++i)
+            ids.new_ids.push_back(i);
+        LOG(ERROR) << "Reflector map is empty";
+        return ids;
+    }
+
+    auto point_transformed_to_global_frame = [&](const Eigen::Vector2f &p) -> Eigen::Vector2f {
+        const float x = p.x() * std::cos(local_mu_(2)) - p.y() * std::sin(local_mu_(2)) + local_mu_(0);
+        const float y = p.x() * std::sin(local_mu_(2)) + p.y() * std::cos(local_mu_(2)) + local_mu_(1);
+        return Eigen::Vector2f(x, y);
+    };
+
+    std::vector<int> candidates;
+    for (int i = 0; i < obs.cloud_.size(); ++i)
+    {
+        const auto reflector = point_transformed_to_global_frame(obs.cloud_[i]);
+        // Match with global map
+        if (M_ > 0)
+        {
+            // Only map reflectors whose gate can contain the observation are checked
+            const int best_match = map_index_.Match(map_, reflector, nullptr);
+            if (best_match >= 0)
+            {
+                ids.map_obs_match_ids.push_back({i, best_match});
+                continue;
+            }
+        }
+        // Match with state landmarks near the observation, local ones use their up to date means
+        if (M > 0)
+        {
+            candidates.clear();
+            landmark_index_.Query(reflector.cast<double>(), kStateMatchDistance, &candidates);
+            int best_match = -1;
+            double best_distance = std::numeric_limits<double>::max();
+            for (const int &j : candidates)
+            {
+                const double dist = (reflector.cast<double>() - LandmarkPosition(j)).norm();
+                if (dist < best_distance)
+                {
+                    best_distance = dist;
+                    best_match = j;
+                }
+            }
+            if (best_match >= 0 && best_distance < LandmarkMatchRadius(best_match))
+            {
+                ids.state_obs_match_ids.push_back({i, best_match});
+                continue;
+            }
+        }
+        ids.new_ids.push_back(i);
+    }
+    return ids;
+}
+
+} // namespace ekf
@@ -1,239 +1,236 @@
 #include <reflector_ekf_slam/reflector_ekf_slam.h>
+#include "reflector_ekf_slam/ekf_update.h"
+#include "sensor/map_io.h"
+#include <algorithm>
+#include <limits>
 #include <glog/logging.h>
 
 namespace ekf
 {
-ReflectorEKFSLAM::ReflectorEKFSLAM(const EKFOptions &options) : options_(options), vt_(Eigen::Vector3d::Zero())
+template <typename OdometryModel, typename ExtraMeasurement>
+ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::ReflectorEKFSLAM(const EKFOptions &options)
+    : options_(options), vt_(Eigen::Vector3d::Zero()),
+      preintegration_(options.odom_model, options.linear_velocity_cov, options.imu_angular_velocity_cov),
+      pending_motion_(Eigen::Matrix3d::Identity()), update_count_(0), landmark_drift_(0.)
 {
-    state_.time = options_.init_time;
-    state_.mu = options_.init_pose;
-    state_.sigma.resize(3, 3);
-    state_.sigma.setZero();
+    state_.Reset(options_.init_time, options_.init_pose, Eigen::Matrix3d::Zero());
+    preintegration_.Reset(options_.init_time);
+    state_.SetMixedPrecision(options_.use_float_landmark_coviarance);
+    state_.Reserve(3 + 2 * options_.reserved_landmarks);
 
-    switch (options_.odom_model)
-    {
-    case sensor::OdometryModel::DIFF:
-        Qu_ = Eigen::MatrixXd::Zero(2, 2);
-        Qu_ << options_.linear_velocity_cov, 0.f,
-            0.f, options_.angular_velocity_cov;
-        break;
-    case sensor::OdometryModel::OMNI:
-        Qu_ = Eigen::MatrixXd::Zero(3, 3);
-        Qu_ << options_.linear_velocity_cov, 0.f, 0.f,
-            0.f, options_.linear_velocity_cov, 0.f,
-            0.f, 0.f, options_.angular_velocity_cov;
-        break;
-    default:
-        Qu_ = Eigen::MatrixXd::Zero(3, 3);
-        Qu_ << options_.linear_velocity_cov, 0.f, 0.f,
-            0.f, options_.linear_velocity_cov, 0.f,
-            0.f, 0.f, options_.angular_velocity_cov;
-        break;
-    }
+    Qu_ = OdometryModel::Coviarance(options_.linear_velocity_cov, options_.angular_velocity_cov);
     Qt_ << options_.observation_cov, 0.f,
         0.f, options_.observation_cov;
     // Load map
-    LoadMapFromTxtFile(options_.map_path);
+    sensor::LoadMap(options_.map_path, kMapMatchGate, Qt_, &map_, &map_index_);
+    UpdateSnapshot(true);
 }
 
-ReflectorEKFSLAM::~ReflectorEKFSLAM()
+template <typename OdometryModel, typename ExtraMeasurement>
+ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::~ReflectorEKFSLAM()
 {
 }
 
-void ReflectorEKFSLAM::LoadMapFromTxtFile(const std::string &file)
+template <typename OdometryModel, typename ExtraMeasurement>
+State ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::GetState()
 {
-    if (file.empty() || !IsFileExist(file))
-        return;
-    std::ifstream in(file.c_str());
-    std::string line;
-    std::vector<std::vector<double>> result;
-    if (in) // 有该文件
-    {
-        while (getline(in, line)) // line中不包括每行的换行符
-        {
-            LOG(INFO) << line;
-            if (!line.empty())
-            {
-                std::vector<double> vec;
-                auto vstr_vec = SplitString(line, ',');
-                for (auto &p : vstr_vec)
-                {
-                    vec.push_back(std::stod(p));
-                }
-                result.push_back(vec);
-            }
-        }
-    }
-    else // 没有该文件
-    {
-        // std::cout << "No map file in the map path!" << std::endl;
-        LOG(INFO) << "No map file in the map path!";
-        return;
-    }
+    State state = state_.ToState();
+    ApplyPendingMotion(pending_motion_, state.sigma);
+    return state;
+}
 
-    if (result.size() != 2 || result.back().size() != 2 * result.front().size())
-    {
-        // std::cout <<"format is not right, must be 2 line" << std::endl;
-        LOG(INFO) << "Format is not right, must be 2 line";
+template <typename OdometryModel, typename ExtraMeasurement>
+std::function<State()> ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::CaptureState()
+{
+    const auto state = std::make_shared<const StateBuffer>(state_.Compacted());
+    const Eigen::Matrix3d pending_motion = pending_motion_;
+    return [state, pending_motion]() {
+        State result = state->ToState();
+        ApplyPendingMotion(pending_motion, result.sigma);
+        return result;
+    };
+}
+
+template <typename OdometryModel, typename ExtraMeasurement>
+bool ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::RestoreState(const State &state, const sensor::Map &map)
+{
+    state_.Assign(state);
+    state_.CheckMixedPrecision();
+    preintegration_.Reset(state.time);
+    pending_motion_.setIdentity();
+    map_ = map;
+    map_index_.Build(map_, kMapMatchGate, Qt_);
+    MapChanged();
+    landmark_index_.Clear();
+    UpdateLandmarkIndex();
+    UpdateSnapshot(true);
+    return true;
+}
+
+template <typename OdometryModel, typename ExtraMeasurement>
+void ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::ApplyPendingMotion(const Eigen::Matrix3d &pending_motion,
+                                                                           Eigen::Ref<Eigen::MatrixXd> sigma)
+{
+    const int N = sigma.rows();
+    if (N == 3 || pending_motion.isIdentity(0.))
         return;
-    }
-    sensor::PointCloud reflector_map;
-    sensor::PointCloudCoviarance reflector_map_coviarance;
+    const Eigen::MatrixXd sigma_xm = pending_motion * sigma.topRightCorner(3, N - 3);
+    sigma.topRightCorner(3, N - 3) = sigma_xm;
+    sigma.bottomLeftCorner(N - 3, 3) = sigma_xm.transpose();
+}
 
-    for (int i = 0; i < result[0].size() / 2; ++i)
-    {
-        reflector_map.push_back(Eigen::Vector2f(result[0][2 * i], result[0][2 * i + 1]));
-    }
-    for (int i = 0; i < result[1].size() / 4; ++i)
+template <typename OdometryModel, typename ExtraMeasurement>
+void ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::FlushPendingMotion()
+{
+    const int N = state_.Dimension();
+    if (N > 3 && !pending_motion_.isIdentity(0.))
     {
-        Eigen::Matrix2d p;
-        p << result[0][4 * i], result[0][4 * i + 1], result[0][4 * i + 2], result[0][4 * i + 3];
-        reflector_map_coviarance.push_back(p);
+        const Eigen::MatrixXd sigma_xm = pending_motion_ * state_.robot_rows().rightCols(N - 3);
+        state_.robot_rows().rightCols(N - 3) = sigma_xm;
+        state_.MirrorRobotRows();
     }
-    map_.reflector_map_ = reflector_map;
-    map_.reflector_map_coviarance_ = reflector_map_coviarance;
+    pending_motion_.setIdentity();
 }
 
-State ReflectorEKFSLAM::PredictState(const double &time)
+template <typename OdometryModel, typename ExtraMeasurement>
+State ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::PredictState(const double &time)
 {
-    State result = state_;
-    const double dt = time - state_.time;
-    if (options_.odom_model == sensor::OdometryModel::DIFF)
+    State result = GetState();
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G, Q;
+    MotionTo(time, result.mu(2), &delta, &G, &Q);
+    // Only robot rows and columns change
+    const Eigen::Matrix3d sigma_xi = G * result.sigma.topLeftCorner(3, 3) * G.transpose() + Q;
+    const int N = result.mu.rows();
+    if (N > 3)
     {
-        const double delta_theta = vt_.z() * dt;
-        const double delta_x = vt_.x() * dt * std::cos(state_.mu(2) + delta_theta / 2);
-        const double delta_y = vt_.x() * dt * std::sin(state_.mu(2) + delta_theta / 2);
-
-        const int N = state_.mu.rows();
-        /***** 更新协方差 *****/
-        /* 构造 Gt */
-        const double angular_half_delta = state_.mu(2) + delta_theta / 2;
-        Eigen::MatrixXd G_xi = Eigen::MatrixXd::Identity(N, N);
-        G_xi(0, 2) = -vt_.x() * dt * std::sin(angular_half_delta);
-        G_xi(1, 2) = vt_.x() * dt * std::cos(angular_half_delta);
-
-        /* 构造 Gu' */
-        Eigen::MatrixXd G_u = Eigen::MatrixXd::Zero(N, 2);
-        Eigen::MatrixXd G_u_2(3, 2);
-        G_u_2 << dt * std::cos(angular_half_delta), -vt_.x() * dt * dt * std::sin(angular_half_delta) / 2,
-            dt * std::sin(angular_half_delta), vt_.x() * dt * dt * std::cos(angular_half_delta) / 2,
-            0, dt;
-        G_u.block(0, 0, 3, 2) = G_u_2;
-        /* 更新协方差 */
-        result.sigma = G_xi * state_.sigma * G_xi.transpose() + G_u * Qu_ * G_u.transpose();
-        /***** 更新均值 *****/
-        result.mu.topRows(3) = state_.mu.topRows(3) + Eigen::Vector3d(delta_x, delta_y, delta_theta);
-        result.mu(2) = std::atan2(std::sin(result.mu(2)), std::cos(result.mu(2))); //norm
-        return result;
+        const Eigen::MatrixXd sigma_xm = G * result.sigma.topRightCorner(3, N - 3);
+        result.sigma.topRightCorner(3, N - 3) = sigma_xm;
+        result.sigma.bottomLeftCorner(N - 3, 3) = sigma_xm.transpose();
     }
-    const double delta_theta = vt_.z() * dt;
-    const double delta_x = vt_.x() * dt * std::cos(state_.mu(2)) - vt_.y() * dt * std::sin(state_.mu(2));
-    const double delta_y = vt_.x() * dt * std::sin(state_.mu(2)) + vt_.y() * dt * std::cos(state_.mu(2));
-    const int N = state_.mu.rows();
-    /***** 更新协方差 *****/
-    /* 构造 Gt */
-    Eigen::MatrixXd G_xi = Eigen::MatrixXd::Identity(N, N);
-    G_xi(0, 2) = -vt_.x() * dt * std::sin(state_.mu(2)) - vt_.y() * dt * std::cos(state_.mu(2));
-    G_xi(1, 2) = vt_.x() * dt * std::cos(state_.mu(2)) - vt_.y() * dt * std::sin(state_.mu(2));
-
-    /* 构造 Gu' */
-    Eigen::MatrixXd G_u = Eigen::MatrixXd::Zero(N, 3);
-    Eigen::Matrix3d G_u_2;
-    G_u_2 << dt * std::cos(state_.mu(2)), -dt * std::sin(state_.mu(2)), 0.,
-        dt * std::sin(state_.mu(2)), dt * std::cos(state_.mu(2)), 0.,
-        0., 0., dt;
-    G_u.block(0, 0, 3, 3) = G_u_2;
-    /* 更新协方差 */
-    result.sigma = G_xi * state_.sigma * G_xi.transpose() + G_u * Qu_ * G_u.transpose();
-    /***** 更新均值 *****/
-    result.mu.topRows(3) = state_.mu.topRows(3) + Eigen::Vector3d(delta_x, delta_y, delta_theta);
+    result.sigma.topLeftCorner(3, 3) = sigma_xi;
+    result.mu.head(3) += delta;
     result.mu(2) = std::atan2(std::sin(result.mu(2)), std::cos(result.mu(2))); //norm
     return result;
 }
 
-void ReflectorEKFSLAM::Predict(const double &dt)
+template <typename OdometryModel, typename ExtraMeasurement>
+PoseState ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::PredictPose(const double &time)
+{
+    // Same as robot part of PredictState, robot block is never deferred
+    PoseState result;
+    result.time = time;
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G, Q;
+    MotionTo(time, state_.mu()(2), &delta, &G, &Q);
+    result.coviarance = G * state_.RobotCoviarance() * G.transpose() + Q;
+    result.pose = state_.mu().head<3>() + delta;
+    result.pose(2) = std::atan2(std::sin(result.pose(2)), std::cos(result.pose(2))); //norm
+    return result;
+}
+
+template <typename OdometryModel, typename ExtraMeasurement>
+void ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::MotionTo(const double &time, const double &theta,
+                                                                 Eigen::Vector3d *delta, Eigen::Matrix3d *G,
+                                                                 Eigen::Matrix3d *Q) const
 {
-    if (options_.odom_model == sensor::OdometryModel::DIFF)
+    if (options_.use_imu)
     {
-        const double delta_theta = vt_.z() * dt;
-        const double delta_x = vt_.x() * dt * std::cos(state_.mu(2) + delta_theta / 2);
-        const double delta_y = vt_.x() * dt * std::sin(state_.mu(2) + delta_theta / 2);
-
-        const int N = state_.mu.rows();
-        /***** 更新协方差 *****/
-        /* 构造 Gt */
-        const double angular_half_delta = state_.mu(2) + delta_theta / 2;
-        Eigen::MatrixXd G_xi = Eigen::MatrixXd::Identity(N, N);
-        G_xi(0, 2) = -vt_.x() * dt * std::sin(angular_half_delta);
-        G_xi(1, 2) = vt_.x() * dt * std::cos(angular_half_delta);
-
-        /* 构造 Gu' */
-        Eigen::MatrixXd G_u = Eigen::MatrixXd::Zero(N, 2);
-        Eigen::MatrixXd G_u_2(3, 2);
-        G_u_2 << dt * std::cos(angular_half_delta), -vt_.x() * dt * dt * std::sin(angular_half_delta) / 2,
-            dt * std::sin(angular_half_delta), vt_.x() * dt * dt * std::cos(angular_half_delta) / 2,
-            0, dt;
-        G_u.block(0, 0, 3, 2) = G_u_2;
-        /* 更新协方差 */
-        state_.sigma = G_xi * state_.sigma * G_xi.transpose() + G_u * Qu_ * G_u.transpose();
-        /***** 更新均值 *****/
-        state_.mu.topRows(3) += Eigen::Vector3d(delta_x, delta_y, delta_theta);
-        state_.mu(2) = std::atan2(std::sin(state_.mu(2)), std::cos(state_.mu(2))); //norm
+        ImuPreintegration preintegration = preintegration_;
+        preintegration.Integrate(time);
+        preintegration.Motion(theta, delta, G, Q);
         return;
     }
-    const double delta_theta = vt_.z() * dt;
-    const double delta_x = vt_.x() * dt * std::cos(state_.mu(2)) - vt_.y() * dt * std::sin(state_.mu(2));
-    const double delta_y = vt_.x() * dt * std::sin(state_.mu(2)) + vt_.y() * dt * std::cos(state_.mu(2));
-    const int N = state_.mu.rows();
-    /***** 更新协方差 *****/
-    /* 构造 Gt */
-    Eigen::MatrixXd G_xi = Eigen::MatrixXd::Identity(N, N);
-    G_xi(0, 2) = -vt_.x() * dt * std::sin(state_.mu(2)) - vt_.y() * dt * std::cos(state_.mu(2));
-    G_xi(1, 2) = vt_.x() * dt * std::cos(state_.mu(2)) - vt_.y() * dt * std::sin(state_.mu(2));
-
-    /* 构造 Gu' */
-    Eigen::MatrixXd G_u = Eigen::MatrixXd::Zero(N, 3);
-    Eigen::Matrix3d G_u_2;
-    G_u_2 << dt * std::cos(state_.mu(2)), -dt * std::sin(state_.mu(2)), 0.,
-        dt * std::sin(state_.mu(2)), dt * std::cos(state_.mu(2)), 0.,
-        0., 0., dt;
-    G_u.block(0, 0, 3, 3) = G_u_2;
-    /* 更新协方差 */
-    state_.sigma = G_xi * state_.sigma * G_xi.transpose() + G_u * Qu_ * G_u.transpose();
-    /***** 更新均值 *****/
-    state_.mu.topRows(3) += Eigen::Vector3d(delta_x, delta_y, delta_theta);
-    state_.mu(2) = std::atan2(std::sin(state_.mu(2)), std::cos(state_.mu(2))); //norm
+    typename OdometryModel::InputJacobian G_u;
+    OdometryModel::Motion(theta, vt_, time - state_.time(), delta, G, &G_u);
+    *Q = G_u * Qu_ * G_u.transpose();
+}
+
+template <typename OdometryModel, typename ExtraMeasurement>
+void ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::Predict(const double &dt)
+{
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G;
+    typename OdometryModel::InputJacobian G_u;
+    OdometryModel::Motion(state_.mu()(2), vt_, dt, &delta, &G, &G_u);
+    ApplyMotion(delta, G, G_u * Qu_ * G_u.transpose());
+}
+
+template <typename OdometryModel, typename ExtraMeasurement>
+void ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::PredictPreintegrated(const double &time)
+{
+    preintegration_.Integrate(time);
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G, Q;
+    preintegration_.Motion(state_.mu()(2), &delta, &G, &Q);
+    ApplyMotion(delta, G, Q);
+    preintegration_.Reset(time);
+}
+
+template <typename OdometryModel, typename ExtraMeasurement>
+void ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::ApplyMotion(const Eigen::Vector3d &delta,
+                                                                    const Eigen::Matrix3d &G,
+                                                                    const Eigen::Matrix3d &Q)
+{
+    // Robot block is propagated now, the robot-landmark block P_xm = G * P_xm
+    // is deferred by composing G until the covariance is needed
+    const Eigen::Matrix3d sigma_xi = state_.RobotCoviarance();
+    state_.robot_rows().leftCols<3>() = G * sigma_xi * G.transpose() + Q;
+    pending_motion_ = G * pending_motion_;
+    state_.mu().head<3>() += delta;
+    state_.mu()(2) = std::atan2(std::sin(state_.mu()(2)), std::cos(state_.mu()(2))); //norm
 }
 
-void ReflectorEKFSLAM::HandleOdometryMessage(const sensor::OdometryData &odometry)
+template <typename OdometryModel, typename ExtraMeasurement>
+void ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::HandleOdometryMessage(const sensor::OdometryData &odometry)
 {
     // drop old data
-    if (odometry.time < state_.time)
+    if (odometry.time < state_.time())
         return;
     if (!options_.use_imu)
     {
         /***** 保存上一帧编码器数据 *****/
         vt_ = Eigen::Vector3d(odometry.linear_velocity.x(), odometry.linear_velocity.y(), odometry.angular_velocity.z());
-        const double dt = odometry.time - state_.time;
+        const double dt = odometry.time - state_.time();
         Predict(dt);
-        state_.time = odometry.time;
+        state_.SetTime(odometry.time);
+        UpdateSnapshot(false);
         return;
     }
-    // use imu
+    // Gyro gives the heading, odometry only the linear velocity
+    preintegration_.Integrate(odometry.time);
+    preintegration_.SetLinearVelocity(odometry.linear_velocity.head<2>());
+    UpdateSnapshot(false);
 }
-void ReflectorEKFSLAM::HandleImuMessage(const sensor::ImuData &imu)
+template <typename OdometryModel, typename ExtraMeasurement>
+void ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::HandleImuMessage(const sensor::ImuData &imu)
 {
-    // use imu
+    if (!options_.use_imu || imu.time < state_.time())
+        return;
+    preintegration_.Integrate(imu.time);
+    preintegration_.SetAngularVelocity(imu.angulear_velocity.z());
 }
 
-void ReflectorEKFSLAM::HandleObservationMessage(const sensor::Observation &observation)
+template <typename OdometryModel, typename ExtraMeasurement>
+void ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::HandleObservationMessage(const sensor::Observation &observation)
 {
     // Predict now pose
-    const double dt = observation.time_ - state_.time;
-    Predict(dt);
-    state_.time = observation.time_;
+    if (options_.use_imu)
+    {
+        PredictPreintegrated(observation.time_);
+    }
+    else
+    {
+        const double dt = observation.time_ - state_.time();
+        Predict(dt);
+    }
+    state_.SetTime(observation.time_);
     if (observation.cloud_.empty())
+    {
+        UpdateSnapshot(false);
         return;
+    }
+    FlushPendingMotion();
     ReflectorMatchResult result = ReflectorMatch(observation);
     const int M_ = result.map_obs_match_ids.size();
     const int M = result.state_obs_match_ids.size();
@@ -242,104 +239,96 @@ void ReflectorEKFSLAM::HandleObservationMessage(const sensor::Observation &obser
     LOG(INFO) << "Match with old map size is: " << M_;
     LOG(INFO) << "Match with state vector size is: " << M;
     const int MM = M + M_;
-    const int N = state_.mu.rows();
+    const int N = state_.mu().rows();
     if (MM > 0)
     {
-        Eigen::MatrixXd H_t = Eigen::MatrixXd::Zero(2 * MM, N);
-        Eigen::VectorXd zt = Eigen::VectorXd::Zero(2 * MM);
-        Eigen::VectorXd zt_hat = Eigen::VectorXd::Zero(2 * MM);
-        Eigen::MatrixXd Q = Eigen::MatrixXd::Zero(2 * MM, 2 * MM);
-        const double cos_theta = std::cos(state_.mu(2));
-        const double sin_theta = std::sin(state_.mu(2));
+        // Each observation only touches robot pose and one landmark, update by blocks
+        std::vector<ObservationBlock> blocks;
+        blocks.reserve(MM);
+        const double cos_theta = std::cos(state_.mu()(2));
+        const double sin_theta = std::sin(state_.mu()(2));
         Eigen::Matrix2d B;
         B << cos_theta, sin_theta, -sin_theta, cos_theta;
-        if (M > 0)
+        const auto make_block = [&](const Eigen::Vector2f &observed,
+                                    const double &mx, const double &my) -> ObservationBlock {
+            const double delta_x = mx - state_.mu()(0);
+            const double delta_y = my - state_.mu()(1);
+            ObservationBlock block;
+            block.robot_jacobian.resize(2, 3);
+            block.robot_jacobian << -cos_theta, -sin_theta, -delta_x * sin_theta + delta_y * cos_theta,
+                sin_theta, -cos_theta, -delta_x * cos_theta - delta_y * sin_theta;
+            block.landmark_index = -1;
+            block.innovation = Eigen::Vector2d(observed.x() - (delta_x * cos_theta + delta_y * sin_theta),
+                                               observed.y() - (-delta_x * sin_theta + delta_y * cos_theta));
+            block.noise = Qt_;
+            return block;
+        };
+        for (int i = 0; i < M; ++i)
         {
-            const auto xy = [&](const int &id) -> Eigen::Vector2d {
-                return Eigen::Vector2d(state_.mu(3 + 2 * id), state_.mu(3 + 2 * id + 1));
-            };
-            for (int i = 0; i < M; ++i)
-            {
-                const int local_id = result.state_obs_match_ids[i].first;
-                const int global_id = result.state_obs_match_ids[i].second;
-                zt(2 * i) = observation.cloud_[local_id].x();
-                zt(2 * i + 1) = observation.cloud_[local_id].y();
-                const double delta_x = xy(global_id).x() - state_.mu(0);
-                const double delta_y = xy(global_id).y() - state_.mu(1);
-                zt_hat(2 * i) = delta_x * cos_theta + delta_y * sin_theta;
-                zt_hat(2 * i + 1) = -delta_x * sin_theta + delta_y * cos_theta;
-                Eigen::MatrixXd A_i(2, 3);
-                A_i << -cos_theta, -sin_theta, -delta_x * sin_theta + delta_y * cos_theta,
-                    sin_theta, -cos_theta, -delta_x * cos_theta - delta_y * sin_theta;
-                H_t.block(2 * i, 0, 2, 3) = A_i;
-                H_t.block(2 * i, 3 + 2 * global_id, 2, 2) = B;
-                Q.block(2 * i, 2 * i, 2, 2) = Qt_;
-            }
+            const int local_id = result.state_obs_match_ids[i].first;
+            const int global_id = result.state_obs_match_ids[i].second;
+            ObservationBlock block = make_block(observation.cloud_[local_id],
+                                                state_.mu()(3 + 2 * global_id), state_.mu()(3 + 2 * global_id + 1));
+            block.landmark_index = 3 + 2 * global_id;
+            block.landmark_jacobian = B;
+            blocks.push_back(block);
         }
-        if (M_ > 0)
+        // Global map reflectors are fixed, only robot pose is touched
+        for (int i = 0; i < M_; ++i)
         {
-            const auto xy = [&](const int &id) -> Eigen::Vector2f {
-                return map_.reflector_map_[id];
-            };
-
-            for (int i = 0; i < M_; ++i)
-            {
-                const int local_id = result.map_obs_match_ids[i].first;
-                const int global_id = result.map_obs_match_ids[i].second;
-                zt(2 * (M + i)) = observation.cloud_[local_id].x();
-                zt(2 * (M + i) + 1) = observation.cloud_[local_id].y();
-                const double delta_x = xy(global_id).x() - state_.mu(0);
-                const double delta_y = xy(global_id).y() - state_.mu(1);
-
-                zt_hat(2 * (M + i)) = delta_x * cos_theta + delta_y * sin_theta;
-                zt_hat(2 * (M + i) + 1) = -delta_x * sin_theta + delta_y * cos_theta;
-
-                Eigen::MatrixXd A_i(2, 3);
-                A_i << -cos_theta, -sin_theta, -delta_x * sin_theta + delta_y * cos_theta,
-                    sin_theta, -cos_theta, -delta_x * cos_theta - delta_y * sin_theta;
-                H_t.block(2 * (M + i), 0, 2, 3) = A_i;
-
-                Q.block(2 * (M + i), 2 * (M + i), 2, 2) = Qt_;
-            }
+            const int local_id = result.map_obs_match_ids[i].first;
+            const int global_id = result.map_obs_match_ids[i].second;
+            blocks.push_back(make_block(observation.cloud_[local_id],
+                                        map_.reflector_map_[global_id].x(), map_.reflector_map_[global_id].y()));
+        }
+        ExtraMeasurement::AddBlocks(observation, state_.mu(), &blocks);
+        // The update moves every landmark correlated with the robot, not only the matched ones
+        const Eigen::VectorXd landmark_mu = state_.mu().tail(N - 3);
+        if (options_.use_sequential_update)
+        {
+            const int rejected = SequentialUpdate(blocks, options_, &state_);
+            if (rejected > 0)
+                LOG(WARNING) << "Drop " << rejected << " of " << blocks.size() << " measurements by gate";
+        }
+        else
+        {
+            SparseUpdate(blocks, options_, &state_);
+        }
+        state_.mu()(2) = std::atan2(std::sin(state_.mu()(2)), std::cos(state_.mu()(2)));
+        if (N > 3)
+            landmark_drift_ += std::sqrt(2.) * (state_.mu().tail(N - 3) - landmark_mu).template lpNorm<Eigen::Infinity>();
+        if (options_.symmetrize_interval > 0 && ++update_count_ % options_.symmetrize_interval == 0)
+        {
+            // Factorizes the whole landmark covariance, so not after every update
+            state_.Symmetrize();
+            state_.CheckMixedPrecision();
         }
-        const auto K_t = state_.sigma * H_t.transpose() * (H_t * state_.sigma * H_t.transpose() + Q).inverse();
-        state_.mu += K_t * (zt - zt_hat);
-        state_.mu(2) = std::atan2(std::sin(state_.mu(2)), std::cos(state_.mu(2)));
-        state_.sigma = state_.sigma - K_t * H_t * state_.sigma;
     }
 
     const int N2 = result.new_ids.size();
     if (N2 > 0)
     {
         LOG(INFO) << "Add " << N2 << " reflectors";
-        // increase X_estimate and coviarance size
-        const int M_e = N + 2 * N2;
-        Eigen::VectorXd tmp_xe = Eigen::VectorXd::Zero(M_e);
-        tmp_xe.topRows(N) = state_.mu.topRows(N);
-
-        Eigen::MatrixXd tmp_sigma = Eigen::MatrixXd::Zero(M_e, M_e);
-        tmp_sigma.block(0, 0, N, N) = state_.sigma;
-        const Eigen::Matrix3d sigma_xi = state_.sigma.block(0, 0, 3, 3);
-        const double sin_theta = std::sin(state_.mu(2));
-        const double cos_theta = std::cos(state_.mu(2));
+        const Eigen::Matrix3d sigma_xi = state_.RobotCoviarance();
+        const double sin_theta = std::sin(state_.mu()(2));
+        const double cos_theta = std::cos(state_.mu()(2));
         Eigen::Matrix2d G_zi;
         G_zi << cos_theta, -sin_theta, sin_theta, cos_theta;
         auto point_transformed_to_global_frame = [&](const Eigen::Vector2f &p) -> Eigen::Vector2f {
-            const float x = p.x() * std::cos(state_.mu(2)) - p.y() * std::sin(state_.mu(2)) + state_.mu(0);
-            const float y = p.x() * std::sin(state_.mu(2)) + p.y() * std::cos(state_.mu(2)) + state_.mu(1);
+            const float x = p.x() * std::cos(state_.mu()(2)) - p.y() * std::sin(state_.mu()(2)) + state_.mu()(0);
+            const float y = p.x() * std::sin(state_.mu()(2)) + p.y() * std::cos(state_.mu()(2)) + state_.mu()(1);
             return Eigen::Vector2f(x, y);
         };
+        Eigen::VectorXd new_mu(2 * N2);
         Eigen::MatrixXd G_p(2 * N2, 3);
         Eigen::MatrixXd G_z(2 * N2, 2);
-        Eigen::MatrixXd G_fx = Eigen::MatrixXd::Zero(2 * N2, N);
 
         for (int i = 0; i < N2; i++)
         {
             const int local_id = result.new_ids[i];
             const auto point = point_transformed_to_global_frame(observation.cloud_[local_id]);
-            // update state vector
-            tmp_xe(N + 2 * i) = point.x();
-            tmp_xe(N + 2 * i + 1) = point.y();
+            new_mu(2 * i) = point.x();
+            new_mu(2 * i + 1) = point.y();
             // for update cov
             const double rx = observation.cloud_[local_id].x();
             const double ry = observation.cloud_[local_id].y();
@@ -347,27 +336,146 @@ void ReflectorEKFSLAM::HandleObservationMessage(const sensor::Observation &obser
             Gp_i << 1., 0., -rx * sin_theta - ry * cos_theta, 0., 1., rx * cos_theta - ry * sin_theta;
             G_p.block(2 * i, 0, 2, 3) = Gp_i;
             G_z.block(2 * i, 0, 2, 2) = G_zi;
-            Eigen::MatrixXd G_fx_i = Eigen::MatrixXd::Zero(2, N);
-            G_fx_i.topLeftCorner(2, 3) = Gp_i;
-            G_fx.block(2 * i, 0, 2, N) = G_fx_i;
         }
-        const auto sigma_mm = G_p * sigma_xi * G_p.transpose() + G_z * Qt_ * G_z.transpose();
-        const auto sigma_mx = G_fx * state_.sigma;
-        tmp_sigma.block(N, 0, 2 * N2, N) = sigma_mx;
-        tmp_sigma.block(0, N, N, 2 * N2) = sigma_mx.transpose();
-        tmp_sigma.block(N, N, 2 * N2, 2 * N2) = sigma_mm;
-
-        state_.sigma.resize(M_e, M_e);
-        state_.sigma = tmp_sigma;
-        state_.mu.resize(M_e);
-        state_.mu = tmp_xe;
+        const Eigen::MatrixXd sigma_mm = G_p * sigma_xi * G_p.transpose() + G_z * Qt_ * G_z.transpose();
+        // New landmarks only depend on robot pose, G_fx * sigma = G_p * sigma(0:3, :)
+        Eigen::MatrixXd sigma_rows(2 * N2, N + 2 * N2);
+        sigma_rows.leftCols(N) = G_p * state_.robot_rows();
+        sigma_rows.rightCols(2 * N2) = sigma_mm;
+
+        // Only the new rows and columns are written, old covariance stays in place
+        state_.Augment(2 * N2);
+        state_.mu().tail(2 * N2) = new_mu;
+        state_.SetRows(N, sigma_rows);
     }
-    LOG(INFO) << "Update now pose is: " << state_.mu(0) << "," << state_.mu(1) << "," << state_.mu(2);
+    MarginalizeLandmarks(result);
+    UpdateLandmarkIndex(result);
+    UpdateSnapshot(true);
+    LOG(INFO) << "Update now pose is: " << state_.mu()(0) << "," << state_.mu()(1) << "," << state_.mu()(2);
     LOG(INFO) << "state vector:  \n"
-              << state_.mu;
+              << state_.mu();
+}
+
+template <typename OdometryModel, typename ExtraMeasurement>
+void ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::MarginalizeLandmarks(const ReflectorMatchResult &result)
+{
+    const int L = (state_.Dimension() - 3) / 2;
+    if (options_.max_landmarks <= 0 || L <= options_.max_landmarks)
+        return;
+    // Landmarks of this scan stay, new ones are at the end of state
+    std::vector<bool> observed(L, false);
+    for (const auto &match : result.state_obs_match_ids)
+        observed[match.second] = true;
+    for (int id = L - result.new_ids.size(); id < L; ++id)
+        observed[id] = true;
+
+    // Mature landmarks, farthest from robot first
+    std::vector<std::pair<double, int>> distance_id;
+    for (int id = 0; id < L; ++id)
+    {
+        if (observed[id])
+            continue;
+        const double dist = (state_.mu().segment<2>(3 + 2 * id) - state_.mu().head<2>()).norm();
+        const Eigen::Matrix2d coviarance = state_.LandmarkCoviarance(id);
+        const double max_variance = coviarance.selfadjointView<Eigen::Lower>().eigenvalues().maxCoeff();
+        if (dist > options_.marginalize_distance || max_variance < options_.marginalize_coviarance)
+            distance_id.push_back({dist, id});
+    }
+    if (distance_id.empty())
+    {
+        LOG(WARNING) << "State has " << L << " reflectors, but none can move into map";
+        return;
+    }
+    std::sort(distance_id.begin(), distance_id.end(),
+              [](const std::pair<double, int> &left,
+                 const std::pair<double, int> &right) {
+                  return left.first > right.first;
+              });
+    if (distance_id.size() > L - options_.max_landmarks)
+        distance_id.resize(L - options_.max_landmarks);
+
+    // Marginal of a landmark is its mean and 2x2 diagonal block, from now on it
+    // is matched as a fixed map reflector
+    std::vector<int> ids;
+    for (const auto &candidate : distance_id)
+    {
+        const int id = candidate.second;
+        ids.push_back(id);
+        map_.reflector_map_.push_back(state_.mu().segment<2>(3 + 2 * id).cast<float>());
+        map_.reflector_map_coviarance_.push_back(state_.LandmarkCoviarance(id));
+        map_index_.Insert(map_, map_.reflector_map_.size() - 1);
+    }
+    state_.RemoveLandmarks(ids);
+    MapChanged();
+    // Landmark ids changed
+    landmark_index_.Clear();
+    LOG(INFO) << "Move " << ids.size() << " reflectors from state to map, " << L - ids.size() << " left";
+}
+
+template <typename OdometryModel, typename ExtraMeasurement>
+void ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::UpdateLandmarkIndex()
+{
+    const int L = (state_.Dimension() - 3) / 2;
+    for (int i = 0; i < L; ++i)
+        landmark_index_.Update(i, state_.mu().segment<2>(3 + 2 * i));
+    landmark_drift_ = 0.;
+}
+
+template <typename OdometryModel, typename ExtraMeasurement>
+void ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::UpdateLandmarkIndex(const ReflectorMatchResult &result)
+{
+    // Index is cleared when landmarks are marginalized, ids of 'result' are stale then
+    if (landmark_drift_ > landmark_index_.Slack() || landmark_index_.Size() == 0)
+    {
+        UpdateLandmarkIndex();
+        return;
+    }
+    for (const auto &match : result.state_obs_match_ids)
+        landmark_index_.Update(match.second, state_.mu().segment<2>(3 + 2 * match.second));
+    // New landmarks are at the end of state
+    const int L = (state_.Dimension() - 3) / 2;
+    for (int id = landmark_index_.Size(); id < L; ++id)
+        landmark_index_.Update(id, state_.mu().segment<2>(3 + 2 * id));
+}
+
+template <typename OdometryModel, typename ExtraMeasurement>
+double ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::LandmarkMatchRadius(const int &id) const
+{
+    const Eigen::Matrix2d coviarance = state_.LandmarkCoviarance(id) + state_.RobotCoviarance().topLeftCorner<2, 2>() + Qt_;
+    return ekf::LandmarkMatchRadius(coviarance);
+}
+
+template <typename OdometryModel, typename ExtraMeasurement>
+void ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::UpdateSnapshot(const bool &landmarks_changed)
+{
+    // Robot block and landmark diagonal blocks are not affected by the pending motion
+    PoseState robot;
+    if (options_.use_imu)
+    {
+        // Including the IMU samples not applied to the state yet
+        robot = PredictPose(preintegration_.time());
+    }
+    else
+    {
+        robot.time = state_.time();
+        robot.pose = state_.mu().head(3);
+        robot.coviarance = state_.RobotCoviarance();
+    }
+    std::shared_ptr<LandmarkSnapshot> landmarks;
+    if (landmarks_changed)
+    {
+        const int L = (state_.Dimension() - 3) / 2;
+        const auto landmark = [this](const int &id, Eigen::Vector2d *position, Eigen::Matrix2d *coviarance) {
+            *position = state_.mu().segment<2>(3 + 2 * id);
+            *coviarance = state_.LandmarkCoviarance(id);
+        };
+        landmarks = LandmarkSnapshot::Build(nullptr, L, {}, landmark);
+    }
+    PublishSnapshot(robot, landmarks);
 }
 
-ReflectorMatchResult ReflectorEKFSLAM::ReflectorMatch(const sensor::Observation &obs)
+template <typename OdometryModel, typename ExtraMeasurement>
+ReflectorMatchResult ReflectorEKFSLAM<OdometryModel, ExtraMeasurement>::ReflectorMatch(const sensor::Observation &obs)
 {
     ReflectorMatchResult ids;
     if (obs.cloud_.empty())
@@ -376,7 +484,7 @@ ReflectorMatchResult ReflectorEKFSLAM::ReflectorMatch(const sensor::Observation
         LOG(ERROR) << "Should never reach here";
         exit(-1);
     }
-    if (state_.mu.rows() == 3 && map_.reflector_map_.empty())
+    if (state_.mu().rows() == 3 && map_.reflector_map_.empty())
     {
         for (int i = 0; i < obs.cloud_.size(); ++i)
             ids.new_ids.push_back(i);
@@ -387,65 +495,47 @@ ReflectorMatchResult ReflectorEKFSLAM::ReflectorMatch(const sensor::Observation
     }
 
     auto point_transformed_to_global_frame = [&](const Eigen::Vector2f &p) -> Eigen::Vector2f {
-        const float x = p.x() * std::cos(state_.mu(2)) - p.y() * std::sin(state_.mu(2)) + state_.mu(0);
-        const float y = p.x() * std::sin(state_.mu(2)) + p.y() * std::cos(state_.mu(2)) + state_.mu(1);
+        const float x = p.x() * std::cos(state_.mu()(2)) - p.y() * std::sin(state_.mu()(2)) + state_.mu()(0);
+        const float y = p.x() * std::sin(state_.mu()(2)) + p.y() * std::cos(state_.mu()(2)) + state_.mu()(1);
         return Eigen::Vector2f(x, y);
     };
 
-    const int M = (state_.mu.rows() - 3) / 2;
+    const int M = (state_.mu().rows() - 3) / 2;
     const int M_ = map_.reflector_map_.size();
+    std::vector<int> candidates;
     for (int i = 0; i < obs.cloud_.size(); ++i)
     {
-        const auto reflector = point_transformed_to_global_frame(obs.cloud_[i]);
+        const Eigen::Vector2f reflector = point_transformed_to_global_frame(obs.cloud_[i]);
         // Match with global map
         if (M_ > 0)
         {
-            std::vector<std::pair<double, int>> distance_id;
-            for (int j = 0; j < M_; ++j)
+            // Only map reflectors whose gate can contain the observation are checked
+            const int best_match = map_index_.Match(map_, reflector, nullptr);
+            if (best_match >= 0)
             {
-                // Get global reflector covariance
-                const Eigen::Matrix2d sigma = map_.reflector_map_coviarance_[j];
-                const Eigen::Vector2f delta_state = map_.reflector_map_[j] - reflector;
-                const auto delta_double_state = delta_state.cast<double>().transpose();
-                // Calculate Ma distance
-                const double dist = std::sqrt(delta_double_state * sigma * delta_double_state.transpose());
-                distance_id.push_back({dist, j});
-            }
-            std::sort(distance_id.begin(), distance_id.end(),
-                      [](const std::pair<double, int> &left,
-                         const std::pair<double, int> &right) {
-                          return left.first <= right.first;
-                      });
-            const auto best_match = distance_id.front();
-            if (best_match.first < 0.05)
-            {
-                ids.map_obs_match_ids.push_back({i, best_match.second});
+                ids.map_obs_match_ids.push_back({i, best_match});
                 continue;
             }
         }
         if (M > 0)
         {
-            std::vector<std::pair<double, int>> distance_id;
-            for (int j = 0; j < M; ++j)
+            // Only landmarks near the observation are candidates
+            candidates.clear();
+            landmark_index_.Query(reflector.cast<double>(), kStateMatchDistance + landmark_drift_, &candidates);
+            int best_match = -1;
+            double best_distance = std::numeric_limits<double>::max();
+            for (const int &j : candidates)
             {
-                Eigen::Vector2f global_reflector(state_.mu(3 + 2 * j), state_.mu(3 + 2 * j + 1));
-                const Eigen::Matrix2d sigma = state_.sigma.block(3 + 2 * j, 3 + 2 * j, 2, 2);
-                const Eigen::Vector2f delta_state = reflector - global_reflector;
-                const auto delta_double_state = delta_state.cast<double>().transpose();
-                // Calculate Ma distance
-                // const double dist = std::sqrt(delta_double_state * sigma * delta_double_state.transpose());
-                const double dist = std::sqrt(delta_double_state * delta_double_state.transpose());
-                distance_id.push_back({dist, j});
+                const double dist = (reflector.cast<double>() - state_.mu().segment<2>(3 + 2 * j)).norm();
+                if (dist < best_distance)
+                {
+                    best_distance = dist;
+                    best_match = j;
+                }
             }
-            std::sort(distance_id.begin(), distance_id.end(),
-                      [](const std::pair<double, int> &left,
-                         const std::pair<double, int> &right) {
-                          return left.first <= right.first;
-                      });
-            const auto best_match = distance_id.front();
-            if (best_match.first < 0.6)
+            if (best_match >= 0 && best_distance < LandmarkMatchRadius(best_match))
             {
-                ids.state_obs_match_ids.push_back({i, best_match.second});
+                ids.state_obs_match_ids.push_back({i, best_match});
                 continue;
             }
         }
@@ -454,4 +544,22 @@ ReflectorMatchResult ReflectorEKFSLAM::ReflectorMatch(const sensor::Observation
     return ids;
 }
 
+std::unique_ptr<ReflectorEKFSLAMInterface> CreateReflectorEKFSLAM(const EKFOptions &options, const bool &use_gps_pose)
+{
+    if (options.odom_model == sensor::OdometryModel::DIFF)
+    {
+        if (use_gps_pose)
+            return common::make_unique<ReflectorEKFSLAM<DiffOdometryModel, GpsPoseMeasurement>>(options);
+        return common::make_unique<ReflectorEKFSLAM<DiffOdometryModel>>(options);
+    }
+    if (use_gps_pose)
+        return common::make_unique<ReflectorEKFSLAM<OmniOdometryModel, GpsPoseMeasurement>>(options);
+    return common::make_unique<ReflectorEKFSLAM<OmniOdometryModel>>(options);
+}
+
+template class ReflectorEKFSLAM<DiffOdometryModel, NoExtraMeasurement>;
+template class ReflectorEKFSLAM<OmniOdometryModel, NoExtraMeasurement>;
+template class ReflectorEKFSLAM<DiffOdometryModel, GpsPoseMeasurement>;
+template class ReflectorEKFSLAM<OmniOdometryModel, GpsPoseMeasurement>;
+
 } // namespace ekf
@@ -0,0 +1,719 @@
+#include "reflector_ekf_slam/reflector_fixed_lag_smoother.h"
+#include "reflector_ekf_slam/ekf_update.h"
+#include "sensor/map_io.h"
+#include <algorithm>
+#include <limits>
+#include <glog/logging.h>
+
+namespace ekf
+{
+namespace
+{
+// Standard deviation of the prior on the initial pose, fixes the gauge of the window
+constexpr double kInitialPoseStd = 1e-4;
+// Added to the covariance of an odometry factor, which is singular for short DIFF motions
+constexpr double kMinOdometryVariance = 1e-6;
+// Gauss-Newton stops when no variable moves more than it
+constexpr double kConvergedStep = 1e-6;
+
+double NormalizeAngle(const double &angle)
+{
+    return std::atan2(std::sin(angle), std::cos(angle));
+}
+
+// L^-1 with coviarance = L * L^T, whitens residuals of that covariance
+Eigen::MatrixXd SqrtInformation(const Eigen::MatrixXd &coviarance)
+{
+    Eigen::LLT<Eigen::MatrixXd> llt(coviarance);
+    CHECK(llt.info() == Eigen::Success) << "Coviarance is not positive definite";
+    return llt.matrixL().solve(Eigen::MatrixXd::Identity(coviarance.rows(), coviarance.cols()));
+}
+} // namespace
+
+ReflectorFixedLagSmoother::ReflectorFixedLagSmoother(const EKFOptions &options)
+    : options_(options), time_(options.init_time), vt_(Eigen::Vector3d::Zero()), first_pose_id_(0),
+      odometry_delta_(Eigen::Vector3d::Zero()), odometry_coviarance_(Eigen::Matrix3d::Zero())
+{
+    CHECK(options_.smoother_window_size >= 2) << "Window must hold at least 2 poses";
+    CHECK(!options_.use_imu) << "Fixed-lag smoother predicts from odometry only";
+    Qu_ = InputCoviarance(options_.odom_model, options_.linear_velocity_cov, options_.angular_velocity_cov);
+    Qt_ << options_.observation_cov, 0.f,
+        0.f, options_.observation_cov;
+    observation_sqrt_information_ = SqrtInformation(Qt_);
+
+    poses_.push_back(options_.init_pose);
+    prior_.variables.push_back({true, first_pose_id_});
+    prior_.linearization = options_.init_pose;
+    prior_.sqrt_information = Eigen::Matrix3d::Identity() / kInitialPoseStd;
+    prior_.residual = Eigen::Vector3d::Zero();
+    coviarance_ = Eigen::Matrix3d::Identity() * kInitialPoseStd * kInitialPoseStd;
+
+    // Load map
+    sensor::LoadMap(options_.map_path, kMapMatchGate, Qt_, &map_, &map_index_);
+    UpdateSnapshot(true);
+}
+
+ReflectorFixedLagSmoother::~ReflectorFixedLagSmoother()
+{
+}
+
+int ReflectorFixedLagSmoother::Column(const Variable &variable) const
+{
+    if (variable.is_pose)
+        return 3 * (variable.id - first_pose_id_);
+    return 3 * PoseNumber() + 2 * variable.id;
+}
+
+Eigen::VectorXd ReflectorFixedLagSmoother::Value(const Variable &variable) const
+{
+    if (variable.is_pose)
+        return poses_[variable.id - first_pose_id_];
+    return landmarks_[variable.id];
+}
+
+Eigen::Vector3d ReflectorFixedLagSmoother::CurrentPose() const
+{
+    const Eigen::Vector3d &pose = poses_.back();
+    const double cos_theta = std::cos(pose(2));
+    const double sin_theta = std::sin(pose(2));
+    return Eigen::Vector3d(pose(0) + cos_theta * odometry_delta_(0) - sin_theta * odometry_delta_(1),
+                           pose(1) + sin_theta * odometry_delta_(0) + cos_theta * odometry_delta_(1),
+                           NormalizeAngle(pose(2) + odometry_delta_(2)));
+}
+
+void ReflectorFixedLagSmoother::CompositionJacobians(Eigen::Matrix3d *J_pose, Eigen::Matrix3d *J_delta) const
+{
+    const Eigen::Vector3d &pose = poses_.back();
+    const double cos_theta = std::cos(pose(2));
+    const double sin_theta = std::sin(pose(2));
+    *J_pose << 1., 0., -sin_theta * odometry_delta_(0) - cos_theta * odometry_delta_(1),
+        0., 1., cos_theta * odometry_delta_(0) - sin_theta * odometry_delta_(1),
+        0., 0., 1.;
+    *J_delta << cos_theta, -sin_theta, 0.,
+        sin_theta, cos_theta, 0.,
+        0., 0., 1.;
+}
+
+Eigen::Matrix3d ReflectorFixedLagSmoother::CurrentPoseCoviarance() const
+{
+    Eigen::Matrix3d J_pose, J_delta;
+    CompositionJacobians(&J_pose, &J_delta);
+    const int last = 3 * (PoseNumber() - 1);
+    return J_pose * coviarance_.block<3, 3>(last, last) * J_pose.transpose() +
+           J_delta * odometry_coviarance_ * J_delta.transpose();
+}
+
+State ReflectorFixedLagSmoother::GetState()
+{
+    const int L = LandmarkNumber();
+    const int landmark_column = 3 * PoseNumber();
+    const int last = landmark_column - 3;
+    State state;
+    state.time = time_;
+    state.mu.resize(3 + 2 * L);
+    state.mu.head<3>() = CurrentPose();
+    for (int id = 0; id < L; ++id)
+        state.mu.segment<2>(3 + 2 * id) = landmarks_[id];
+    state.sigma.resize(3 + 2 * L, 3 + 2 * L);
+    state.sigma.topLeftCorner<3, 3>() = CurrentPoseCoviarance();
+    if (L > 0)
+    {
+        // Only the latest pose of the window correlates with the odometry since then
+        Eigen::Matrix3d J_pose, J_delta;
+        CompositionJacobians(&J_pose, &J_delta);
+        const Eigen::MatrixXd sigma_xm = J_pose * coviarance_.block(last, landmark_column, 3, 2 * L);
+        state.sigma.topRightCorner(3, 2 * L) = sigma_xm;
+        state.sigma.bottomLeftCorner(2 * L, 3) = sigma_xm.transpose();
+        state.sigma.bottomRightCorner(2 * L, 2 * L) = coviarance_.bottomRightCorner(2 * L, 2 * L);
+    }
+    return state;
+}
+
+State ReflectorFixedLagSmoother::PredictState(const double &time)
+{
+    State result = GetState();
+    const double dt = time - time_;
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G;
+    Eigen::Matrix3d Q;
+    RobotMotion(result.mu(2), vt_, dt, options_.odom_model, Qu_, &delta, &G, &Q);
+    // Only robot rows and columns change
+    const Eigen::Matrix3d sigma_xi = G * result.sigma.topLeftCorner(3, 3) * G.transpose() + Q;
+    const int N = result.mu.rows();
+    if (N > 3)
+    {
+        const Eigen::MatrixXd sigma_xm = G * result.sigma.topRightCorner(3, N - 3);
+        result.sigma.topRightCorner(3, N - 3) = sigma_xm;
+        result.sigma.bottomLeftCorner(N - 3, 3) = sigma_xm.transpose();
+    }
+    result.sigma.topLeftCorner(3, 3) = sigma_xi;
+    result.mu.head(3) += delta;
+    result.mu(2) = NormalizeAngle(result.mu(2));
+    result.time = time;
+    return result;
+}
+
+PoseState ReflectorFixedLagSmoother::PredictPose(const double &time)
+{
+    PoseState result;
+    result.time = time;
+    const Eigen::Vector3d pose = CurrentPose();
+    const double dt = time - time_;
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G;
+    Eigen::Matrix3d Q;
+    RobotMotion(pose(2), vt_, dt, options_.odom_model, Qu_, &delta, &G, &Q);
+    result.coviarance = G * CurrentPoseCoviarance() * G.transpose() + Q;
+    result.pose = pose + delta;
+    result.pose(2) = NormalizeAngle(result.pose(2));
+    return result;
+}
+
+void ReflectorFixedLagSmoother::Predict(const double &dt)
+{
+    // Motion is invariant to the frame, so integrate it in the frame of the latest pose
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G;
+    Eigen::Matrix3d Q;
+    RobotMotion(odometry_delta_(2), vt_, dt, options_.odom_model, Qu_, &delta, &G, &Q);
+    odometry_coviarance_ = G * odometry_coviarance_ * G.transpose() + Q;
+    odometry_delta_ += delta;
+    odometry_delta_(2) = NormalizeAngle(odometry_delta_(2));
+}
+
+void ReflectorFixedLagSmoother::HandleOdometryMessage(const sensor::OdometryData &odometry)
+{
+    // drop old data
+    if (odometry.time < time_)
+        return;
+    vt_ = Eigen::Vector3d(odometry.linear_velocity.x(), odometry.linear_velocity.y(), odometry.angular_velocity.z());
+    Predict(odometry.time - time_);
+    time_ = odometry.time;
+    UpdateSnapshot(false);
+}
+
+void ReflectorFixedLagSmoother::HandleImuMessage(const sensor::ImuData & /*imu*/)
+{
+    // Odometry only, see the constructor
+}
+
+void ReflectorFixedLagSmoother::AddPose()
+{
+    OdometryFactor factor;
+    factor.pose_id = first_pose_id_ + PoseNumber() - 1;
+    factor.delta = odometry_delta_;
+    factor.sqrt_information = SqrtInformation(odometry_coviarance_ + kMinOdometryVariance * Eigen::Matrix3d::Identity());
+    odometry_factors_.push_back(factor);
+    poses_.push_back(CurrentPose());
+    odometry_delta_.setZero();
+    odometry_coviarance_.setZero();
+}
+
+void ReflectorFixedLagSmoother::HandleObservationMessage(const sensor::Observation &observation)
+{
+    Predict(observation.time_ - time_);
+    time_ = observation.time_;
+    if (observation.cloud_.empty())
+    {
+        UpdateSnapshot(false);
+        return;
+    }
+    ReflectorMatchResult result = ReflectorMatch(observation);
+    LOG(INFO) << "Match with old map size is: " << result.map_obs_match_ids.size();
+    LOG(INFO) << "Match with state vector size is: " << result.state_obs_match_ids.size();
+
+    AddPose();
+    const int pose_id = first_pose_id_ + PoseNumber() - 1;
+    const auto add_factor = [&](const int &local_id, const int &landmark_id, const bool &map_reflector) {
+        ReflectorFactor factor;
+        factor.pose_id = pose_id;
+        factor.landmark_id = landmark_id;
+        factor.map_reflector = map_reflector;
+        factor.observation = observation.cloud_[local_id].cast<double>();
+        reflector_factors_.push_back(factor);
+    };
+    for (const auto &match : result.state_obs_match_ids)
+        add_factor(match.first, match.second, false);
+    // Global map reflectors are fixed, only robot pose is touched
+    for (const auto &match : result.map_obs_match_ids)
+        add_factor(match.first, match.second, true);
+    if (!result.new_ids.empty())
+    {
+        LOG(INFO) << "Add " << result.new_ids.size() << " reflectors";
+        const Eigen::Vector3d &pose = poses_.back();
+        const double cos_theta = std::cos(pose(2));
+        const double sin_theta = std::sin(pose(2));
+        for (const int &local_id : result.new_ids)
+        {
+            const Eigen::Vector2d p = observation.cloud_[local_id].cast<double>();
+            landmarks_.push_back(Eigen::Vector2d(p.x() * cos_theta - p.y() * sin_theta + pose(0),
+                                                 p.x() * sin_theta + p.y() * cos_theta + pose(1)));
+            add_factor(local_id, LandmarkNumber() - 1, false);
+        }
+    }
+
+    Solve();
+    UpdateCoviarance();
+    if (PoseNumber() > options_.smoother_window_size)
+        MarginalizeOldestPose();
+    UpdateLandmarkIndex();
+    UpdateSnapshot(true);
+    const Eigen::Vector3d &pose = poses_.back();
+    LOG(INFO) << "Update now pose is: " << pose(0) << "," << pose(1) << "," << pose(2);
+}
+
+ReflectorFixedLagSmoother::Linearization ReflectorFixedLagSmoother::LinearizePrior() const
+{
+    Linearization result;
+    result.variables = prior_.variables;
+    Eigen::VectorXd difference(prior_.linearization.rows());
+    int offset = 0;
+    for (const auto &variable : prior_.variables)
+    {
+        const int dimension = Dimension(variable);
+        difference.segment(offset, dimension) = Value(variable) - prior_.linearization.segment(offset, dimension);
+        if (variable.is_pose)
+            difference(offset + 2) = NormalizeAngle(difference(offset + 2));
+        result.jacobians.push_back(prior_.sqrt_information.middleCols(offset, dimension));
+        offset += dimension;
+    }
+    result.residual = prior_.residual + prior_.sqrt_information * difference;
+    return result;
+}
+
+ReflectorFixedLagSmoother::Linearization ReflectorFixedLagSmoother::LinearizeOdometry(const OdometryFactor &factor) const
+{
+    const Eigen::Vector3d &from = poses_[factor.pose_id - first_pose_id_];
+    const Eigen::Vector3d &to = poses_[factor.pose_id + 1 - first_pose_id_];
+    const double cos_theta = std::cos(from(2));
+    const double sin_theta = std::sin(from(2));
+    const double delta_x = to(0) - from(0);
+    const double delta_y = to(1) - from(1);
+    // 'to' in the frame of 'from' minus the odometry
+    Eigen::Vector3d error(delta_x * cos_theta + delta_y * sin_theta,
+                          -delta_x * sin_theta + delta_y * cos_theta,
+                          to(2) - from(2));
+    error -= factor.delta;
+    error(2) = NormalizeAngle(error(2));
+    Eigen::Matrix3d J_from, J_to;
+    J_from << -cos_theta, -sin_theta, -delta_x * sin_theta + delta_y * cos_theta,
+        sin_theta, -cos_theta, -delta_x * cos_theta - delta_y * sin_theta,
+        0., 0., -1.;
+    J_to << cos_theta, sin_theta, 0.,
+        -sin_theta, cos_theta, 0.,
+        0., 0., 1.;
+
+    Linearization result;
+    result.residual = factor.sqrt_information * error;
+    result.variables.push_back({true, factor.pose_id});
+    result.jacobians.push_back(factor.sqrt_information * J_from);
+    result.variables.push_back({true, factor.pose_id + 1});
+    result.jacobians.push_back(factor.sqrt_information * J_to);
+    return result;
+}
+
+ReflectorFixedLagSmoother::Linearization ReflectorFixedLagSmoother::LinearizeReflector(const ReflectorFactor &factor) const
+{
+    const Eigen::Vector3d &pose = poses_[factor.pose_id - first_pose_id_];
+    const Eigen::Vector2d m = factor.map_reflector ? map_.reflector_map_[factor.landmark_id].cast<double>()
+                                                   : landmarks_[factor.landmark_id];
+    const double cos_theta = std::cos(pose(2));
+    const double sin_theta = std::sin(pose(2));
+    const double delta_x = m.x() - pose(0);
+    const double delta_y = m.y() - pose(1);
+    // z_hat - z, same observation model as the EKF
+    const Eigen::Vector2d error(delta_x * cos_theta + delta_y * sin_theta - factor.observation.x(),
+                                -delta_x * sin_theta + delta_y * cos_theta - factor.observation.y());
+    Eigen::Matrix<double, 2, 3> J_pose;
+    J_pose << -cos_theta, -sin_theta, -delta_x * sin_theta + delta_y * cos_theta,
+        sin_theta, -cos_theta, -delta_x * cos_theta - delta_y * sin_theta;
+
+    Linearization result;
+    result.residual = observation_sqrt_information_ * error;
+    result.variables.push_back({true, factor.pose_id});
+    result.jacobians.push_back(observation_sqrt_information_ * J_pose);
+    if (!factor.map_reflector)
+    {
+        Eigen::Matrix2d J_landmark;
+        J_landmark << cos_theta, sin_theta, -sin_theta, cos_theta;
+        result.variables.push_back({false, factor.landmark_id});
+        result.jacobians.push_back(observation_sqrt_information_ * J_landmark);
+    }
+    return result;
+}
+
+void ReflectorFixedLagSmoother::BuildInformation(Eigen::SparseMatrix<double> *information, Eigen::VectorXd *gradient) const
+{
+    std::vector<Linearization> factors;
+    factors.reserve(1 + odometry_factors_.size() + reflector_factors_.size());
+    if (!prior_.variables.empty())
+        factors.push_back(LinearizePrior());
+    for (const auto &factor : odometry_factors_)
+        factors.push_back(LinearizeOdometry(factor));
+    for (const auto &factor : reflector_factors_)
+        factors.push_back(LinearizeReflector(factor));
+
+    const int n = WindowDimension();
+    std::vector<Eigen::Triplet<double>> triplets;
+    *gradient = Eigen::VectorXd::Zero(n);
+    for (const auto &factor : factors)
+    {
+        for (int a = 0; a < factor.variables.size(); ++a)
+        {
+            const Eigen::MatrixXd &J_a = factor.jacobians[a];
+            const int row = Column(factor.variables[a]);
+            gradient->segment(row, J_a.cols()) += J_a.transpose() * factor.residual;
+            for (int b = 0; b < factor.variables.size(); ++b)
+            {
+                const Eigen::MatrixXd block = J_a.transpose() * factor.jacobians[b];
+                const int col = Column(factor.variables[b]);
+                for (int i = 0; i < block.rows(); ++i)
+                {
+                    for (int j = 0; j < block.cols(); ++j)
+                        triplets.emplace_back(row + i, col + j, block(i, j));
+                }
+            }
+        }
+    }
+    // Duplicated entries are summed
+    information->resize(n, n);
+    information->setFromTriplets(triplets.begin(), triplets.end());
+}
+
+void ReflectorFixedLagSmoother::Solve()
+{
+    Eigen::SparseMatrix<double> information;
+    Eigen::VectorXd gradient;
+    Eigen::SimplicialLLT<Eigen::SparseMatrix<double>> llt;
+    for (int iteration = 0; iteration < options_.smoother_iterations; ++iteration)
+    {
+        BuildInformation(&information, &gradient);
+        // Factors do not change between iterations, neither does the sparsity pattern
+        if (iteration == 0)
+            llt.analyzePattern(information);
+        llt.factorize(information);
+        if (llt.info() != Eigen::Success)
+        {
+            LOG(WARNING) << "Information matrix of the window is not positive definite";
+            return;
+        }
+        const Eigen::VectorXd step = -llt.solve(gradient);
+        for (int i = 0; i < PoseNumber(); ++i)
+        {
+            poses_[i] += step.segment<3>(3 * i);
+            poses_[i](2) = NormalizeAngle(poses_[i](2));
+        }
+        for (int id = 0; id < LandmarkNumber(); ++id)
+            landmarks_[id] += step.segment<2>(3 * PoseNumber() + 2 * id);
+        if (step.lpNorm<Eigen::Infinity>() < kConvergedStep)
+            break;
+    }
+}
+
+void ReflectorFixedLagSmoother::UpdateCoviarance()
+{
+    Eigen::SparseMatrix<double> information;
+    Eigen::VectorXd gradient;
+    BuildInformation(&information, &gradient);
+    const int n = WindowDimension();
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> ldlt(information);
+    if (ldlt.info() != Eigen::Success)
+    {
+        LOG(WARNING) << "Information matrix of the window is singular, regularize it";
+        Eigen::SparseMatrix<double> identity(n, n);
+        identity.setIdentity();
+        information += kMinOdometryVariance * identity;
+        ldlt.compute(information);
+    }
+    if (ldlt.info() != Eigen::Success)
+    {
+        // Regularized information is positive definite unless it is not finite
+        LOG(WARNING) << "Regularized information matrix of the window is singular, use its diagonal";
+        coviarance_ = information.diagonal().array().inverse().matrix().asDiagonal();
+        return;
+    }
+    coviarance_ = ldlt.solve(Eigen::MatrixXd::Identity(n, n));
+}
+
+void ReflectorFixedLagSmoother::Marginalize(const std::vector<Variable> &removed, const std::vector<Linearization> &factors)
+{
+    // Removed variables first, then the kept ones
+    std::vector<Variable> variables = removed;
+    const auto index_of = [&variables](const Variable &variable) -> int {
+        for (int i = 0; i < variables.size(); ++i)
+        {
+            if (variables[i].is_pose == variable.is_pose && variables[i].id == variable.id)
+                return i;
+        }
+        return -1;
+    };
+    for (const auto &factor : factors)
+    {
+        for (const auto &variable : factor.variables)
+        {
+            if (index_of(variable) < 0)
+                variables.push_back(variable);
+        }
+    }
+    std::vector<int> offsets;
+    int dimension = 0;
+    int m = 0;
+    for (int i = 0; i < variables.size(); ++i)
+    {
+        offsets.push_back(dimension);
+        dimension += Dimension(variables[i]);
+        if (i < removed.size())
+            m = dimension;
+    }
+
+    // J^T * J and J^T * e of the factors over these variables
+    Eigen::MatrixXd information = Eigen::MatrixXd::Zero(dimension, dimension);
+    Eigen::VectorXd gradient = Eigen::VectorXd::Zero(dimension);
+    for (const auto &factor : factors)
+    {
+        for (int a = 0; a < factor.variables.size(); ++a)
+        {
+            const Eigen::MatrixXd &J_a = factor.jacobians[a];
+            const int row = offsets[index_of(factor.variables[a])];
+            gradient.segment(row, J_a.cols()) += J_a.transpose() * factor.residual;
+            for (int b = 0; b < factor.variables.size(); ++b)
+            {
+                const int col = offsets[index_of(factor.variables[b])];
+                information.block(row, col, J_a.cols(), factor.jacobians[b].cols()) += J_a.transpose() * factor.jacobians[b];
+            }
+        }
+    }
+
+    // Schur complement of the removed block
+    const int k = dimension - m;
+    prior_ = Prior();
+    if (k == 0)
+        return;
+    const Eigen::MatrixXd information_mk = information.topRightCorner(m, k);
+    const Eigen::MatrixXd solved_mk = information.topLeftCorner(m, m).ldlt().solve(information_mk);
+    Eigen::MatrixXd information_k = information.bottomRightCorner(k, k) - information_mk.transpose() * solved_mk;
+    const Eigen::VectorXd gradient_k = gradient.tail(k) - solved_mk.transpose() * gradient.head(m);
+
+    // Square root form: information_k = R^T * R, e = R^-T * gradient_k
+    Eigen::LLT<Eigen::MatrixXd> llt(information_k);
+    if (llt.info() != Eigen::Success)
+    {
+        LOG(WARNING) << "Marginal information is not positive definite, regularize it";
+        information_k.diagonal().array() += kMinOdometryVariance;
+        llt.compute(information_k);
+    }
+    prior_.variables.assign(variables.begin() + removed.size(), variables.end());
+    prior_.linearization.resize(k);
+    for (int i = removed.size(); i < variables.size(); ++i)
+        prior_.linearization.segment(offsets[i] - m, Dimension(variables[i])) = Value(variables[i]);
+    prior_.sqrt_information = llt.matrixU();
+    prior_.residual = llt.matrixL().solve(gradient_k);
+}
+
+void ReflectorFixedLagSmoother::MarginalizeOldestPose()
+{
+    const int oldest = first_pose_id_;
+    std::vector<Linearization> factors;
+    if (!prior_.variables.empty())
+        factors.push_back(LinearizePrior());
+    while (!odometry_factors_.empty() && odometry_factors_.front().pose_id == oldest)
+    {
+        factors.push_back(LinearizeOdometry(odometry_factors_.front()));
+        odometry_factors_.pop_front();
+    }
+    while (!reflector_factors_.empty() && reflector_factors_.front().pose_id == oldest)
+    {
+        factors.push_back(LinearizeReflector(reflector_factors_.front()));
+        reflector_factors_.pop_front();
+    }
+    Marginalize({{true, oldest}}, factors);
+
+    // Landmarks only observed by the oldest pose leave the window
+    std::vector<bool> observed(LandmarkNumber(), false);
+    for (const auto &factor : reflector_factors_)
+    {
+        if (!factor.map_reflector)
+            observed[factor.landmark_id] = true;
+    }
+    // Marginals of the kept variables do not change, keep their covariance
+    std::vector<int> kept_columns;
+    for (int i = 3; i < 3 * PoseNumber(); ++i)
+        kept_columns.push_back(i);
+    std::vector<int> unobserved;
+    for (int id = 0; id < LandmarkNumber(); ++id)
+    {
+        const int column = Column({false, id});
+        if (!observed[id])
+        {
+            unobserved.push_back(id);
+            continue;
+        }
+        kept_columns.push_back(column);
+        kept_columns.push_back(column + 1);
+    }
+    if (!unobserved.empty())
+    {
+        // Marginal of a landmark is its mean and 2x2 diagonal block, from now on it
+        // is matched as a fixed map reflector
+        std::vector<Variable> removed;
+        for (const int &id : unobserved)
+        {
+            const int column = Column({false, id});
+            map_.reflector_map_.push_back(landmarks_[id].cast<float>());
+            map_.reflector_map_coviarance_.push_back(coviarance_.block<2, 2>(column, column));
+            map_index_.Insert(map_, map_.reflector_map_.size() - 1);
+            removed.push_back({false, id});
+        }
+        Marginalize(removed, {LinearizePrior()});
+        RemoveLandmarks(unobserved);
+        MapChanged();
+        LOG(INFO) << "Move " << unobserved.size() << " reflectors from window to map, "
+                  << LandmarkNumber() << " left";
+    }
+    poses_.pop_front();
+    ++first_pose_id_;
+
+    const int n = kept_columns.size();
+    Eigen::MatrixXd coviarance(n, n);
+    for (int j = 0; j < n; ++j)
+    {
+        for (int i = 0; i < n; ++i)
+            coviarance(i, j) = coviarance_(kept_columns[i], kept_columns[j]);
+    }
+    coviarance_.swap(coviarance);
+}
+
+void ReflectorFixedLagSmoother::RemoveLandmarks(const std::vector<int> &landmark_ids)
+{
+    std::vector<bool> removed(LandmarkNumber(), false);
+    for (const int &id : landmark_ids)
+        removed[id] = true;
+    std::vector<int> new_ids(LandmarkNumber(), -1);
+    int kept = 0;
+    for (int id = 0; id < LandmarkNumber(); ++id)
+    {
+        if (removed[id])
+            continue;
+        new_ids[id] = kept;
+        landmarks_[kept++] = landmarks_[id];
+    }
+    landmarks_.resize(kept);
+    for (auto &factor : reflector_factors_)
+    {
+        if (factor.map_reflector)
+            continue;
+        factor.landmark_id = new_ids[factor.landmark_id];
+        CHECK(factor.landmark_id >= 0);
+    }
+    for (auto &variable : prior_.variables)
+    {
+        if (variable.is_pose)
+            continue;
+        variable.id = new_ids[variable.id];
+        CHECK(variable.id >= 0);
+    }
+    // Landmark ids changed
+    landmark_index_.Clear();
+}
+
+void ReflectorFixedLagSmoother::UpdateLandmarkIndex()
+{
+    for (int id = 0; id < LandmarkNumber(); ++id)
+        landmark_index_.Update(id, landmarks_[id]);
+}
+
+double ReflectorFixedLagSmoother::LandmarkMatchRadius(const int &id) const
+{
+    const int column = Column({false, id});
+    const Eigen::Matrix2d coviarance = coviarance_.block<2, 2>(column, column) +
+                                       CurrentPoseCoviarance().topLeftCorner<2, 2>() + Qt_;
+    return ekf::LandmarkMatchRadius(coviarance);
+}
+
+void ReflectorFixedLagSmoother::UpdateSnapshot(const bool &landmarks_changed)
+{
+    PoseState robot;
+    robot.time = time_;
+    robot.pose = CurrentPose();
+    robot.coviarance = CurrentPoseCoviarance();
+    std::shared_ptr<LandmarkSnapshot> landmarks;
+    if (landmarks_changed)
+    {
+        const auto landmark = [this](const int &id, Eigen::Vector2d *position, Eigen::Matrix2d *coviarance) {
+            const int column = Column({false, id});
+            *position = landmarks_[id];
+            *coviarance = coviarance_.block<2, 2>(column, column);
+        };
+        landmarks = LandmarkSnapshot::Build(nullptr, LandmarkNumber(), {}, landmark);
+    }
+    PublishSnapshot(robot, landmarks);
+}
+
+ReflectorMatchResult ReflectorFixedLagSmoother::ReflectorMatch(const sensor::Observation &obs)
+{
+    ReflectorMatchResult ids;
+    if (obs.cloud_.empty())
+    {
+        LOG(ERROR) << "Should never reach here";
+        exit(-1);
+    }
+    const int M = LandmarkNumber();
+    const int M_ = map_.reflector_map_.size();
+    if (M == 0 && M_ == 0)
+    {
+        for (int i = 0; i < obs.cloud_.size(); ++i)
+            ids.new_ids.push_back(i);
+        LOG(ERROR) << "Reflector map is empty";
+        return ids;
+    }
+
+    const Eigen::Vector3d pose = CurrentPose();
+    auto point_transformed_to_global_frame = [&](const Eigen::Vector2f &p) -> Eigen::Vector2f {
+        const float x = p.x() * std::cos(pose(2)) - p.y() * std::sin(pose(2)) + pose(0);
+        const float y = p.x() * std::sin(pose(2)) + p.y() * std::cos(pose(2)) + pose(1);
+        return Eigen::Vector2f(x, y);
+    };
+
+    std::vector<int> candidates;
+    for (int i = 0; i < obs.cloud_.size(); ++i)
+    {
+        const auto reflector = point_transformed_to_global_frame(obs.cloud_[i]);
+        // Match with global map
+        if (M_ > 0)
+        {
+            // Only map reflectors whose gate can contain the observation are checked
+            const int best_match = map_index_.Match(map_, reflector, nullptr);
+            if (best_match >= 0)
+            {
+                ids.map_obs_match_ids.push_back({i, best_match});
+                continue;
+            }
+        }
+        // Match with window landmarks near the observation
+        if (M > 0)
+        {
+            candidates.clear();
+            landmark_index_.Query(reflector.cast<double>(), kStateMatchDistance, &candidates);
+            int best_match = -1;
+            double best_distance = std::numeric_limits<double>::max();
+            for (const int &j : candidates)
+            {
+                const double dist = (reflector.cast<double>() - landmarks_[j]).norm();
+                if (dist < best_distance)
+                {
+                    best_distance = dist;
+                    best_match = j;
+                }
+            }
+            if (best_match >= 0 && best_distance < LandmarkMatchRadius(best_match))
+            {
+                ids.state_obs_match_ids.push_back({i, best_match});
+                continue;
+            }
+        }
+        ids.new_ids.push_back(i);
+    }
+    return ids;
+}
+
+} // namespace ekf
@@ -0,0 +1,558 @@
+#include "reflector_ekf_slam/reflector_seif_slam.h"
+#include "reflector_ekf_slam/ekf_update.h"
+#include "sensor/map_io.h"
+#include <Eigen/Sparse>
+#include <algorithm>
+#include <limits>
+#include <glog/logging.h>
+
+namespace ekf
+{
+namespace
+{
+// Standard deviation of the initial pose, its information would be infinite otherwise
+constexpr double kInitialPoseStd = 1e-3;
+
+double NormalizeAngle(const double &angle)
+{
+    return std::atan2(std::sin(angle), std::cos(angle));
+}
+} // namespace
+
+ReflectorSEIFSLAM::ReflectorSEIFSLAM(const EKFOptions &options)
+    : options_(options), time_(options.init_time), vt_(Eigen::Vector3d::Zero())
+{
+    CHECK(options_.seif_active_landmarks > 0);
+    CHECK(!options_.use_imu) << "SEIF predicts from odometry only";
+    Qu_ = InputCoviarance(options_.odom_model, options_.linear_velocity_cov, options_.angular_velocity_cov);
+    Qt_ << options_.observation_cov, 0.f,
+        0.f, options_.observation_cov;
+    Qt_inverse_ = Qt_.inverse();
+
+    robot_coviarance_ = Eigen::Matrix3d::Identity() * kInitialPoseStd * kInitialPoseStd;
+    omega_xx_ = robot_coviarance_.inverse();
+    mu_x_ = options_.init_pose;
+    xi_x_ = omega_xx_ * mu_x_;
+
+    // Load map
+    sensor::LoadMap(options_.map_path, kMapMatchGate, Qt_, &map_, &map_index_);
+    UpdateSnapshot(true);
+}
+
+ReflectorSEIFSLAM::~ReflectorSEIFSLAM()
+{
+}
+
+std::vector<int> ReflectorSEIFSLAM::ActiveLandmarks() const
+{
+    std::vector<int> ids;
+    ids.reserve(omega_xm_.size());
+    for (const auto &link : omega_xm_)
+        ids.push_back(link.first);
+    return ids;
+}
+
+Eigen::MatrixXd ReflectorSEIFSLAM::BlockInformation(const std::vector<int> &ids) const
+{
+    const int n = 3 + 2 * ids.size();
+    std::unordered_map<int, int> slots;
+    for (int i = 0; i < ids.size(); ++i)
+        slots[ids[i]] = i;
+    Eigen::MatrixXd omega = Eigen::MatrixXd::Zero(n, n);
+    omega.topLeftCorner<3, 3>() = omega_xx_;
+    for (int i = 0; i < ids.size(); ++i)
+    {
+        const int id = ids[i];
+        const int column = 3 + 2 * i;
+        omega.block<2, 2>(column, column) = omega_mm_[id];
+        const auto robot_link = omega_xm_.find(id);
+        if (robot_link != omega_xm_.end())
+        {
+            omega.block<3, 2>(0, column) = robot_link->second;
+            omega.block<2, 3>(column, 0) = robot_link->second.transpose();
+        }
+        for (const auto &link : omega_links_[id])
+        {
+            const auto slot = slots.find(link.first);
+            if (slot != slots.end())
+                omega.block<2, 2>(column, 3 + 2 * slot->second) = link.second;
+        }
+    }
+    return omega;
+}
+
+Eigen::VectorXd ReflectorSEIFSLAM::BlockInformationVector(const std::vector<int> &ids) const
+{
+    Eigen::VectorXd xi(3 + 2 * ids.size());
+    xi.head<3>() = xi_x_;
+    for (int i = 0; i < ids.size(); ++i)
+        xi.segment<2>(3 + 2 * i) = xi_m_[ids[i]];
+    return xi;
+}
+
+Eigen::VectorXd ReflectorSEIFSLAM::BlockMean(const std::vector<int> &ids) const
+{
+    Eigen::VectorXd mu(3 + 2 * ids.size());
+    mu.head<3>() = mu_x_;
+    for (int i = 0; i < ids.size(); ++i)
+        mu.segment<2>(3 + 2 * i) = mu_m_[ids[i]];
+    return mu;
+}
+
+void ReflectorSEIFSLAM::SetBlockInformation(const std::vector<int> &ids, const Eigen::MatrixXd &omega)
+{
+    omega_xx_ = omega.topLeftCorner<3, 3>();
+    for (int i = 0; i < ids.size(); ++i)
+    {
+        const int id = ids[i];
+        const int column = 3 + 2 * i;
+        omega_mm_[id] = omega.block<2, 2>(column, column);
+        const RobotLandmarkBlock robot_link = omega.block<3, 2>(0, column);
+        if (robot_link.isZero(0.))
+            omega_xm_.erase(id);
+        else
+            omega_xm_[id] = robot_link;
+        for (int j = i + 1; j < ids.size(); ++j)
+        {
+            const Eigen::Matrix2d link = omega.block<2, 2>(column, 3 + 2 * j);
+            if (link.isZero(0.))
+            {
+                omega_links_[id].erase(ids[j]);
+                omega_links_[ids[j]].erase(id);
+                continue;
+            }
+            omega_links_[id][ids[j]] = link;
+            omega_links_[ids[j]][id] = link.transpose();
+        }
+    }
+}
+
+void ReflectorSEIFSLAM::SetBlockInformationVector(const std::vector<int> &ids, const Eigen::VectorXd &xi)
+{
+    xi_x_ = xi.head<3>();
+    for (int i = 0; i < ids.size(); ++i)
+        xi_m_[ids[i]] = xi.segment<2>(3 + 2 * i);
+}
+
+void ReflectorSEIFSLAM::Predict(const double &dt)
+{
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G;
+    Eigen::Matrix3d R;
+    RobotMotion(mu_x_(2), vt_, dt, options_.odom_model, Qu_, &delta, &G, &R);
+    robot_coviarance_ = G * robot_coviarance_ * G.transpose() + R;
+
+    // Only the robot and the active landmarks change. Transform the robot by G,
+    // then add noise R: omega - omega_:x * R * (I + omega_xx * R)^-1 * omega_x:
+    const std::vector<int> ids = ActiveLandmarks();
+    Eigen::MatrixXd omega = BlockInformation(ids);
+    const Eigen::VectorXd old_product = omega * BlockMean(ids);
+    const Eigen::Matrix3d G_inverse = G.inverse();
+    omega.leftCols<3>() = omega.leftCols<3>() * G_inverse;
+    omega.topRows<3>() = G_inverse.transpose() * omega.topRows<3>();
+    const Eigen::Matrix3d K = R * (Eigen::Matrix3d::Identity() + omega.topLeftCorner<3, 3>() * R).inverse();
+    const Eigen::MatrixXd omega_x = omega.topRows<3>();
+    omega.noalias() -= omega_x.transpose() * K * omega_x;
+    // Robot angle is not normalized inside the filter, xi must stay omega * mu
+    mu_x_ += delta;
+    // xi changes as omega * mu did on these rows
+    const Eigen::VectorXd xi = BlockInformationVector(ids) + omega * BlockMean(ids) - old_product;
+    SetBlockInformation(ids, omega);
+    SetBlockInformationVector(ids, xi);
+}
+
+void ReflectorSEIFSLAM::HandleOdometryMessage(const sensor::OdometryData &odometry)
+{
+    // drop old data
+    if (odometry.time < time_)
+        return;
+    vt_ = Eigen::Vector3d(odometry.linear_velocity.x(), odometry.linear_velocity.y(), odometry.angular_velocity.z());
+    Predict(odometry.time - time_);
+    time_ = odometry.time;
+    UpdateSnapshot(false);
+}
+
+void ReflectorSEIFSLAM::HandleImuMessage(const sensor::ImuData & /*imu*/)
+{
+    // Odometry only, see the constructor
+}
+
+void ReflectorSEIFSLAM::AddReflectorInformation(const Eigen::Vector2d &observed, const int &id, const Eigen::Vector2d &position)
+{
+    const double cos_theta = std::cos(mu_x_(2));
+    const double sin_theta = std::sin(mu_x_(2));
+    const double delta_x = position.x() - mu_x_(0);
+    const double delta_y = position.y() - mu_x_(1);
+    Eigen::Matrix<double, 2, 3> H_x;
+    H_x << -cos_theta, -sin_theta, -delta_x * sin_theta + delta_y * cos_theta,
+        sin_theta, -cos_theta, -delta_x * cos_theta - delta_y * sin_theta;
+    const Eigen::Vector2d innovation(observed.x() - (delta_x * cos_theta + delta_y * sin_theta),
+                                     observed.y() - (-delta_x * sin_theta + delta_y * cos_theta));
+    // omega += H^T * Qt^-1 * H, xi += H^T * Qt^-1 * (z - z_hat + H * mu)
+    Eigen::Vector2d residual = innovation + H_x * mu_x_;
+    if (id < 0)
+    {
+        omega_xx_ += H_x.transpose() * Qt_inverse_ * H_x;
+        xi_x_ += H_x.transpose() * Qt_inverse_ * residual;
+        return;
+    }
+    Eigen::Matrix2d H_m;
+    H_m << cos_theta, sin_theta, -sin_theta, cos_theta;
+    residual += H_m * position;
+    omega_xx_ += H_x.transpose() * Qt_inverse_ * H_x;
+    const RobotLandmarkBlock robot_link = H_x.transpose() * Qt_inverse_ * H_m;
+    const auto it = omega_xm_.find(id);
+    if (it == omega_xm_.end())
+        omega_xm_[id] = robot_link;
+    else
+        it->second += robot_link;
+    omega_mm_[id] += H_m.transpose() * Qt_inverse_ * H_m;
+    xi_x_ += H_x.transpose() * Qt_inverse_ * residual;
+    xi_m_[id] += H_m.transpose() * Qt_inverse_ * residual;
+}
+
+int ReflectorSEIFSLAM::AddLandmark(const Eigen::Vector2d &observed)
+{
+    const double cos_theta = std::cos(mu_x_(2));
+    const double sin_theta = std::sin(mu_x_(2));
+    const Eigen::Vector2d position(observed.x() * cos_theta - observed.y() * sin_theta + mu_x_(0),
+                                   observed.x() * sin_theta + observed.y() * cos_theta + mu_x_(1));
+    // Without information until its first observation is added
+    const int id = LandmarkNumber();
+    mu_m_.push_back(position);
+    xi_m_.push_back(Eigen::Vector2d::Zero());
+    omega_mm_.push_back(Eigen::Matrix2d::Zero());
+    omega_links_.emplace_back();
+    landmark_coviarances_.push_back(Qt_);
+    landmark_index_.Update(id, position);
+    changed_landmarks_.push_back(id);
+    AddReflectorInformation(observed, id, position);
+    return id;
+}
+
+void ReflectorSEIFSLAM::Sparsify(const std::vector<int> &observed)
+{
+    const int active = omega_xm_.size();
+    if (active <= options_.seif_active_landmarks)
+        return;
+    // Weakest links of landmarks not observed in this scan are removed first
+    std::vector<bool> keep(LandmarkNumber(), false);
+    for (const int &id : observed)
+        keep[id] = true;
+    std::vector<std::pair<double, int>> strength_id;
+    for (const auto &link : omega_xm_)
+    {
+        if (!keep[link.first])
+            strength_id.push_back({link.second.norm(), link.first});
+    }
+    std::sort(strength_id.begin(), strength_id.end());
+    const int removed_number = std::min<int>(active - options_.seif_active_landmarks, strength_id.size());
+    if (removed_number <= 0)
+        return;
+
+    // Order robot, removed (m0), kept (m+)
+    std::vector<int> ids;
+    for (int i = 0; i < removed_number; ++i)
+        ids.push_back(strength_id[i].second);
+    for (const auto &link : omega_xm_)
+    {
+        if (std::find(ids.begin(), ids.end(), link.first) == ids.end())
+            ids.push_back(link.first);
+    }
+    const Eigen::MatrixXd omega = BlockInformation(ids);
+    const int m0 = 2 * removed_number;
+    // Thrun's sparsification, every term is within robot and active landmarks:
+    //   omega - omega_:m0 * omega_m0m0^-1 * omega_m0:
+    //         + omega_:xm0 * omega_xm0xm0^-1 * omega_xm0: - omega_:x * omega_xx^-1 * omega_x:
+    const Eigen::MatrixXd omega_m0 = omega.middleCols(3, m0);
+    const Eigen::MatrixXd omega_xm0 = omega.leftCols(3 + m0);
+    const Eigen::MatrixXd omega_x = omega.leftCols<3>();
+    Eigen::MatrixXd change = -omega_m0 * omega.block(3, 3, m0, m0).ldlt().solve(omega_m0.transpose());
+    change += omega_xm0 * omega.topLeftCorner(3 + m0, 3 + m0).ldlt().solve(omega_xm0.transpose());
+    change -= omega_x * omega.topLeftCorner<3, 3>().ldlt().solve(omega_x.transpose());
+    Eigen::MatrixXd sparsified = omega + change;
+    sparsified = 0.5 * (sparsified + sparsified.transpose());
+    // Links of the robot to m0 vanish up to rounding
+    sparsified.block(0, 3, 3, m0).setZero();
+    sparsified.block(3, 0, m0, 3).setZero();
+    const Eigen::VectorXd xi = BlockInformationVector(ids) + (sparsified - omega) * BlockMean(ids);
+    SetBlockInformation(ids, sparsified);
+    SetBlockInformationVector(ids, xi);
+    CHECK(omega_xm_.size() == ids.size() - removed_number);
+}
+
+void ReflectorSEIFSLAM::RecoverLocalMeans()
+{
+    // Robot, active landmarks and landmarks near the robot, the means of the
+    // others are taken as they are
+    std::vector<int> ids = ActiveLandmarks();
+    landmark_index_.Query(mu_x_.head<2>(), options_.local_region_radius, &ids);
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    std::unordered_map<int, int> slots;
+    for (int i = 0; i < ids.size(); ++i)
+        slots[ids[i]] = i;
+    const Eigen::MatrixXd omega = BlockInformation(ids);
+    Eigen::VectorXd xi = BlockInformationVector(ids);
+    for (int i = 0; i < ids.size(); ++i)
+    {
+        for (const auto &link : omega_links_[ids[i]])
+        {
+            if (!slots.count(link.first))
+                xi.segment<2>(3 + 2 * i) -= link.second * mu_m_[link.first];
+        }
+    }
+    Eigen::LLT<Eigen::MatrixXd> llt(omega);
+    if (llt.info() != Eigen::Success)
+    {
+        LOG(WARNING) << "Local information matrix is not positive definite, keep old means";
+        return;
+    }
+    const Eigen::VectorXd mu = llt.solve(xi);
+    const Eigen::MatrixXd coviarance = llt.solve(Eigen::MatrixXd::Identity(omega.rows(), omega.cols()));
+    mu_x_ = mu.head<3>();
+    robot_coviarance_ = coviarance.topLeftCorner<3, 3>();
+    for (int i = 0; i < ids.size(); ++i)
+    {
+        mu_m_[ids[i]] = mu.segment<2>(3 + 2 * i);
+        landmark_coviarances_[ids[i]] = coviarance.block<2, 2>(3 + 2 * i, 3 + 2 * i);
+        landmark_index_.Update(ids[i], mu_m_[ids[i]]);
+    }
+    changed_landmarks_.insert(changed_landmarks_.end(), ids.begin(), ids.end());
+}
+
+void ReflectorSEIFSLAM::SyncGlobalState()
+{
+    // Exact means, omega * mu = xi over the whole map
+    const int N = 3 + 2 * LandmarkNumber();
+    std::vector<Eigen::Triplet<double>> triplets;
+    const auto add_block = [&triplets](const int &row, const int &col, const Eigen::MatrixXd &block) {
+        for (int j = 0; j < block.cols(); ++j)
+        {
+            for (int i = 0; i < block.rows(); ++i)
+                triplets.emplace_back(row + i, col + j, block(i, j));
+        }
+    };
+    add_block(0, 0, omega_xx_);
+    for (const auto &link : omega_xm_)
+    {
+        add_block(0, 3 + 2 * link.first, link.second);
+        add_block(3 + 2 * link.first, 0, link.second.transpose());
+    }
+    Eigen::VectorXd xi(N);
+    xi.head<3>() = xi_x_;
+    for (int id = 0; id < LandmarkNumber(); ++id)
+    {
+        add_block(3 + 2 * id, 3 + 2 * id, omega_mm_[id]);
+        for (const auto &link : omega_links_[id])
+            add_block(3 + 2 * id, 3 + 2 * link.first, link.second);
+        xi.segment<2>(3 + 2 * id) = xi_m_[id];
+    }
+    Eigen::SparseMatrix<double> omega(N, N);
+    omega.setFromTriplets(triplets.begin(), triplets.end());
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> ldlt(omega);
+    if (ldlt.info() != Eigen::Success)
+    {
+        LOG(WARNING) << "Information matrix is singular, keep old means";
+        return;
+    }
+    const Eigen::VectorXd mu = ldlt.solve(xi);
+    mu_x_ = mu.head<3>();
+    for (int id = 0; id < LandmarkNumber(); ++id)
+    {
+        mu_m_[id] = mu.segment<2>(3 + 2 * id);
+        landmark_index_.Update(id, mu_m_[id]);
+        changed_landmarks_.push_back(id);
+    }
+    UpdateSnapshot(true);
+}
+
+State ReflectorSEIFSLAM::GetState()
+{
+    // Dense inverse of the whole information matrix
+    std::vector<int> ids(LandmarkNumber());
+    for (int id = 0; id < LandmarkNumber(); ++id)
+        ids[id] = id;
+    const Eigen::MatrixXd omega = BlockInformation(ids);
+    State state;
+    state.time = time_;
+    state.sigma = omega.ldlt().solve(Eigen::MatrixXd::Identity(omega.rows(), omega.cols()));
+    state.mu = state.sigma * BlockInformationVector(ids);
+    state.mu(2) = NormalizeAngle(state.mu(2));
+    return state;
+}
+
+State ReflectorSEIFSLAM::PredictState(const double &time)
+{
+    State result = GetState();
+    const double dt = time - time_;
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G;
+    Eigen::Matrix3d Q;
+    RobotMotion(result.mu(2), vt_, dt, options_.odom_model, Qu_, &delta, &G, &Q);
+    // Only robot rows and columns change
+    const Eigen::Matrix3d sigma_xi = G * result.sigma.topLeftCorner(3, 3) * G.transpose() + Q;
+    const int N = result.mu.rows();
+    if (N > 3)
+    {
+        const Eigen::MatrixXd sigma_xm = G * result.sigma.topRightCorner(3, N - 3);
+        result.sigma.topRightCorner(3, N - 3) = sigma_xm;
+        result.sigma.bottomLeftCorner(N - 3, 3) = sigma_xm.transpose();
+    }
+    result.sigma.topLeftCorner(3, 3) = sigma_xi;
+    result.mu.head(3) += delta;
+    result.mu(2) = NormalizeAngle(result.mu(2));
+    result.time = time;
+    return result;
+}
+
+PoseState ReflectorSEIFSLAM::PredictPose(const double &time)
+{
+    PoseState result;
+    result.time = time;
+    const double dt = time - time_;
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d G;
+    Eigen::Matrix3d Q;
+    RobotMotion(mu_x_(2), vt_, dt, options_.odom_model, Qu_, &delta, &G, &Q);
+    result.coviarance = G * robot_coviarance_ * G.transpose() + Q;
+    result.pose = mu_x_ + delta;
+    result.pose(2) = NormalizeAngle(result.pose(2));
+    return result;
+}
+
+void ReflectorSEIFSLAM::HandleObservationMessage(const sensor::Observation &observation)
+{
+    Predict(observation.time_ - time_);
+    time_ = observation.time_;
+    if (observation.cloud_.empty())
+    {
+        UpdateSnapshot(false);
+        return;
+    }
+    ReflectorMatchResult result = ReflectorMatch(observation);
+    LOG(INFO) << "Match with old map size is: " << result.map_obs_match_ids.size();
+    LOG(INFO) << "Match with state vector size is: " << result.state_obs_match_ids.size();
+
+    // Information of all observations is linearized at the same means
+    std::vector<int> observed;
+    for (const auto &match : result.state_obs_match_ids)
+    {
+        AddReflectorInformation(observation.cloud_[match.first].cast<double>(), match.second, mu_m_[match.second]);
+        observed.push_back(match.second);
+    }
+    // Global map reflectors are fixed, only robot pose is touched
+    for (const auto &match : result.map_obs_match_ids)
+    {
+        AddReflectorInformation(observation.cloud_[match.first].cast<double>(), -1,
+                                map_.reflector_map_[match.second].cast<double>());
+    }
+    if (!result.new_ids.empty())
+    {
+        LOG(INFO) << "Add " << result.new_ids.size() << " reflectors";
+        for (const int &local_id : result.new_ids)
+            observed.push_back(AddLandmark(observation.cloud_[local_id].cast<double>()));
+    }
+    Sparsify(observed);
+    RecoverLocalMeans();
+    UpdateSnapshot(true);
+    LOG(INFO) << "Update now pose is: " << mu_x_(0) << "," << mu_x_(1) << "," << NormalizeAngle(mu_x_(2));
+}
+
+double ReflectorSEIFSLAM::LandmarkMatchRadius(const int &id) const
+{
+    const Eigen::Matrix2d coviarance = landmark_coviarances_[id] + robot_coviarance_.topLeftCorner<2, 2>() + Qt_;
+    return ekf::LandmarkMatchRadius(coviarance);
+}
+
+void ReflectorSEIFSLAM::UpdateSnapshot(const bool &landmarks_changed)
+{
+    PoseState robot;
+    robot.time = time_;
+    robot.pose = mu_x_;
+    robot.pose(2) = NormalizeAngle(robot.pose(2));
+    robot.coviarance = robot_coviarance_;
+    std::shared_ptr<LandmarkSnapshot> landmarks;
+    if (landmarks_changed)
+    {
+        // Chunks of landmarks which were not recovered or added are shared
+        const auto previous = GetSnapshot();
+        const auto landmark = [this](const int &id, Eigen::Vector2d *position, Eigen::Matrix2d *coviarance) {
+            *position = mu_m_[id];
+            *coviarance = landmark_coviarances_[id];
+        };
+        landmarks = LandmarkSnapshot::Build(previous ? previous->landmarks.get() : nullptr, LandmarkNumber(),
+                                            changed_landmarks_, landmark);
+        changed_landmarks_.clear();
+    }
+    PublishSnapshot(robot, landmarks);
+}
+
+ReflectorMatchResult ReflectorSEIFSLAM::ReflectorMatch(const sensor::Observation &obs)
+{
+    ReflectorMatchResult ids;
+    if (obs.cloud_.empty())
+    {
+        LOG(ERROR) << "Should never reach here";
+        exit(-1);
+    }
+    const int M = LandmarkNumber();
+    const int M_ = map_.reflector_map_.size();
+    if (M == 0 && M_ == 0)
+    {
+        for (int i = 0; i < obs.cloud_.size(); ++i)
+            ids.new_ids.push_back(i);
+        LOG(ERROR) << "Reflector map is empty";
+        return ids;
+    }
+
+    auto point_transformed_to_global_frame = [&](const Eigen::Vector2f &p) -> Eigen::Vector2f {
+        const float x = p.x() * std::cos(mu_x_(2)) - p.y() * std::sin(mu_x_(2)) + mu_x_(0);
+        const float y = p.x() * std::sin(mu_x_(2)) + p.y() * std::cos(mu_x_(2)) + mu_x_(1);
+        return Eigen::Vector2f(x, y);
+    };
+
+    std::vector<int> candidates;
+    for (int i = 0; i < obs.cloud_.size(); ++i)
+    {
+        const auto reflector = point_transformed_to_global_frame(obs.cloud_[i]);
+        // Match with global map
+        if (M_ > 0)
+        {
+            // Only map reflectors whose gate can contain the observation are checked
+            const int best_match = map_index_.Match(map_, reflector, nullptr);
+            if (best_match >= 0)
+            {
+                ids.map_obs_match_ids.push_back({i, best_match});
+                continue;
+            }
+        }
+        // Means near the robot were recovered by the last scan
+        if (M > 0)
+        {
+            candidates.clear();
+            landmark_index_.Query(reflector.cast<double>(), kStateMatchDistance, &candidates);
+            int best_match = -1;
+            double best_distance = std::numeric_limits<double>::max();
+            for (const int &j : candidates)
+            {
+                const double dist = (reflector.cast<double>() - mu_m_[j]).norm();
+                if (dist < best_distance)
+                {
+                    best_distance = dist;
+                    best_match = j;
+                }
+            }
+            if (best_match >= 0 && best_distance < LandmarkMatchRadius(best_match))
+            {
+                ids.state_obs_match_ids.push_back({i, best_match});
+                continue;
+            }
+        }
+        ids.new_ids.push_back(i);
+    }
+    return ids;
+}
+
+} // namespace ekf
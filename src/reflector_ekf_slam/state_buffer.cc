@@ -0,0 +1,276 @@
+#include "reflector_ekf_slam/state_buffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <glog/logging.h>
+
+namespace ekf
+{
+namespace
+{
+// Smallest eigenvalue of the landmark block relative to its largest variance
+// that float storage keeps, about 100 float epsilons. Rounding every entry of
+// the landmark block to float perturbs it by up to epsilon times the largest
+// variance, which can make a block below this limit indefinite.
+constexpr double kFloatConditionLimit = 1e-5;
+} // namespace
+
+StateBuffer::StateBuffer()
+    : time_(0.), dimension_(3), mixed_precision_(false), mu_(Eigen::VectorXd::Zero(3)), sigma_(Eigen::MatrixXd::Zero(3, 3))
+{
+}
+
+void StateBuffer::Reset(const double &time, const Eigen::Vector3d &pose, const Eigen::Matrix3d &pose_coviarance)
+{
+    time_ = time;
+    dimension_ = 3;
+    mu() = pose;
+    sigma_.topLeftCorner<3, 3>() = pose_coviarance;
+}
+
+void StateBuffer::Assign(const State &state)
+{
+    const int N = state.mu.rows();
+    CHECK(N >= 3 && (N - 3) % 2 == 0 && state.sigma.rows() == N && state.sigma.cols() == N);
+    Reset(state.time, state.mu.head<3>(), state.sigma.topLeftCorner<3, 3>());
+    Reserve(N);
+    Augment(N - 3);
+    mu() = state.mu;
+    if (N > 3)
+        SetRows(3, state.sigma.bottomRows(N - 3));
+}
+
+void StateBuffer::Reserve(const int &dimension)
+{
+    if (dimension > Capacity())
+        Reallocate(dimension);
+}
+
+void StateBuffer::Augment(const int &extra)
+{
+    CHECK(extra >= 0);
+    const int N = dimension_;
+    if (N + extra > Capacity())
+    {
+        // Grow geometrically so that the copy of old covariance is amortized
+        const int capacity = std::max(N + extra, 2 * Capacity());
+        LOG(INFO) << "State capacity grows from " << Capacity() << " to " << capacity
+                  << ", used " << N + extra;
+        Reallocate(capacity);
+    }
+    dimension_ = N + extra;
+    mu_.segment(N, extra).setZero();
+    if (!mixed_precision_)
+    {
+        sigma_.block(N, 0, extra, dimension_).setZero();
+        sigma_.block(0, N, N, extra).setZero();
+        return;
+    }
+    sigma_.middleCols(N, extra).setZero();
+    landmark_sigma_.block(N - 3, 0, extra, dimension_ - 3).setZero();
+    landmark_sigma_.block(0, N - 3, N - 3, extra).setZero();
+}
+
+void StateBuffer::RemoveLandmarks(const std::vector<int> &landmark_ids)
+{
+    if (landmark_ids.empty())
+        return;
+    const int N = dimension_;
+    std::vector<bool> removed((N - 3) / 2, false);
+    for (const int &id : landmark_ids)
+    {
+        CHECK(id >= 0 && id < removed.size());
+        removed[id] = true;
+    }
+    std::vector<int> kept = {0, 1, 2};
+    for (int id = 0; id < removed.size(); ++id)
+    {
+        if (removed[id])
+            continue;
+        kept.push_back(3 + 2 * id);
+        kept.push_back(3 + 2 * id + 1);
+    }
+    // Kept rows only move forward, so compacting in increasing order is in place
+    const int K = kept.size();
+    if (mixed_precision_)
+    {
+        for (int k = 3; k < K; ++k)
+        {
+            if (kept[k] == k)
+                continue;
+            mu_(k) = mu_(kept[k]);
+            sigma_.col(k) = sigma_.col(kept[k]);
+            landmark_sigma_.col(k - 3).head(N - 3) = landmark_sigma_.col(kept[k] - 3).head(N - 3);
+        }
+        for (int k = 3; k < K; ++k)
+        {
+            if (kept[k] != k)
+                landmark_sigma_.row(k - 3).head(K - 3) = landmark_sigma_.row(kept[k] - 3).head(K - 3);
+        }
+        dimension_ = K;
+        return;
+    }
+    for (int k = 0; k < K; ++k)
+    {
+        if (kept[k] == k)
+            continue;
+        mu_(k) = mu_(kept[k]);
+        sigma_.col(k).head(N) = sigma_.col(kept[k]).head(N);
+    }
+    for (int k = 0; k < K; ++k)
+    {
+        if (kept[k] != k)
+            sigma_.row(k).head(K) = sigma_.row(kept[k]).head(K);
+    }
+    dimension_ = K;
+}
+
+void StateBuffer::SetRows(const int &row, const Eigen::MatrixXd &rows)
+{
+    const int R = rows.rows();
+    CHECK(row >= 3 && row + R <= dimension_ && rows.cols() == dimension_);
+    // Columns first, so the rows are kept as given where both overlap
+    if (!mixed_precision_)
+    {
+        sigma().middleCols(row, R) = rows.transpose();
+        sigma().middleRows(row, R) = rows;
+        return;
+    }
+    const int M = dimension_ - 3;
+    sigma_.middleCols(row, R) = rows.leftCols<3>().transpose();
+    landmark_sigma().middleCols(row - 3, R) = rows.rightCols(M).transpose().cast<float>();
+    landmark_sigma().middleRows(row - 3, R) = rows.rightCols(M).cast<float>();
+}
+
+void StateBuffer::MirrorRobotRows()
+{
+    if (mixed_precision_ || dimension_ == 3)
+        return;
+    sigma_.block(3, 0, dimension_ - 3, 3) = sigma_.block(0, 3, 3, dimension_ - 3).transpose();
+}
+
+void StateBuffer::Symmetrize()
+{
+    if (!mixed_precision_)
+    {
+        const Eigen::MatrixXd symmetric = 0.5 * (sigma() + sigma().transpose());
+        sigma() = symmetric;
+        return;
+    }
+    const Eigen::Matrix3d robot = RobotCoviarance();
+    sigma_.topLeftCorner<3, 3>() = 0.5 * (robot + robot.transpose());
+    const Eigen::MatrixXf symmetric = 0.5f * (landmark_sigma() + landmark_sigma().transpose());
+    landmark_sigma() = symmetric;
+}
+
+void StateBuffer::SetMixedPrecision(const bool &mixed_precision)
+{
+    if (mixed_precision == mixed_precision_)
+        return;
+    const int C = Capacity();
+    if (mixed_precision)
+    {
+        landmark_sigma_ = sigma_.bottomRightCorner(C - 3, C - 3).cast<float>();
+        Eigen::MatrixXd robot_rows = sigma_.topRows(3);
+        sigma_.swap(robot_rows);
+    }
+    else
+    {
+        Eigen::MatrixXd sigma(C, C);
+        sigma.topRows(3) = sigma_;
+        sigma.bottomLeftCorner(C - 3, 3) = sigma_.rightCols(C - 3).transpose();
+        sigma.bottomRightCorner(C - 3, C - 3) = landmark_sigma_.cast<double>();
+        sigma_.swap(sigma);
+        landmark_sigma_.resize(0, 0);
+    }
+    mixed_precision_ = mixed_precision;
+}
+
+bool StateBuffer::CheckMixedPrecision()
+{
+    if (!mixed_precision_ || dimension_ == 3)
+        return true;
+    // Correlations between landmarks can make the whole block indefinite while
+    // every 2x2 block is fine. The float block shifted by the limit has a
+    // cholesky factor exactly if its smallest eigenvalue is above the limit.
+    const int M = dimension_ - 3;
+    Eigen::MatrixXd shifted = landmark_sigma().cast<double>();
+    const double max_variance = shifted.diagonal().maxCoeff();
+    shifted.diagonal().array() -= kFloatConditionLimit * max_variance;
+    const Eigen::LLT<Eigen::MatrixXd> llt(shifted);
+    // Also catches nan
+    if (!(max_variance > 0.) || llt.info() != Eigen::Success || !llt.matrixLLT().allFinite())
+    {
+        LOG(WARNING) << "Landmark coviarance of " << M / 2 << " reflectors is badly conditioned for float,"
+                     << " largest variance " << max_variance << ", switch back to double";
+        SetMixedPrecision(false);
+        return false;
+    }
+    return true;
+}
+
+Eigen::Matrix2d StateBuffer::LandmarkCoviarance(const int &id) const
+{
+    const int row = 3 + 2 * id;
+    if (!mixed_precision_)
+        return sigma_.block<2, 2>(row, row);
+    return landmark_sigma_.block<2, 2>(row - 3, row - 3).cast<double>();
+}
+
+State StateBuffer::ToState() const
+{
+    State state;
+    state.time = time_;
+    state.mu = mu();
+    if (!mixed_precision_)
+    {
+        state.sigma = sigma();
+        return state;
+    }
+    const int N = dimension_;
+    state.sigma.resize(N, N);
+    state.sigma.topRows(3) = robot_rows();
+    state.sigma.bottomLeftCorner(N - 3, 3) = robot_rows().rightCols(N - 3).transpose();
+    state.sigma.bottomRightCorner(N - 3, N - 3) = landmark_sigma_.topLeftCorner(N - 3, N - 3).cast<double>();
+    return state;
+}
+
+StateBuffer StateBuffer::Compacted() const
+{
+    StateBuffer buffer;
+    buffer.time_ = time_;
+    buffer.dimension_ = dimension_;
+    buffer.mixed_precision_ = mixed_precision_;
+    buffer.mu_ = mu();
+    if (!mixed_precision_)
+    {
+        buffer.sigma_ = sigma();
+        return buffer;
+    }
+    buffer.sigma_ = robot_rows();
+    buffer.landmark_sigma_ = landmark_sigma_.topLeftCorner(dimension_ - 3, dimension_ - 3);
+    return buffer;
+}
+
+void StateBuffer::Reallocate(const int &capacity)
+{
+    Eigen::VectorXd mu = Eigen::VectorXd::Zero(capacity);
+    mu.head(dimension_) = mu_.head(dimension_);
+    mu_.swap(mu);
+    if (mixed_precision_)
+    {
+        Eigen::MatrixXd robot_rows = Eigen::MatrixXd::Zero(3, capacity);
+        Eigen::MatrixXf landmark_sigma = Eigen::MatrixXf::Zero(capacity - 3, capacity - 3);
+        robot_rows.leftCols(dimension_) = sigma_.leftCols(dimension_);
+        landmark_sigma.topLeftCorner(dimension_ - 3, dimension_ - 3) =
+            landmark_sigma_.topLeftCorner(dimension_ - 3, dimension_ - 3);
+        sigma_.swap(robot_rows);
+        landmark_sigma_.swap(landmark_sigma);
+        return;
+    }
+    Eigen::MatrixXd sigma = Eigen::MatrixXd::Zero(capacity, capacity);
+    sigma.topLeftCorner(dimension_, dimension_) = sigma_.topLeftCorner(dimension_, dimension_);
+    sigma_.swap(sigma);
+}
+
+} // namespace ekf
@@ -1,8 +1,16 @@
 #include "ros_node.h"
+#include "sensor/map_io.h"
 #include "sensor/sensor_data.h"
 #include <geometry_msgs/Point32.h>
 
-Node::Node()
+namespace
+{
+// Weight and scans a hypothesis needs before the filter starts from it
+constexpr double kHypothesisDominance = 0.99;
+constexpr int kHypothesisMinScans = 3;
+} // namespace
+
+Node::Node() : checkpoint_writing_(false), scans_since_map_builder_(0), tracking_map_version_(-1)
 {
     LoadNodeOptions();
     if (!options_.use_laser && !options_.use_point_cloud)
@@ -25,6 +33,9 @@ Node::Node()
 
     /***** 初始化消息订阅 *****/
     odometry_subscriber_ = node_handle_.subscribe(options_.odom_topic_name, 1, &Node::OdometryCallback, this);
+    // Every sample is integrated, keep those arriving between spins
+    if (options_.use_imu)
+        imu_subscriber_ = node_handle_.subscribe(options_.imu_topic_name, 100, &Node::ImuCallback, this);
     if (options_.use_laser)
         laser_subscriber_ = node_handle_.subscribe(options_.scan_topic_name, 1, &Node::ScanCallback, this);
     if (options_.use_point_cloud)
@@ -39,6 +50,8 @@ Node::Node()
         laser_reflector_options.reflector_length_error = options_.reflector_length_error;
         laser_reflector_options.range_min = options_.range_min;
         laser_reflector_options.range_max = options_.range_max;
+        laser_reflector_options.use_tracking = options_.use_reflector_tracking;
+        laser_reflector_options.tracking_full_scan_interval = options_.reflector_tracking_full_scan_interval;
         laser_reflector_detector_ =
             common::make_unique<reflector_detect::LaserReflectorDetect>(laser_reflector_options);
         laser_reflector_detector_->SetSensorToBaseLinkTransform(options_.sensor_to_base_link);
@@ -53,9 +66,43 @@ Node::Node()
         point_cloud_reflector_detector_->SetSensorToBaseLinkTransform(options_.sensor_to_base_link);
     }
 
+    if (!options_.checkpoint_path.empty())
+    {
+        start_checkpoint_ = common::make_unique<ekf::Checkpoint>();
+        if (!ekf::LoadCheckpoint(options_.checkpoint_path, start_checkpoint_.get()))
+            start_checkpoint_.reset();
+    }
+
+    if (options_.use_global_localization || options_.use_multi_hypothesis)
+    {
+        const Eigen::Matrix2d noise = Eigen::Matrix2d::Identity() * options_.observation_cov;
+        if (sensor::LoadMap(options_.map_path, ekf::kMapMatchGate, noise, &localization_map_, &localization_map_index_))
+        {
+            if (options_.use_global_localization)
+            {
+                // 3 sigma of the difference of two observed positions
+                const double side_tolerance = 3. * std::sqrt(2. * options_.observation_cov);
+                constellation_index_ = common::make_unique<sensor::ReflectorConstellationIndex>(
+                    4. * side_tolerance, options_.global_localization_max_side_length, side_tolerance);
+                constellation_index_->Build(localization_map_);
+            }
+            if (options_.use_multi_hypothesis)
+                hypothesis_bank_ = common::make_unique<ekf::PoseHypothesisBank>(
+                    CreateEKFOptions(0.), localization_map_, localization_map_index_, options_.hypothesis_threads);
+        }
+        else
+        {
+            LOG(WARNING) << "No prior map for global localization, start from start pose";
+        }
+    }
+
     wall_timer_ = node_handle_.createWallTimer(
         ros::WallDuration(options_.map_publish_period_sec),
         &Node::PublishMap, this);
+    if (!options_.checkpoint_path.empty() && options_.checkpoint_period_sec > 0.)
+        checkpoint_timer_ = node_handle_.createWallTimer(
+            ros::WallDuration(options_.checkpoint_period_sec),
+            &Node::SaveCheckpoint, this);
 
     save_map_service_ =
         node_handle_.advertiseService(
@@ -70,6 +117,8 @@ Node::Node()
 
 Node::~Node()
 {
+    if (checkpoint_thread_.joinable())
+        checkpoint_thread_.join();
 }
 
 void Node::SaveReflectorResult(const std::string &filebase)
@@ -77,65 +126,33 @@ void Node::SaveReflectorResult(const std::string &filebase)
     if (!slam_)
         return;
 
-    std::string map_path = filebase + ".txt";
-    const ekf::State state = slam_->GetState();
-    const sensor::Map map = slam_->GetGlobalMap();
-    LOG(INFO) << "Start to save reflector map in " << map_path;
-    // write data
-    std::ofstream out(map_path.c_str(), std::ios::out);
-    if (!map.reflector_map_.empty())
-    {
-        LOG(INFO) << "Write global map";
-        for (int i = 0; i < map.reflector_map_.size(); ++i)
-        {
-            if (i != map.reflector_map_.size() - 1)
-                out << map.reflector_map_[i].x() << "," << map.reflector_map_[i].y() << ",";
-            else
-                out << map.reflector_map_[i].x() << "," << map.reflector_map_[i].y();
-        }
-    }
-    if (state.mu.rows() > 3)
+    // Snapshot landmarks carry their marginal covariances, so no backend has to
+    // build its dense covariance here
+    const std::shared_ptr<const ekf::LandmarkSnapshot> landmarks = slam_->GetSnapshot()->landmarks;
+    sensor::Map map = slam_->GetGlobalMap();
+    LOG(INFO) << "Write " << map.reflector_map_.size() << " reflectors of global map and "
+              << landmarks->size() << " new reflectors";
+    for (int i = 0; i < landmarks->size(); ++i)
     {
-        LOG(INFO) << "Write new map";
-        out << ",";
-        const int N = (state.mu.rows() - 3) / 2;
-        for (int i = 0; i < N; ++i)
-        {
-            if (i != N - 1)
-                out << state.mu(3 + 2 * i) << "," << state.mu(3 + 2 * i + 1) << ",";
-            else
-                out << state.mu(3 + 2 * i) << "," << state.mu(3 + 2 * i + 1);
-        }
+        map.reflector_map_.push_back(landmarks->position(i).cast<float>());
+        map.reflector_map_coviarance_.push_back(landmarks->coviarance(i));
     }
-    out << std::endl;
-    if (!map.reflector_map_.empty())
+
+    if (options_.map_format == "binary")
     {
-        for (int i = 0; i < map.reflector_map_.size(); ++i)
-        {
-            if (i != map.reflector_map_.size() - 1)
-                out << map.reflector_map_coviarance_[i](0, 0) << "," << map.reflector_map_coviarance_[i](0, 1) << ","
-                    << map.reflector_map_coviarance_[i](1, 0) << "," << map.reflector_map_coviarance_[i](1, 1) << ",";
-            else
-                out << map.reflector_map_coviarance_[i](0, 0) << "," << map.reflector_map_coviarance_[i](0, 1) << ","
-                    << map.reflector_map_coviarance_[i](1, 0) << "," << map.reflector_map_coviarance_[i](1, 1);
-        }
+        const std::string map_path = filebase + ".bin";
+        LOG(INFO) << "Start to save reflector map in " << map_path;
+        // Index is built for the gate of the filters, so loading skips it
+        sensor::ReflectorMapIndex index;
+        index.Build(map, ekf::kMapMatchGate, Eigen::Matrix2d::Identity() * options_.observation_cov);
+        sensor::SaveMapToBinaryFile(map_path, map, &index);
     }
-    if (state.mu.rows() > 3)
+    else
     {
-        out << ",";
-        const int N = (state.mu.rows() - 3) / 2;
-        for (int i = 0; i < N; ++i)
-        {
-            if (i != N - 1)
-                out << state.sigma.block(3 + 2 * i, 3 + 2 * i, 2, 2)(0, 0) << "," << state.sigma.block(3 + 2 * i, 3 + 2 * i, 2, 2)(0, 1) << ","
-                    << state.sigma.block(3 + 2 * i, 3 + 2 * i, 2, 2)(1, 0) << "," << state.sigma.block(3 + 2 * i, 3 + 2 * i, 2, 2)(1, 1) << ",";
-            else
-                out << state.sigma.block(3 + 2 * i, 3 + 2 * i, 2, 2)(0, 0) << "," << state.sigma.block(3 + 2 * i, 3 + 2 * i, 2, 2)(0, 1) << ","
-                    << state.sigma.block(3 + 2 * i, 3 + 2 * i, 2, 2)(1, 0) << "," << state.sigma.block(3 + 2 * i, 3 + 2 * i, 2, 2)(1, 1);
-        }
+        const std::string map_path = filebase + ".txt";
+        LOG(INFO) << "Start to save reflector map in " << map_path;
+        sensor::SaveMapToTxtFile(map_path, map);
     }
-    out << std::endl;
-    out.close();
     LOG(INFO) << "Finish to save relfector map";
 }
 
@@ -145,9 +162,11 @@ void Node::LoadNodeOptions()
     node_handle_.getParam("scan", options_.scan_topic_name);
     node_handle_.getParam("odom", options_.odom_topic_name);
     node_handle_.getParam("points", options_.points_topic_name);
+    node_handle_.getParam("imu", options_.imu_topic_name);
     LOG(INFO) << "Odometry topic is: " << options_.odom_topic_name;
     LOG(INFO) << "Scan topic is: " << options_.scan_topic_name;
     LOG(INFO) << "Point cloud topic is: " << options_.points_topic_name;
+    LOG(INFO) << "IMU topic is: " << options_.imu_topic_name;
 
     // Read initial pose from launch file, we need initial pose for relocalization
     std::string pose_str;
@@ -169,6 +188,53 @@ void Node::LoadNodeOptions()
 
     LOG(INFO) << "Start pose: " << options_.initial_pose;
 
+    if (!node_handle_.getParam("use_global_localization", options_.use_global_localization))
+    {
+        options_.use_global_localization = false;
+    }
+    if (!node_handle_.getParam("global_localization_max_side_length", options_.global_localization_max_side_length))
+    {
+        options_.global_localization_max_side_length = 10.;
+    }
+    if (!node_handle_.getParam("global_localization_min_inliers", options_.global_localization_min_inliers))
+    {
+        options_.global_localization_min_inliers = 4;
+    }
+    LOG(INFO) << "Use global localization: " << options_.use_global_localization
+              << ", max side length: " << options_.global_localization_max_side_length
+              << ", min inliers: " << options_.global_localization_min_inliers;
+
+    if (!node_handle_.getParam("use_multi_hypothesis", options_.use_multi_hypothesis))
+    {
+        options_.use_multi_hypothesis = false;
+    }
+    if (!node_handle_.getParam("hypothesis_threads", options_.hypothesis_threads))
+    {
+        options_.hypothesis_threads = 0;
+    }
+    if (!node_handle_.getParam("hypothesis_position_range", options_.hypothesis_position_range))
+    {
+        options_.hypothesis_position_range = 1.;
+    }
+    if (!node_handle_.getParam("hypothesis_position_step", options_.hypothesis_position_step))
+    {
+        options_.hypothesis_position_step = 0.25;
+    }
+    if (!node_handle_.getParam("hypothesis_angle_range", options_.hypothesis_angle_range))
+    {
+        options_.hypothesis_angle_range = 0.3;
+    }
+    if (!node_handle_.getParam("hypothesis_angle_step", options_.hypothesis_angle_step))
+    {
+        options_.hypothesis_angle_step = 0.05;
+    }
+    LOG(INFO) << "Use multi hypothesis: " << options_.use_multi_hypothesis
+              << ", threads: " << options_.hypothesis_threads
+              << ", position range: " << options_.hypothesis_position_range
+              << ", step: " << options_.hypothesis_position_step
+              << ", angle range: " << options_.hypothesis_angle_range
+              << ", step: " << options_.hypothesis_angle_step;
+
     if (!node_handle_.getParam("map_path", options_.map_path))
     {
         LOG(ERROR) << "Can not get path, you must set path for mapping and localization!!";
@@ -179,12 +245,26 @@ void Node::LoadNodeOptions()
     node_handle_.getParam("result_path", options_.result_path);
     LOG(INFO) << "Result path: " << options_.result_path;
 
+    if (!node_handle_.getParam("map_format", options_.map_format))
+    {
+        options_.map_format = "txt";
+    }
+    LOG(INFO) << "Map format: " << options_.map_format;
+
+    node_handle_.getParam("checkpoint_path", options_.checkpoint_path);
+    LOG(INFO) << "Checkpoint path: " << options_.checkpoint_path;
+
+    if (!node_handle_.getParam("checkpoint_period_sec", options_.checkpoint_period_sec))
+    {
+        options_.checkpoint_period_sec = 10.0;
+    }
+    LOG(INFO) << "Checkpoint period seconds: " << options_.checkpoint_period_sec;
+
     if (!node_handle_.getParam("use_imu", options_.use_imu))
     {
         options_.use_imu = false;
     }
-    options_.use_imu = false;
-    LOG(INFO) << "IMU will be supported in the future ...";
+    LOG(INFO) << "Use IMU: " << options_.use_imu;
 
     if (!node_handle_.getParam("use_laser", options_.use_laser))
     {
@@ -237,6 +317,17 @@ void Node::LoadNodeOptions()
     }
     LOG(INFO) << "Observation covariance is : " << std::sqrt(options_.observation_cov);
 
+    double imu_angular_coviance;
+    if (node_handle_.getParam("imu_angular_velocity_cov", imu_angular_coviance))
+    {
+        options_.imu_angular_velocity_cov = imu_angular_coviance * imu_angular_coviance;
+    }
+    else
+    {
+        options_.imu_angular_velocity_cov = 0.01 * 0.01;
+    }
+    LOG(INFO) << "IMU angular velocity covariance is : " << std::sqrt(options_.imu_angular_velocity_cov);
+
     if (!node_handle_.getParam("intensity_min", options_.intensity_min))
     {
         options_.intensity_min = 160.;
@@ -265,6 +356,24 @@ void Node::LoadNodeOptions()
     }
     LOG(INFO) << "Laser Reflector detect used range: [ " << options_.range_min << "," << options_.range_max << "]";
 
+    if (!node_handle_.getParam("use_reflector_tracking", options_.use_reflector_tracking))
+    {
+        options_.use_reflector_tracking = false;
+    }
+    LOG(INFO) << "Use reflector tracking: " << options_.use_reflector_tracking;
+
+    if (!node_handle_.getParam("reflector_tracking_full_scan_interval", options_.reflector_tracking_full_scan_interval))
+    {
+        options_.reflector_tracking_full_scan_interval = 20;
+    }
+    LOG(INFO) << "Reflector tracking full scan interval: " << options_.reflector_tracking_full_scan_interval;
+
+    if (!node_handle_.getParam("reflector_tracking_margin", options_.reflector_tracking_margin))
+    {
+        options_.reflector_tracking_margin = 0.2;
+    }
+    LOG(INFO) << "Reflector tracking margin: " << options_.reflector_tracking_margin;
+
     std::string extra_pose_str;
     if (node_handle_.getParam("sensor_to_base_link", extra_pose_str) && !extra_pose_str.empty())
     {
@@ -295,6 +404,108 @@ void Node::LoadNodeOptions()
         LOG(INFO) << "Use DIFF odometry model";
     }
 
+    std::string innovation_solver;
+    node_handle_.getParam("innovation_solver", innovation_solver);
+    if (innovation_solver == "inverse")
+    {
+        options_.innovation_solver = ekf::InnovationSolver::INVERSE;
+    }
+    else if (innovation_solver == "ldlt")
+    {
+        options_.innovation_solver = ekf::InnovationSolver::LDLT;
+    }
+    else
+    {
+        innovation_solver = "llt";
+        options_.innovation_solver = ekf::InnovationSolver::LLT;
+    }
+    LOG(INFO) << "Innovation solver: " << innovation_solver;
+
+    if (!node_handle_.getParam("use_joseph_form", options_.use_joseph_form))
+    {
+        options_.use_joseph_form = false;
+    }
+    LOG(INFO) << "Use joseph form covariance update: " << options_.use_joseph_form;
+
+    if (!node_handle_.getParam("use_sequential_update", options_.use_sequential_update))
+    {
+        options_.use_sequential_update = false;
+    }
+    LOG(INFO) << "Use sequential update: " << options_.use_sequential_update;
+
+    if (!node_handle_.getParam("use_float_landmark_coviarance", options_.use_float_landmark_coviarance))
+    {
+        options_.use_float_landmark_coviarance = false;
+    }
+    LOG(INFO) << "Use float landmark coviarance: " << options_.use_float_landmark_coviarance;
+
+    if (!node_handle_.getParam("symmetrize_interval", options_.symmetrize_interval))
+    {
+        options_.symmetrize_interval = 100;
+    }
+    LOG(INFO) << "Symmetrize covariance every " << options_.symmetrize_interval << " updates";
+
+    if (!node_handle_.getParam("reserved_landmarks", options_.reserved_landmarks))
+    {
+        options_.reserved_landmarks = 64;
+    }
+    LOG(INFO) << "Reserved landmarks in state: " << options_.reserved_landmarks;
+
+    if (!node_handle_.getParam("ekf_type", options_.ekf_type))
+    {
+        options_.ekf_type = "full";
+    }
+    LOG(INFO) << "EKF type: " << options_.ekf_type;
+    if (options_.use_imu && options_.ekf_type != "full" && options_.ekf_type != "compressed")
+    {
+        LOG(WARNING) << "EKF type " << options_.ekf_type << " does not support IMU, use odometry only";
+        options_.use_imu = false;
+    }
+
+    if (!node_handle_.getParam("local_region_radius", options_.local_region_radius))
+    {
+        options_.local_region_radius = 15.;
+    }
+    if (!node_handle_.getParam("local_region_switch_distance", options_.local_region_switch_distance))
+    {
+        options_.local_region_switch_distance = 5.;
+    }
+    LOG(INFO) << "Compressed EKF local region radius: " << options_.local_region_radius
+              << ", switch distance: " << options_.local_region_switch_distance;
+
+    if (!node_handle_.getParam("max_landmarks", options_.max_landmarks))
+    {
+        options_.max_landmarks = 0;
+    }
+    if (!node_handle_.getParam("marginalize_distance", options_.marginalize_distance))
+    {
+        options_.marginalize_distance = 20.;
+    }
+    if (!node_handle_.getParam("marginalize_coviarance", options_.marginalize_coviarance))
+    {
+        options_.marginalize_coviarance = 0.001;
+    }
+    LOG(INFO) << "Max landmarks in state: " << options_.max_landmarks
+              << ", marginalize distance: " << options_.marginalize_distance
+              << ", marginalize coviarance: " << options_.marginalize_coviarance;
+
+    if (!node_handle_.getParam("smoother_window_size", options_.smoother_window_size))
+    {
+        options_.smoother_window_size = 10;
+    }
+    if (!node_handle_.getParam("smoother_iterations", options_.smoother_iterations))
+    {
+        options_.smoother_iterations = 2;
+    }
+    LOG(INFO) << "Smoother window size: " << options_.smoother_window_size
+              << ", iterations: " << options_.smoother_iterations;
+
+    if (!node_handle_.getParam("seif_active_landmarks", options_.seif_active_landmarks))
+    {
+        options_.seif_active_landmarks = 12;
+    }
+    LOG(INFO) << "SEIF active landmarks: " << options_.seif_active_landmarks;
+
     // Load map builder options
     if (!node_handle_.getParam("resolution", options_.map_builder_options.resolution))
     {
@@ -302,6 +513,18 @@ void Node::LoadNodeOptions()
     }
     LOG(INFO) << "Map resolution: " << options_.map_builder_options.resolution;
 
+    if (!node_handle_.getParam("map_builder_scan_interval", options_.map_builder_scan_interval))
+    {
+        options_.map_builder_scan_interval = 0;
+    }
+    if (options_.map_builder_scan_interval <= 0)
+    {
+        // Tracking only pays off if the whole scan is not projected for the map every scan
+        options_.map_builder_scan_interval =
+            options_.use_reflector_tracking ? options_.reflector_tracking_full_scan_interval : 1;
+    }
+    LOG(INFO) << "Map builder scan interval: " << options_.map_builder_scan_interval;
+
     if (!node_handle_.getParam("voxel_filter_size", options_.map_builder_options.voxel_filter_size))
     {
         options_.map_builder_options.voxel_filter_size = 0.025;
@@ -400,6 +623,220 @@ void Node::LoadNodeOptions()
               << ",\n  hit_probability = " << grid_data_inserter_options.hit_probability << ",\n miss_probability = " << grid_data_inserter_options.miss_probability << "\n}";
 }
 
+ekf::EKFOptions Node::CreateEKFOptions(const double &time)
+{
+    ekf::EKFOptions options;
+    options.use_imu = options_.use_imu;
+    options.init_time = time;
+    options.init_pose = options_.initial_pose;
+    options.map_path = options_.map_path;
+    options.odom_model = options_.odom_model;
+    options.linear_velocity_cov = options_.linear_velocity_cov;
+    options.angular_velocity_cov = options_.angular_velocity_cov;
+    options.observation_cov = options_.observation_cov;
+    options.imu_angular_velocity_cov = options_.imu_angular_velocity_cov;
+    options.innovation_solver = options_.innovation_solver;
+    options.use_joseph_form = options_.use_joseph_form;
+    options.use_sequential_update = options_.use_sequential_update;
+    options.use_float_landmark_coviarance = options_.use_float_landmark_coviarance;
+    options.symmetrize_interval = options_.symmetrize_interval;
+    options.reserved_landmarks = options_.reserved_landmarks;
+    options.local_region_radius = options_.local_region_radius;
+    options.local_region_switch_distance = options_.local_region_switch_distance;
+    options.max_landmarks = options_.max_landmarks;
+    options.marginalize_distance = options_.marginalize_distance;
+    options.marginalize_coviarance = options_.marginalize_coviarance;
+    options.smoother_window_size = options_.smoother_window_size;
+    options.smoother_iterations = options_.smoother_iterations;
+    options.seif_active_landmarks = options_.seif_active_landmarks;
+    return options;
+}
+
+std::unique_ptr<ekf::ReflectorEKFSLAMInterface> Node::ResumeSLAM(const double &time)
+{
+    if (!start_checkpoint_)
+        return nullptr;
+    // Only tried with the first scan, afterwards the filter has its own state
+    const std::unique_ptr<ekf::Checkpoint> checkpoint = std::move(start_checkpoint_);
+    ekf::EKFOptions options = CreateEKFOptions(time);
+    // The state was estimated with the odometry settings of the checkpoint
+    options.odom_model = checkpoint->odom_model;
+    options.linear_velocity_cov = checkpoint->linear_velocity_cov;
+    options.angular_velocity_cov = checkpoint->angular_velocity_cov;
+    options.observation_cov = checkpoint->observation_cov;
+    auto slam = CreateFilter(options);
+    // Robot is assumed to stand still while the node is down
+    checkpoint->state.time = time;
+    if (!slam->RestoreState(checkpoint->state, checkpoint->map))
+    {
+        LOG(WARNING) << "EKF type " << options_.ekf_type << " can not resume from checkpoint, start from start pose";
+        return nullptr;
+    }
+    LOG(INFO) << "Resume from checkpoint " << options_.checkpoint_path << " with "
+              << (checkpoint->state.mu.rows() - 3) / 2 << " reflectors in state and "
+              << checkpoint->map.reflector_map_.size() << " in map";
+    // A checkpoint carries its own pose
+    ReleaseStartPoseLocalization();
+    slam_options_ = options;
+    return slam;
+}
+
+std::unique_ptr<ekf::ReflectorEKFSLAMInterface> Node::CreateSLAM(const double &time)
+{
+    slam_options_ = CreateEKFOptions(time);
+    return CreateFilter(slam_options_);
+}
+
+bool Node::LocalizeStartPose(const sensor::Observation &observation)
+{
+    const auto start = std::chrono::steady_clock::now();
+    if (hypothesis_bank_ && hypothesis_bank_->Size() == 0)
+    {
+        std::vector<Eigen::Vector3d> seeds;
+        if (constellation_index_)
+        {
+            const auto candidates = constellation_index_->Candidates(
+                localization_map_, localization_map_index_, observation.cloud_, options_.global_localization_min_inliers);
+            if (candidates.empty())
+            {
+                LOG(WARNING) << "Global localization failed with " << observation.cloud_.size()
+                             << " reflectors, retry with next scan";
+                return false;
+            }
+            if (candidates.size() > 1 && candidates[1].inliers >= candidates[0].inliers)
+            {
+                for (const auto &candidate : candidates)
+                    seeds.emplace_back(candidate.pose.translation().x(), candidate.pose.translation().y(),
+                                       candidate.pose.normalized_angle());
+            }
+            else
+            {
+                seeds.emplace_back(candidates[0].pose.translation().x(), candidates[0].pose.translation().y(),
+                                   candidates[0].pose.normalized_angle());
+            }
+        }
+        else
+        {
+            const Eigen::Vector3d &center = options_.initial_pose;
+            const int positions = std::round(options_.hypothesis_position_range / options_.hypothesis_position_step);
+            const int angles = std::round(options_.hypothesis_angle_range / options_.hypothesis_angle_step);
+            for (int x = -positions; x <= positions; ++x)
+                for (int y = -positions; y <= positions; ++y)
+                    for (int a = -angles; a <= angles; ++a)
+                        seeds.push_back(center + Eigen::Vector3d(x * options_.hypothesis_position_step,
+                                                                 y * options_.hypothesis_position_step,
+                                                                 a * options_.hypothesis_angle_step));
+        }
+        if (seeds.size() == 1)
+            return HandOffStartPose(seeds.front(), start);
+        const Eigen::Vector3d stddev(options_.hypothesis_position_step / 2, options_.hypothesis_position_step / 2,
+                                     options_.hypothesis_angle_step / 2);
+        hypothesis_bank_->Reset(observation.time_, seeds, stddev.cwiseProduct(stddev).asDiagonal());
+    }
+    if (hypothesis_bank_)
+    {
+        hypothesis_bank_->HandleObservationMessage(observation);
+        ekf::PoseState state;
+        if (!hypothesis_bank_->GetDominant(kHypothesisDominance, kHypothesisMinScans,
+                                           options_.global_localization_min_inliers, &state))
+            return false;
+        return HandOffStartPose(state.pose, start);
+    }
+
+    transform::Rigid2d pose;
+    int inliers;
+    if (!constellation_index_->Localize(localization_map_, localization_map_index_, observation.cloud_,
+                                        options_.global_localization_min_inliers, &pose, &inliers))
+    {
+        LOG(WARNING) << "Global localization failed with " << observation.cloud_.size()
+                     << " reflectors, retry with next scan";
+        return false;
+    }
+    LOG(INFO) << "Global localization matches " << inliers << " of " << observation.cloud_.size() << " reflectors";
+    return HandOffStartPose(Eigen::Vector3d(pose.translation().x(), pose.translation().y(), pose.normalized_angle()),
+                            start);
+}
+
+bool Node::HandOffStartPose(const Eigen::Vector3d &pose, const std::chrono::steady_clock::time_point &start)
+{
+    const double duration = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    options_.initial_pose = pose;
+    LOG(INFO) << "Global localization found start pose " << pose.transpose() << " in " << duration << " ms";
+    ReleaseStartPoseLocalization();
+    return true;
+}
+
+void Node::ReleaseStartPoseLocalization()
+{
+    // The filter loads its own map, the bank refers to this one
+    hypothesis_bank_.reset();
+    constellation_index_.reset();
+    localization_map_ = sensor::Map();
+    localization_map_index_ = sensor::ReflectorMapIndex();
+}
+
+void Node::SetTrackingTargets(const sensor_msgs::LaserScan &scan)
+{
+    // Middle of the scan, the margins cover the motion during half a scan
+    const double time = scan.header.stamp.toSec() - scan.scan_time / 2;
+    ekf::PoseState state;
+    std::shared_ptr<const ekf::StateSnapshot> snapshot;
+    {
+        std::lock_guard<std::mutex> lock_slam(slam_mutex_);
+        state = slam_->PredictPose(time);
+        snapshot = slam_->GetSnapshot();
+        // Landmarks moved to the map leave the snapshot, take the map again
+        if (snapshot && snapshot->map_version != tracking_map_version_)
+        {
+            tracking_map_ = slam_->GetGlobalMap();
+            tracking_map_version_ = snapshot->map_version;
+        }
+    }
+    const Eigen::Vector2f position = state.pose.head<2>().cast<float>();
+    const transform::Rigid2f map_to_base_link =
+        transform::Rigid2d(state.pose.head<2>(), state.pose(2)).inverse().cast<float>();
+    // 3 sigma of the predicted pose on top of the configured margin
+    const float position_margin =
+        options_.reflector_tracking_margin + 3. * std::sqrt(state.coviarance.topLeftCorner<2, 2>().trace());
+    const float angle_margin = 3. * std::sqrt(state.coviarance(2, 2));
+    const float max_range = options_.range_max + options_.sensor_to_base_link.translation().head<2>().norm() +
+                            options_.reflector_min_length + position_margin;
+    tracking_targets_.clear();
+    const auto add_target = [&](const Eigen::Vector2f &reflector) {
+        if ((reflector - position).squaredNorm() < max_range * max_range)
+            tracking_targets_.push_back(map_to_base_link * reflector);
+    };
+    for (const auto &reflector : tracking_map_.reflector_map_)
+        add_target(reflector);
+    if (snapshot && snapshot->landmarks)
+    {
+        for (int i = 0; i < snapshot->landmarks->size(); ++i)
+            add_target(snapshot->landmarks->position(i).cast<float>());
+    }
+    laser_reflector_detector_->SetTrackingTargets(tracking_targets_, position_margin, angle_margin);
+}
+
+std::unique_ptr<ekf::ReflectorEKFSLAMInterface> Node::CreateFilter(const ekf::EKFOptions &options)
+{
+    if (options_.ekf_type == "compressed")
+    {
+        return common::make_unique<ekf::ReflectorCompressedEKFSLAM>(options);
+    }
+    if (options_.ekf_type == "smoother")
+    {
+        return common::make_unique<ekf::ReflectorFixedLagSmoother>(options);
+    }
+    if (options_.ekf_type == "seif")
+    {
+        return common::make_unique<ekf::ReflectorSEIFSLAM>(options);
+    }
+#ifdef USE_GPS
+    return ekf::CreateReflectorEKFSLAM(options, true);
+#else
+    return ekf::CreateReflectorEKFSLAM(options, false);
+#endif
+}
+
 sensor_msgs::PointCloud Node::ToPointCloud(const sensor::RangeData &range_data)
 {
     sensor_msgs::PointCloud cloud;
@@ -423,21 +860,16 @@ void Node::ScanCallback(const sensor_msgs::LaserScanConstPtr &scan_ptr)
     const double time = scan_ptr->header.stamp.toSec();
     if (!slam_)
     {
-        ekf::EKFOptions options;
-        options.use_imu = options_.use_imu;
-        options.init_time = time;
-        options.init_pose = options_.initial_pose;
-        options.map_path = options_.map_path;
-        options.odom_model = options_.odom_model;
-        options.linear_velocity_cov = options_.linear_velocity_cov;
-        options.angular_velocity_cov = options_.angular_velocity_cov;
-        options.observation_cov = options_.observation_cov;
-#ifndef USE_GPS
-        slam_ = common::make_unique<ekf::ReflectorEKFSLAM>(options);
-#else
-        slam_ = common::make_unique<ekf::ReflectorEKFSLAMGPS>(options);
-#endif
+        slam_ = ResumeSLAM(time);
+        if (!slam_)
+        {
+            if ((constellation_index_ || hypothesis_bank_) &&
+                !LocalizeStartPose(laser_reflector_detector_->HandleLaserScan(scan_ptr)))
+                return;
+            slam_ = CreateSLAM(time);
+        }
         global_reflector_markers_ = ReflectorToRosMarkers(slam_->GetGlobalMap());
+        tracking_map_version_ = -1;
     }
     else
     {
@@ -446,20 +878,27 @@ void Node::ScanCallback(const sensor_msgs::LaserScanConstPtr &scan_ptr)
             LOG(ERROR) << "Laser reflector detector should be init first";
             exit(-1);
         }
+        if (options_.use_reflector_tracking)
+            SetTrackingTargets(*scan_ptr);
         auto observation = laser_reflector_detector_->HandleLaserScan(scan_ptr);
+        // Range data is only built for the scans the map builder takes
+        const bool add_range_data = ++scans_since_map_builder_ >= options_.map_builder_scan_interval;
+        if (add_range_data)
+            scans_since_map_builder_ = 0;
 #ifdef USE_GPS
-        ekf::State state;
-        const sensor::RangeData range_data = laser_reflector_detector_->GetRangeData();
-        {
-            std::lock_guard<std::mutex> lock_slam(slam_mutex_);
-            state = slam_->PredictState(scan_ptr->header.stamp.toSec());
-        }
-        const Eigen::Vector3d translation(state.mu(0), state.mu(1), 0.);
-        const Eigen::Quaterniond rotation(std::cos(state.mu(2) / 2), 0., 0., std::sin(state.mu(2) / 2));
-        transform::Rigid3d ekf_pose(translation, rotation);
-        common::Time now_time = FromRos(scan_ptr->header.stamp);
         std::unique_ptr<mapping::MatchingResult> match_result;
+        if (add_range_data)
         {
+            ekf::PoseState state;
+            const sensor::RangeData range_data = laser_reflector_detector_->GetRangeData();
+            {
+                std::lock_guard<std::mutex> lock_slam(slam_mutex_);
+                state = slam_->PredictPose(scan_ptr->header.stamp.toSec());
+            }
+            const Eigen::Vector3d translation(state.pose(0), state.pose(1), 0.);
+            const Eigen::Quaterniond rotation(std::cos(state.pose(2) / 2), 0., 0., std::sin(state.pose(2) / 2));
+            transform::Rigid3d ekf_pose(translation, rotation);
+            common::Time now_time = FromRos(scan_ptr->header.stamp);
             std::lock_guard<std::mutex> lock(map_builder_mutex_);
             match_result = map_builder_->AddRangeData(now_time, range_data, ekf_pose);
         }
@@ -471,23 +910,22 @@ void Node::ScanCallback(const sensor_msgs::LaserScanConstPtr &scan_ptr)
             observation.gps_pose_ =
                 common::make_unique<transform::Rigid2d>(transform::Project2D(match_result->local_pose));
         }
-        ekf::State latest_state;
         {
             std::lock_guard<std::mutex> lock_slam(slam_mutex_);
             slam_->HandleObservationMessage(observation);
-            latest_state = slam_->GetState();
         }
+        const auto latest_state = slam_->GetSnapshot();
 
         if (!observation.cloud_.empty())
         {
             /* publish  landmarks */
-            visualization_msgs::MarkerArray markers = ReflectorToRosMarkers(latest_state);
+            visualization_msgs::MarkerArray markers = ReflectorToRosMarkers(*latest_state);
             landmark_publisher_.publish(markers);
             // publish global marker
             global_reflector_publisher_.publish(global_reflector_markers_);
 
             /* publish  robot pose */
-            geometry_msgs::PoseWithCovarianceStamped robot_pose = StatePosetoRosPose(latest_state);
+            geometry_msgs::PoseWithCovarianceStamped robot_pose = StatePosetoRosPose(latest_state->robot);
             robot_pose.header.stamp = scan_ptr->header.stamp;
             pose_publisher_.publish(robot_pose);
 
@@ -497,9 +935,9 @@ void Node::ScanCallback(const sensor_msgs::LaserScanConstPtr &scan_ptr)
             geometry_msgs::PoseStamped pose;
             pose.header.frame_id = "world";
             pose.header.stamp = scan_ptr->header.stamp;
-            pose.pose.position.x = latest_state.mu(0);
-            pose.pose.position.y = latest_state.mu(1);
-            const double theta = latest_state.mu(2);
+            pose.pose.position.x = latest_state->robot.pose(0);
+            pose.pose.position.y = latest_state->robot.pose(1);
+            const double theta = latest_state->robot.pose(2);
             pose.pose.orientation.x = 0.;
             pose.pose.orientation.y = 0.;
             pose.pose.orientation.z = std::sin(theta / 2);
@@ -508,22 +946,21 @@ void Node::ScanCallback(const sensor_msgs::LaserScanConstPtr &scan_ptr)
             path_publisher_.publish(ekf_path_);
         }
 #else
-        ekf::State state;
         {
             std::lock_guard<std::mutex> lock_slam(slam_mutex_);
             slam_->HandleObservationMessage(observation);
-            state = slam_->GetState();
         }
+        const auto state = slam_->GetSnapshot();
         if (!observation.cloud_.empty())
         {
             /* publish  landmarks */
-            visualization_msgs::MarkerArray markers = ReflectorToRosMarkers(state);
+            visualization_msgs::MarkerArray markers = ReflectorToRosMarkers(*state);
             landmark_publisher_.publish(markers);
             // publish global marker
             global_reflector_publisher_.publish(global_reflector_markers_);
 
             /* publish  robot pose */
-            geometry_msgs::PoseWithCovarianceStamped robot_pose = StatePosetoRosPose(state);
+            geometry_msgs::PoseWithCovarianceStamped robot_pose = StatePosetoRosPose(state->robot);
             robot_pose.header.stamp = scan_ptr->header.stamp;
             pose_publisher_.publish(robot_pose);
 
@@ -533,9 +970,9 @@ void Node::ScanCallback(const sensor_msgs::LaserScanConstPtr &scan_ptr)
             geometry_msgs::PoseStamped pose;
             pose.header.frame_id = "world";
             pose.header.stamp = scan_ptr->header.stamp;
-            pose.pose.position.x = state.mu(0);
-            pose.pose.position.y = state.mu(1);
-            const double theta = state.mu(2);
+            pose.pose.position.x = state->robot.pose(0);
+            pose.pose.position.y = state->robot.pose(1);
+            const double theta = state->robot.pose(2);
             pose.pose.orientation.x = 0.;
             pose.pose.orientation.y = 0.;
             pose.pose.orientation.z = std::sin(theta / 2);
@@ -543,9 +980,11 @@ void Node::ScanCallback(const sensor_msgs::LaserScanConstPtr &scan_ptr)
             ekf_path_.poses.push_back(pose);
             path_publisher_.publish(ekf_path_);
         }
+        if (!add_range_data)
+            return;
         const sensor::RangeData range_data = laser_reflector_detector_->GetRangeData();
-        const Eigen::Vector3d translation(state.mu(0), state.mu(1), 0.);
-        const Eigen::Quaterniond rotation(std::cos(state.mu(2) / 2), 0., 0., std::sin(state.mu(2) / 2));
+        const Eigen::Vector3d translation(state->robot.pose(0), state->robot.pose(1), 0.);
+        const Eigen::Quaterniond rotation(std::cos(state->robot.pose(2) / 2), 0., 0., std::sin(state->robot.pose(2) / 2));
         transform::Rigid3d ekf_pose(translation, rotation);
         common::Time now_time = FromRos(scan_ptr->header.stamp);
         std::lock_guard<std::mutex> lock(map_builder_mutex_);
@@ -565,16 +1004,14 @@ void Node::PointCloudCallback(const sensor_msgs::PointCloud2ConstPtr &points_ptr
     const double time = points_ptr->header.stamp.toSec();
     if (!slam_)
     {
-        ekf::EKFOptions options;
-        options.use_imu = options_.use_imu;
-        options.init_time = time;
-        options.init_pose = options_.initial_pose;
-        options.map_path = options_.map_path;
-        options.odom_model = options_.odom_model;
-        options.linear_velocity_cov = options_.linear_velocity_cov;
-        options.angular_velocity_cov = options_.angular_velocity_cov;
-        options.observation_cov = options_.observation_cov;
-        slam_ = common::make_unique<ekf::ReflectorEKFSLAM>(options);
+        slam_ = ResumeSLAM(time);
+        if (!slam_)
+        {
+            if ((constellation_index_ || hypothesis_bank_) &&
+                !LocalizeStartPose(point_cloud_reflector_detector_->HandlePointCloud(points_ptr)))
+                return;
+            slam_ = CreateSLAM(time);
+        }
         global_reflector_markers_ = ReflectorToRosMarkers(slam_->GetGlobalMap());
     }
     else
@@ -585,23 +1022,22 @@ void Node::PointCloudCallback(const sensor_msgs::PointCloud2ConstPtr &points_ptr
             exit(-1);
         }
         const auto observation = point_cloud_reflector_detector_->HandlePointCloud(points_ptr);
-        ekf::State state;
         {
             std::lock_guard<std::mutex> lock_slam(slam_mutex_);
             slam_->HandleObservationMessage(observation);
-            state = slam_->GetState();
         }
+        const auto state = slam_->GetSnapshot();
 
         if (!observation.cloud_.empty())
         {
             /* publish  landmarks */
-            visualization_msgs::MarkerArray markers = ReflectorToRosMarkers(state);
+            visualization_msgs::MarkerArray markers = ReflectorToRosMarkers(*state);
             landmark_publisher_.publish(markers);
             // publish global marker
             global_reflector_publisher_.publish(global_reflector_markers_);
 
             /* publish  robot pose */
-            geometry_msgs::PoseWithCovarianceStamped robot_pose = StatePosetoRosPose(state);
+            geometry_msgs::PoseWithCovarianceStamped robot_pose = StatePosetoRosPose(state->robot);
             robot_pose.header.stamp = points_ptr->header.stamp;
             pose_publisher_.publish(robot_pose);
 
@@ -611,9 +1047,9 @@ void Node::PointCloudCallback(const sensor_msgs::PointCloud2ConstPtr &points_ptr
             geometry_msgs::PoseStamped pose;
             pose.header.frame_id = "world";
             pose.header.stamp = points_ptr->header.stamp;
-            pose.pose.position.x = state.mu(0);
-            pose.pose.position.y = state.mu(1);
-            const double theta = state.mu(2);
+            pose.pose.position.x = state->robot.pose(0);
+            pose.pose.position.y = state->robot.pose(1);
+            const double theta = state->robot.pose(2);
             pose.pose.orientation.x = 0.;
             pose.pose.orientation.y = 0.;
             pose.pose.orientation.z = std::sin(theta / 2);
@@ -632,12 +1068,22 @@ void Node::OdometryCallback(const nav_msgs::OdometryConstPtr &msg)
         laser_reflector_detector_->HandleOdometryData(odom);
     }
 
+    if (!slam_ && hypothesis_bank_)
+    {
+        hypothesis_bank_->HandleOdometryMessage(odom);
+        return;
+    }
+
     if (slam_)
     {
-        slam_->HandleOdometryMessage(odom);
-        const ekf::State state = slam_->GetState();
+        {
+            std::lock_guard<std::mutex> lock_slam(slam_mutex_);
+            slam_->HandleOdometryMessage(odom);
+        }
+        // Only robot pose is needed, read from snapshot without copying covariance
+        const auto state = slam_->GetSnapshot();
         /* publish  robot pose */
-        geometry_msgs::PoseWithCovarianceStamped robot_pose = StatePosetoRosPose(state);
+        geometry_msgs::PoseWithCovarianceStamped robot_pose = StatePosetoRosPose(state->robot);
         robot_pose.header.stamp = msg->header.stamp;
         pose_publisher_.publish(robot_pose);
 
@@ -647,9 +1093,9 @@ void Node::OdometryCallback(const nav_msgs::OdometryConstPtr &msg)
         geometry_msgs::PoseStamped pose;
         pose.header.frame_id = "world";
         pose.header.stamp = msg->header.stamp;
-        pose.pose.position.x = state.mu(0);
-        pose.pose.position.y = state.mu(1);
-        const double theta = state.mu(2);
+        pose.pose.position.x = state->robot.pose(0);
+        pose.pose.position.y = state->robot.pose(1);
+        const double theta = state->robot.pose(2);
         pose.pose.orientation.x = 0.;
         pose.pose.orientation.y = 0.;
         pose.pose.orientation.z = std::sin(theta / 2);
@@ -659,6 +1105,34 @@ void Node::OdometryCallback(const nav_msgs::OdometryConstPtr &msg)
     }
 }
 
+void Node::ImuCallback(const sensor_msgs::ImuConstPtr &msg)
+{
+    const auto imu = ToImuData(*msg);
+    if (options_.use_laser && laser_reflector_detector_)
+    {
+        laser_reflector_detector_->HandleImuData(imu);
+    }
+
+    if (slam_)
+    {
+        std::lock_guard<std::mutex> lock_slam(slam_mutex_);
+        slam_->HandleImuMessage(imu);
+    }
+}
+
+sensor::ImuData Node::ToImuData(const sensor_msgs::Imu &msg)
+{
+    sensor::ImuData result;
+    result.time = msg.header.stamp.toSec();
+    result.orientation = Eigen::Quaterniond(msg.orientation.w, msg.orientation.x,
+                                            msg.orientation.y, msg.orientation.z);
+    result.linear_acceleration = Eigen::Vector3d(msg.linear_acceleration.x,
+                                                 msg.linear_acceleration.y, msg.linear_acceleration.z);
+    result.angulear_velocity = Eigen::Vector3d(msg.angular_velocity.x,
+                                               msg.angular_velocity.y, msg.angular_velocity.z);
+    return result;
+}
+
 sensor::OdometryData Node::ToOdometryData(const nav_msgs::Odometry &msg)
 {
     sensor::OdometryData result;
@@ -733,26 +1207,24 @@ visualization_msgs::MarkerArray Node::ReflectorToRosMarkers(const sensor::Map &m
     return markers;
 }
 
-visualization_msgs::MarkerArray Node::ReflectorToRosMarkers(const ekf::State &state, const double &scale)
+visualization_msgs::MarkerArray Node::ReflectorToRosMarkers(const ekf::StateSnapshot &state, const double &scale)
 {
     visualization_msgs::MarkerArray markers;
-    const int N = state.mu.rows();
-    if (N == 3)
+    const int M = state.landmarks->size();
+    if (M == 0)
     {
         LOG(INFO) << "No reflector detected";
         return markers;
     }
 
-    const int M = (N - 3) / 2;
     LOG(INFO) << "Now reflector size is : " << M;
     for (int i = 0; i < M; i++)
     {
-        const int id = 3 + 2 * i;
-        const double mx = state.mu(id);
-        const double my = state.mu(id + 1);
+        const double mx = state.landmarks->position(i).x();
+        const double my = state.landmarks->position(i).y();
 
         /* 计算地图点的协方差椭圆角度以及轴长 */
-        const Eigen::Matrix2d sigma_m = state.sigma.block(id, id, 2, 2); //协方差
+        const Eigen::Matrix2d sigma_m = state.landmarks->coviarance(i); //协方差
         // Calculate Eigen Value(D) and Vectors(V), simga_m = V * D * V^-1
         // D = | D1 0  |  V = |cos  -sin|
         //     | 0  D2 |      |sin  cos |
@@ -767,7 +1239,7 @@ visualization_msgs::MarkerArray Node::ReflectorToRosMarkers(const ekf::State &st
         /* 构造marker */
         visualization_msgs::Marker marker;
         marker.header.frame_id = "world";
-        marker.header.stamp = ros::Time(state.time);
+        marker.header.stamp = ros::Time(state.robot.time);
         marker.ns = "ekf_slam";
         marker.id = i;
         marker.type = visualization_msgs::Marker::SPHERE;
@@ -793,28 +1265,28 @@ visualization_msgs::MarkerArray Node::ReflectorToRosMarkers(const ekf::State &st
     return markers;
 }
 
-geometry_msgs::PoseWithCovarianceStamped Node::StatePosetoRosPose(const ekf::State &state)
+geometry_msgs::PoseWithCovarianceStamped Node::StatePosetoRosPose(const ekf::PoseState &state)
 {
     /* 转换带协方差的机器人位姿 */
     geometry_msgs::PoseWithCovarianceStamped rpose;
     rpose.header.frame_id = "world";
 
-    rpose.pose.pose.position.x = state.mu(0);
-    rpose.pose.pose.position.y = state.mu(1);
+    rpose.pose.pose.position.x = state.pose(0);
+    rpose.pose.pose.position.y = state.pose(1);
     rpose.pose.pose.orientation.x = 0.0;
     rpose.pose.pose.orientation.y = 0.0;
-    rpose.pose.pose.orientation.z = std::sin(state.mu(2) / 2);
-    rpose.pose.pose.orientation.w = std::cos(state.mu(2) / 2);
-
-    rpose.pose.covariance.at(0) = state.sigma(0, 0);
-    rpose.pose.covariance.at(1) = state.sigma(0, 1);
-    rpose.pose.covariance.at(5) = state.sigma(0, 2);
-    rpose.pose.covariance.at(6) = state.sigma(1, 0);
-    rpose.pose.covariance.at(7) = state.sigma(1, 1);
-    rpose.pose.covariance.at(11) = state.sigma(1, 2);
-    rpose.pose.covariance.at(30) = state.sigma(2, 0);
-    rpose.pose.covariance.at(31) = state.sigma(2, 1);
-    rpose.pose.covariance.at(35) = state.sigma(2, 2);
+    rpose.pose.pose.orientation.z = std::sin(state.pose(2) / 2);
+    rpose.pose.pose.orientation.w = std::cos(state.pose(2) / 2);
+
+    rpose.pose.covariance.at(0) = state.coviarance(0, 0);
+    rpose.pose.covariance.at(1) = state.coviarance(0, 1);
+    rpose.pose.covariance.at(5) = state.coviarance(0, 2);
+    rpose.pose.covariance.at(6) = state.coviarance(1, 0);
+    rpose.pose.covariance.at(7) = state.coviarance(1, 1);
+    rpose.pose.covariance.at(11) = state.coviarance(1, 2);
+    rpose.pose.covariance.at(30) = state.coviarance(2, 0);
+    rpose.pose.covariance.at(31) = state.coviarance(2, 1);
+    rpose.pose.covariance.at(35) = state.coviarance(2, 2);
     return rpose;
 }
 
@@ -862,6 +1334,46 @@ void Node::PublishMap(const ros::WallTimerEvent &timer_event)
     occupancy_grid_publisher_.publish(*msg_ptr);
 }
 
+void Node::SaveCheckpoint(const ros::WallTimerEvent &timer_event)
+{
+    if (checkpoint_writing_)
+    {
+        LOG(WARNING) << "Last checkpoint is still being written, skip this one";
+        return;
+    }
+    if (checkpoint_thread_.joinable())
+        checkpoint_thread_.join();
+
+    // Only the copy is done under the lock, building the state and writing
+    // happen off the callback thread. Deferred updates, e.g. of the compressed
+    // filter, are applied to the copy, the filter itself is not synchronized.
+    auto checkpoint = std::make_shared<ekf::Checkpoint>();
+    std::function<ekf::State()> capture_state;
+    {
+        std::lock_guard<std::mutex> lock_slam(slam_mutex_);
+        if (!slam_ || !slam_->CanRestoreState())
+            return;
+        capture_state = slam_->CaptureState();
+        checkpoint->map = slam_->GetGlobalMap();
+        // Settings of the running filter, those of a resumed one came from its checkpoint
+        checkpoint->odom_model = slam_options_.odom_model;
+        checkpoint->linear_velocity_cov = slam_options_.linear_velocity_cov;
+        checkpoint->angular_velocity_cov = slam_options_.angular_velocity_cov;
+        checkpoint->observation_cov = slam_options_.observation_cov;
+    }
+
+    checkpoint_writing_ = true;
+    const std::string path = options_.checkpoint_path;
+    checkpoint_thread_ = std::thread([this, checkpoint, capture_state, path]() {
+        const auto start = std::chrono::steady_clock::now();
+        checkpoint->state = capture_state();
+        if (ekf::WriteCheckpoint(path, *checkpoint))
+            LOG(INFO) << "Write checkpoint with " << checkpoint->state.mu.rows() << " state rows in "
+                      << common::ToSeconds(std::chrono::steady_clock::now() - start) << " s";
+        checkpoint_writing_ = false;
+    });
+}
+
 void Node::WritePgm(const io::Image &image, const double resolution,
                     io::FileWriter *file_writer)
 {
@@ -964,6 +1476,7 @@ bool Node::HandleSaveMap(
 
     {
         std::lock_guard<std::mutex> lock_slam(slam_mutex_);
+        slam_->SyncGlobalState();
         SaveReflectorResult(filebase);
     }
     LOG(INFO) << "Start to write grid map";
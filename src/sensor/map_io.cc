@@ -0,0 +1,314 @@
+#include "sensor/map_io.h"
+#include "common/common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glog/logging.h>
+
+namespace sensor
+{
+namespace
+{
+constexpr char kMapMagic[8] = {'R', 'E', 'F', 'L', 'M', 'A', 'P', '\0'};
+constexpr uint32_t kMapVersion = 1;
+
+struct MapHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t has_index;
+  uint64_t reflector_number;
+  // Parameters the index was built with
+  double resolution;
+  double gate;
+  double noise[4];
+  uint64_t cell_number;
+  uint64_t cell_id_number;
+  uint64_t unbounded_number;
+};
+static_assert(sizeof(MapHeader) == 96, "map header must keep arrays 8 byte aligned");
+
+// Bytes following the header, 8 byte arrays come before 4 byte ones. Returns
+// false if the counts of the header can not fit in 'size' bytes, which is
+// checked before multiplying so a broken header can not overflow.
+bool PayloadSize(const MapHeader &header, const uint64_t &size, uint64_t *payload_size)
+{
+    const uint64_t reflector_bytes = sizeof(float) * 2 + sizeof(double) * 4;
+    const uint64_t max_reflectors = std::min<uint64_t>(size / reflector_bytes, std::numeric_limits<int>::max());
+    if (header.reflector_number > max_reflectors || header.cell_number >= size / sizeof(int64_t) ||
+        header.cell_id_number > size / sizeof(int32_t) || header.unbounded_number > size / sizeof(int32_t))
+        return false;
+    *payload_size = reflector_bytes * header.reflector_number + sizeof(int64_t) * header.cell_number +
+                    sizeof(uint32_t) * (header.cell_number + 1) +
+                    sizeof(int32_t) * (header.cell_id_number + header.unbounded_number);
+    return true;
+}
+
+template <typename T>
+void WriteArray(const std::vector<T> &values, std::ofstream *out)
+{
+    out->write(reinterpret_cast<const char *>(values.data()), sizeof(T) * values.size());
+}
+
+// Copies 'number' values of T at 'bytes' into 'values' and advances 'bytes'
+template <typename T>
+void ReadArray(const uint64_t &number, const char **bytes, std::vector<T> *values)
+{
+    values->resize(number);
+    std::memcpy(values->data(), *bytes, sizeof(T) * number);
+    *bytes += sizeof(T) * number;
+}
+} // namespace
+
+bool LoadMapFromTxtFile(const std::string &file, Map *map)
+{
+    if (file.empty() || !IsFileExist(file))
+        return false;
+    std::ifstream in(file.c_str());
+    std::string line;
+    std::vector<std::vector<double>> result;
+    if (in) // 有该文件
+    {
+        while (getline(in, line)) // line中不包括每行的换行符
+        {
+            if (!line.empty())
+            {
+                std::vector<double> vec;
+                auto vstr_vec = SplitString(line, ',');
+                for (auto &p : vstr_vec)
+                {
+                    vec.push_back(std::stod(p));
+                }
+                result.push_back(vec);
+            }
+        }
+    }
+    else // 没有该文件
+    {
+        // std::cout << "No map file in the map path!" << std::endl;
+        LOG(INFO) << "No map file in the map path!";
+        return false;
+    }
+
+    if (result.size() != 2 || result.back().size() != 2 * result.front().size())
+    {
+        // std::cout <<"format is not right, must be 2 line" << std::endl;
+        LOG(INFO) << "Format is not right, must be 2 line";
+        return false;
+    }
+    PointCloud reflector_map;
+    PointCloudCoviarance reflector_map_coviarance;
+
+    for (int i = 0; i < result[0].size() / 2; ++i)
+    {
+        reflector_map.push_back(Eigen::Vector2f(result[0][2 * i], result[0][2 * i + 1]));
+    }
+    for (int i = 0; i < result[1].size() / 4; ++i)
+    {
+        Eigen::Matrix2d p;
+        p << result[1][4 * i], result[1][4 * i + 1], result[1][4 * i + 2], result[1][4 * i + 3];
+        reflector_map_coviarance.push_back(p);
+    }
+    map->reflector_map_ = reflector_map;
+    map->reflector_map_coviarance_ = reflector_map_coviarance;
+    LOG(INFO) << "Load " << reflector_map.size() << " reflectors from " << file;
+    return true;
+}
+
+bool SaveMapToTxtFile(const std::string &file, const Map &map)
+{
+    CHECK(map.reflector_map_.size() == map.reflector_map_coviarance_.size());
+    std::ofstream out(file.c_str(), std::ios::out);
+    if (!out)
+    {
+        LOG(WARNING) << "Can not open map file " << file;
+        return false;
+    }
+    // Enough digits to read back the same float and double
+    out.precision(std::numeric_limits<float>::max_digits10);
+    for (int i = 0; i < map.reflector_map_.size(); ++i)
+    {
+        if (i != 0)
+            out << ",";
+        out << map.reflector_map_[i].x() << "," << map.reflector_map_[i].y();
+    }
+    out << std::endl;
+    out.precision(std::numeric_limits<double>::max_digits10);
+    for (int i = 0; i < map.reflector_map_coviarance_.size(); ++i)
+    {
+        const Eigen::Matrix2d &coviarance = map.reflector_map_coviarance_[i];
+        if (i != 0)
+            out << ",";
+        out << coviarance(0, 0) << "," << coviarance(0, 1) << "," << coviarance(1, 0) << "," << coviarance(1, 1);
+    }
+    out << std::endl;
+    return static_cast<bool>(out);
+}
+
+bool SaveMapToBinaryFile(const std::string &file, const Map &map, const ReflectorMapIndex *index)
+{
+    CHECK(map.reflector_map_.size() == map.reflector_map_coviarance_.size());
+    ReflectorMapIndex::Cells cells;
+    MapHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kMapMagic, sizeof(header.magic));
+    header.version = kMapVersion;
+    header.reflector_number = map.reflector_map_.size();
+    if (index != nullptr)
+    {
+        CHECK(index->Size() == map.reflector_map_.size());
+        cells = index->ExportCells();
+        header.has_index = 1;
+        header.resolution = index->resolution();
+        header.gate = index->gate();
+        Eigen::Map<Eigen::Matrix2d>(header.noise) = index->noise();
+    }
+    else
+    {
+        cells.offsets.push_back(0);
+    }
+    header.cell_number = cells.keys.size();
+    header.cell_id_number = cells.ids.size();
+    header.unbounded_number = cells.unbounded.size();
+
+    const std::string temporary = file + ".tmp";
+    {
+        std::ofstream out(temporary.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            LOG(WARNING) << "Can not open map file " << temporary;
+            return false;
+        }
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (const auto &reflector : map.reflector_map_)
+            out.write(reinterpret_cast<const char *>(reflector.data()), sizeof(float) * 2);
+        for (const auto &coviarance : map.reflector_map_coviarance_)
+            out.write(reinterpret_cast<const char *>(coviarance.data()), sizeof(double) * 4);
+        WriteArray(cells.keys, &out);
+        WriteArray(cells.offsets, &out);
+        WriteArray(cells.ids, &out);
+        WriteArray(cells.unbounded, &out);
+        if (!out.flush())
+        {
+            LOG(WARNING) << "Failed to write map file " << temporary;
+            return false;
+        }
+    }
+    if (std::rename(temporary.c_str(), file.c_str()) != 0)
+    {
+        LOG(WARNING) << "Failed to move map file " << temporary << " to " << file;
+        return false;
+    }
+    return true;
+}
+
+bool IsBinaryMapFile(const std::string &file)
+{
+    if (file.empty() || !IsFileExist(file))
+        return false;
+    std::ifstream in(file.c_str(), std::ios::in | std::ios::binary);
+    char magic[sizeof(kMapMagic)];
+    return in.read(magic, sizeof(magic)) && std::memcmp(magic, kMapMagic, sizeof(magic)) == 0;
+}
+
+bool LoadMapFromBinaryFile(const std::string &file, Map *map, ReflectorMapIndex *index, bool *has_index)
+{
+    if (file.empty() || !IsFileExist(file))
+        return false;
+    const int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        LOG(WARNING) << "Can not open map file " << file;
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) < sizeof(MapHeader))
+    {
+        LOG(WARNING) << "Map file " << file << " is too short";
+        close(fd);
+        return false;
+    }
+    const size_t size = file_stat.st_size;
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        LOG(WARNING) << "Can not map file " << file;
+        return false;
+    }
+
+    const char *bytes = static_cast<const char *>(data);
+    MapHeader header;
+    std::memcpy(&header, bytes, sizeof(header));
+    uint64_t payload_size = 0;
+    bool valid = true;
+    if (std::memcmp(header.magic, kMapMagic, sizeof(header.magic)) != 0 || header.version != kMapVersion)
+    {
+        LOG(WARNING) << "Map file " << file << " is not a version " << kMapVersion << " binary map";
+        valid = false;
+    }
+    else if (!PayloadSize(header, size, &payload_size) || sizeof(header) + payload_size != size)
+    {
+        LOG(WARNING) << "Map file " << file << " is broken, " << header.reflector_number << " reflectors, "
+                     << header.cell_number << " cells, file size " << size;
+        valid = false;
+    }
+    if (!valid)
+    {
+        munmap(data, size);
+        return false;
+    }
+
+    const int M = header.reflector_number;
+    bytes += sizeof(header);
+    const float *reflectors = reinterpret_cast<const float *>(bytes);
+    const double *coviarances = reinterpret_cast<const double *>(reflectors + 2 * M);
+    map->reflector_map_.resize(M);
+    map->reflector_map_coviarance_.resize(M);
+    for (int i = 0; i < M; ++i)
+    {
+        map->reflector_map_[i] = Eigen::Map<const Eigen::Vector2f>(reflectors + 2 * i);
+        map->reflector_map_coviarance_[i] = Eigen::Map<const Eigen::Matrix2d>(coviarances + 4 * i);
+    }
+    bytes = reinterpret_cast<const char *>(coviarances + 4 * M);
+
+    const bool load_index = header.has_index && index != nullptr && header.resolution == index->resolution();
+    if (load_index)
+    {
+        ReflectorMapIndex::Cells cells;
+        ReadArray(header.cell_number, &bytes, &cells.keys);
+        ReadArray(header.cell_number + 1, &bytes, &cells.offsets);
+        ReadArray(header.cell_id_number, &bytes, &cells.ids);
+        ReadArray(header.unbounded_number, &bytes, &cells.unbounded);
+        index->ImportCells(*map, header.gate, Eigen::Map<const Eigen::Matrix2d>(header.noise), cells);
+    }
+    if (has_index != nullptr)
+        *has_index = load_index;
+    munmap(data, size);
+    LOG(INFO) << "Load " << M << " reflectors from " << file;
+    return true;
+}
+
+bool LoadMap(const std::string &file, const double &gate, const Eigen::Matrix2d &noise,
+             Map *map, ReflectorMapIndex *index)
+{
+    bool loaded = false;
+    bool has_index = false;
+    if (IsBinaryMapFile(file))
+        loaded = LoadMapFromBinaryFile(file, map, index, &has_index);
+    else
+        loaded = LoadMapFromTxtFile(file, map);
+    if (!has_index || index->gate() != gate || index->noise() != noise)
+        index->Build(*map, gate, noise);
+    return loaded;
+}
+
+} // namespace sensor
@@ -0,0 +1,335 @@
+#include "sensor/reflector_constellation_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <unordered_map>
+#include <glog/logging.h>
+
+namespace sensor
+{
+
+namespace
+{
+// Neighbors per reflector used to form triangles, bounds the build in dense areas
+constexpr int kMaxNeighbors = 16;
+// Observed triangles looked up per scan, the most compact ones first
+constexpr int kMaxObservedTriangles = 16;
+// Candidate poses verified per scan
+constexpr int kMaxCandidates = 20000;
+// Distinct poses refined and returned
+constexpr int kMaxDistinctCandidates = 64;
+// Candidates closer than this to a better one are the same pose
+constexpr double kDistinctDistance = 1.;
+constexpr double kDistinctAngle = 0.2;
+constexpr int kSideBits = 20;
+// Vertex orders of a triangle, the last three mirror its orientation
+constexpr int kPermutations[6][3] = {{0, 1, 2}, {1, 2, 0}, {2, 0, 1}, {0, 2, 1}, {2, 1, 0}, {1, 0, 2}};
+
+// Least squares rigid transform taking 'from' to 'to'
+transform::Rigid2d AlignPoints(const std::vector<Eigen::Vector2d> &from, const std::vector<Eigen::Vector2d> &to)
+{
+    CHECK(from.size() == to.size() && !from.empty());
+    Eigen::Vector2d from_mean = Eigen::Vector2d::Zero(), to_mean = Eigen::Vector2d::Zero();
+    for (int i = 0; i < from.size(); ++i)
+    {
+        from_mean += from[i];
+        to_mean += to[i];
+    }
+    from_mean /= from.size();
+    to_mean /= to.size();
+    double dot = 0., cross = 0.;
+    for (int i = 0; i < from.size(); ++i)
+    {
+        const Eigen::Vector2d a = from[i] - from_mean;
+        const Eigen::Vector2d b = to[i] - to_mean;
+        dot += a.dot(b);
+        cross += a.x() * b.y() - a.y() * b.x();
+    }
+    const Eigen::Rotation2Dd rotation(std::atan2(cross, dot));
+    return transform::Rigid2d(to_mean - rotation * from_mean, rotation);
+}
+
+using Candidate = ReflectorConstellationIndex::Candidate;
+
+// Observed reflectors passing the gate at 'pose', and the map reflectors they match
+Candidate Verify(const Map &map, const ReflectorMapIndex &map_index, const std::vector<Eigen::Vector2d> &observed,
+                 const transform::Rigid2d &pose, std::vector<int> *matches)
+{
+    Candidate candidate{pose, 0, 0.};
+    if (matches)
+        matches->assign(observed.size(), -1);
+    for (int i = 0; i < observed.size(); ++i)
+    {
+        double distance;
+        const int id = map_index.Match(map, (pose * observed[i]).cast<float>(), &distance);
+        if (id < 0)
+            continue;
+        ++candidate.inliers;
+        candidate.cost += distance;
+        if (matches)
+            (*matches)[i] = id;
+    }
+    return candidate;
+}
+
+bool IsBetter(const Candidate &lhs, const Candidate &rhs)
+{
+    return lhs.inliers > rhs.inliers || (lhs.inliers == rhs.inliers && lhs.cost < rhs.cost);
+}
+
+bool IsDistinct(const transform::Rigid2d &lhs, const transform::Rigid2d &rhs)
+{
+    const transform::Rigid2d delta = lhs.inverse() * rhs;
+    return delta.translation().norm() > kDistinctDistance || std::abs(delta.normalized_angle()) > kDistinctAngle;
+}
+
+// Pose aligning every reflector 'candidate' explains, if it explains no fewer
+Candidate Refine(const Map &map, const ReflectorMapIndex &map_index, const std::vector<Eigen::Vector2d> &observed,
+                 const Candidate &candidate)
+{
+    std::vector<int> matches;
+    Verify(map, map_index, observed, candidate.pose, &matches);
+    std::vector<Eigen::Vector2d> from, to;
+    for (int i = 0; i < observed.size(); ++i)
+    {
+        if (matches[i] < 0)
+            continue;
+        from.push_back(observed[i]);
+        to.push_back(map.reflector_map_[matches[i]].cast<double>());
+    }
+    const Candidate refined = Verify(map, map_index, observed, AlignPoints(from, to), nullptr);
+    return refined.inliers >= candidate.inliers ? refined : candidate;
+}
+} // namespace
+
+ReflectorConstellationIndex::ReflectorConstellationIndex(const double &min_side_length, const double &max_side_length,
+                                                         const double &side_tolerance)
+    : min_side_length_(min_side_length), max_side_length_(max_side_length), side_tolerance_(side_tolerance)
+{
+    CHECK(side_tolerance_ > 0. && min_side_length_ >= 0. && max_side_length_ > min_side_length_);
+    CHECK(Quantize(max_side_length_ + side_tolerance_) < (1 << kSideBits));
+}
+
+int ReflectorConstellationIndex::Quantize(const double &side) const
+{
+    return std::max(0, static_cast<int>(std::floor(side / side_tolerance_)));
+}
+
+uint64_t ReflectorConstellationIndex::Key(const int &s0, const int &s1, const int &s2, const bool &ccw) const
+{
+    return ((static_cast<uint64_t>(s0) << (2 * kSideBits)) | (static_cast<uint64_t>(s1) << kSideBits) |
+            static_cast<uint64_t>(s2)) << 1 | (ccw ? 1 : 0);
+}
+
+bool ReflectorConstellationIndex::Canonicalize(const Eigen::Vector2d points[3], int order[3], double sides[3],
+                                               bool *ccw) const
+{
+    double opposite[3];
+    for (int i = 0; i < 3; ++i)
+        opposite[i] = (points[(i + 1) % 3] - points[(i + 2) % 3]).norm();
+    order[0] = 0;
+    order[1] = 1;
+    order[2] = 2;
+    std::sort(order, order + 3, [&](const int &lhs, const int &rhs) { return opposite[lhs] < opposite[rhs]; });
+    for (int i = 0; i < 3; ++i)
+        sides[i] = opposite[order[i]];
+    if (sides[0] < min_side_length_ || sides[2] > max_side_length_)
+        return false;
+    const Eigen::Vector2d u = points[order[1]] - points[order[0]];
+    const Eigen::Vector2d v = points[order[2]] - points[order[0]];
+    const double cross = u.x() * v.y() - u.y() * v.x();
+    // Orientation of a nearly collinear triangle flips with noise
+    if (std::abs(cross) / sides[2] < 2. * side_tolerance_)
+        return false;
+    *ccw = cross > 0.;
+    return true;
+}
+
+void ReflectorConstellationIndex::Build(const Map &map)
+{
+    triangles_.clear();
+    const PointCloud &reflectors = map.reflector_map_;
+    const int M = reflectors.size();
+    // Grid with cells of the longest side, neighbors are in the 3x3 cells around
+    auto cell_key = [&](const int &x, const int &y) {
+        return (static_cast<int64_t>(x) << 32) ^ static_cast<uint32_t>(y);
+    };
+    auto cell_index = [&](const float &value) {
+        return static_cast<int>(std::floor(value / max_side_length_));
+    };
+    std::unordered_map<int64_t, std::vector<int>> cells;
+    for (int i = 0; i < M; ++i)
+        cells[cell_key(cell_index(reflectors[i].x()), cell_index(reflectors[i].y()))].push_back(i);
+
+    std::vector<std::pair<double, int>> neighbors;
+    Eigen::Vector2d points[3];
+    int order[3];
+    double sides[3];
+    bool ccw;
+    for (int i = 0; i < M; ++i)
+    {
+        // Triangles are formed at their smallest id, so each is hashed once
+        neighbors.clear();
+        const int x = cell_index(reflectors[i].x()), y = cell_index(reflectors[i].y());
+        for (int dx = -1; dx <= 1; ++dx)
+            for (int dy = -1; dy <= 1; ++dy)
+            {
+                const auto it = cells.find(cell_key(x + dx, y + dy));
+                if (it == cells.end())
+                    continue;
+                for (const int &j : it->second)
+                {
+                    const double distance = (reflectors[j] - reflectors[i]).cast<double>().norm();
+                    if (j > i && distance >= min_side_length_ && distance <= max_side_length_)
+                        neighbors.emplace_back(distance, j);
+                }
+            }
+        if (neighbors.size() > kMaxNeighbors)
+        {
+            std::partial_sort(neighbors.begin(), neighbors.begin() + kMaxNeighbors, neighbors.end());
+            neighbors.resize(kMaxNeighbors);
+        }
+        for (int a = 0; a < neighbors.size(); ++a)
+            for (int b = a + 1; b < neighbors.size(); ++b)
+            {
+                const int ids[3] = {i, neighbors[a].second, neighbors[b].second};
+                for (int k = 0; k < 3; ++k)
+                    points[k] = reflectors[ids[k]].cast<double>();
+                if (!Canonicalize(points, order, sides, &ccw))
+                    continue;
+                Triangle triangle;
+                triangle.key = Key(Quantize(sides[0]), Quantize(sides[1]), Quantize(sides[2]), ccw);
+                for (int k = 0; k < 3; ++k)
+                    triangle.ids[k] = ids[order[k]];
+                triangles_.push_back(triangle);
+            }
+    }
+    std::sort(triangles_.begin(), triangles_.end(),
+              [](const Triangle &lhs, const Triangle &rhs) { return lhs.key < rhs.key; });
+    LOG(INFO) << "Reflector constellation index: " << Size() << " triangles of " << M << " reflectors";
+}
+
+std::vector<ReflectorConstellationIndex::Candidate> ReflectorConstellationIndex::Candidates(
+    const Map &map, const ReflectorMapIndex &map_index, const PointCloud &observed, const int &min_inliers) const
+{
+    CHECK(min_inliers >= 3);
+    const int N = observed.size();
+    if (N < min_inliers)
+        return {};
+    std::vector<Eigen::Vector2d> points(N);
+    for (int i = 0; i < N; ++i)
+        points[i] = observed[i].cast<double>();
+
+    struct ObservedTriangle
+    {
+      int ids[3];
+      double sides[3];
+      bool ccw;
+    };
+    std::vector<ObservedTriangle> observed_triangles;
+    Eigen::Vector2d vertices[3];
+    int order[3];
+    for (int a = 0; a < N; ++a)
+        for (int b = a + 1; b < N; ++b)
+            for (int c = b + 1; c < N; ++c)
+            {
+                const int ids[3] = {a, b, c};
+                for (int k = 0; k < 3; ++k)
+                    vertices[k] = points[ids[k]];
+                ObservedTriangle triangle;
+                if (!Canonicalize(vertices, order, triangle.sides, &triangle.ccw))
+                    continue;
+                for (int k = 0; k < 3; ++k)
+                    triangle.ids[k] = ids[order[k]];
+                observed_triangles.push_back(triangle);
+            }
+    // Compact triangles are the most likely to be hashed, the neighbors of a
+    // reflector are capped in dense areas
+    std::sort(observed_triangles.begin(), observed_triangles.end(),
+              [](const ObservedTriangle &lhs, const ObservedTriangle &rhs) { return lhs.sides[2] < rhs.sides[2]; });
+    if (observed_triangles.size() > kMaxObservedTriangles)
+        observed_triangles.resize(kMaxObservedTriangles);
+
+    std::vector<Candidate> candidates;
+    std::vector<Eigen::Vector2d> from(3), to(3);
+    for (const ObservedTriangle &triangle : observed_triangles)
+        for (int p = 0; p < 6; ++p)
+        {
+            // Sides closer than twice the tolerance may be sorted the other way
+            // in the map, which also mirrors the orientation
+            const int *permutation = kPermutations[p];
+            bool possible = true;
+            for (int i = 0; i < 3 && possible; ++i)
+                for (int j = i + 1; j < 3 && possible; ++j)
+                    possible = triangle.sides[permutation[i]] <= triangle.sides[permutation[j]] + 2. * side_tolerance_;
+            if (!possible)
+                continue;
+            const bool ccw = p < 3 ? triangle.ccw : !triangle.ccw;
+            double sides[3];
+            int low[3], high[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                sides[k] = triangle.sides[permutation[k]];
+                low[k] = Quantize(sides[k] - side_tolerance_);
+                high[k] = Quantize(sides[k] + side_tolerance_);
+                from[k] = points[triangle.ids[permutation[k]]];
+            }
+            for (int s0 = low[0]; s0 <= high[0]; ++s0)
+                for (int s1 = low[1]; s1 <= high[1]; ++s1)
+                    for (int s2 = low[2]; s2 <= high[2]; ++s2)
+                    {
+                        Triangle probe;
+                        probe.key = Key(s0, s1, s2, ccw);
+                        const auto range = std::equal_range(
+                            triangles_.begin(), triangles_.end(), probe,
+                            [](const Triangle &lhs, const Triangle &rhs) { return lhs.key < rhs.key; });
+                        for (auto it = range.first; it != range.second && candidates.size() < kMaxCandidates; ++it)
+                        {
+                            for (int k = 0; k < 3; ++k)
+                                to[k] = map.reflector_map_[it->ids[k]].cast<double>();
+                            bool consistent = true;
+                            for (int k = 0; k < 3 && consistent; ++k)
+                                consistent = std::abs((to[(k + 1) % 3] - to[(k + 2) % 3]).norm() - sides[k]) <=
+                                             side_tolerance_;
+                            if (!consistent)
+                                continue;
+                            candidates.push_back(Verify(map, map_index, points, AlignPoints(from, to), nullptr));
+                        }
+                    }
+        }
+    std::sort(candidates.begin(), candidates.end(), IsBetter);
+    std::vector<Candidate> distinct;
+    for (const Candidate &candidate : candidates)
+    {
+        if (candidate.inliers < min_inliers || distinct.size() == kMaxDistinctCandidates)
+            break;
+        if (std::all_of(distinct.begin(), distinct.end(),
+                        [&](const Candidate &other) { return IsDistinct(other.pose, candidate.pose); }))
+            distinct.push_back(candidate);
+    }
+    for (Candidate &candidate : distinct)
+        candidate = Refine(map, map_index, points, candidate);
+    std::sort(distinct.begin(), distinct.end(), IsBetter);
+    return distinct;
+}
+
+bool ReflectorConstellationIndex::Localize(const Map &map, const ReflectorMapIndex &map_index,
+                                           const PointCloud &observed, const int &min_inliers,
+                                           transform::Rigid2d *pose, int *inliers) const
+{
+    const std::vector<Candidate> candidates = Candidates(map, map_index, observed, min_inliers);
+    if (candidates.empty())
+        return false;
+    if (candidates.size() > 1 && candidates[1].inliers >= candidates[0].inliers)
+    {
+        LOG(WARNING) << "Global localization is ambiguous, " << candidates[0].pose << " and " << candidates[1].pose
+                     << " both explain " << candidates[0].inliers << " of " << observed.size() << " reflectors";
+        return false;
+    }
+    *pose = candidates[0].pose;
+    *inliers = candidates[0].inliers;
+    return true;
+}
+
+} // namespace sensor
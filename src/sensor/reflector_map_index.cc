@@ -0,0 +1,158 @@
+#include "sensor/reflector_map_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <glog/logging.h>
+
+namespace sensor
+{
+
+namespace
+{
+// Reflectors reaching more cells per axis are checked by every lookup instead
+constexpr int kMaxCellSpan = 32;
+} // namespace
+
+ReflectorMapIndex::ReflectorMapIndex(const double &resolution)
+    : resolution_(resolution), gate_(0.), noise_(Eigen::Matrix2d::Zero())
+{
+    CHECK(resolution_ > 0.);
+}
+
+void ReflectorMapIndex::Build(const Map &map, const double &gate, const Eigen::Matrix2d &noise)
+{
+    gate_ = gate;
+    noise_ = noise;
+    information_.clear();
+    cells_.clear();
+    unbounded_.clear();
+    for (int i = 0; i < map.reflector_map_.size(); ++i)
+        Insert(map, i);
+    LOG(INFO) << "Reflector map index: " << Size() << " reflectors in " << cells_.size()
+              << " cells, " << unbounded_.size() << " always checked";
+}
+
+void ReflectorMapIndex::Insert(const Map &map, const int &id)
+{
+    CHECK(id == information_.size() && id < map.reflector_map_.size() && id < map.reflector_map_coviarance_.size());
+    const Eigen::Matrix2d coviarance = GateCoviarance(map, id);
+    information_.push_back(coviarance.inverse());
+
+    // d^T * cov^-1 * d >= |d|^2 / lambda_max, so the gate is inside a circle of
+    // radius gate * sqrt(lambda_max)
+    const double lambda_max = coviarance.selfadjointView<Eigen::Lower>().eigenvalues().maxCoeff();
+    const double radius = gate_ * std::sqrt(lambda_max);
+    if (!(radius <= kMaxCellSpan * resolution_ / 2))
+    {
+        unbounded_.push_back(id);
+        return;
+    }
+    const Eigen::Vector2f &p = map.reflector_map_[id];
+    const int min_x = GetCellIndex(p.x() - radius), max_x = GetCellIndex(p.x() + radius);
+    const int min_y = GetCellIndex(p.y() - radius), max_y = GetCellIndex(p.y() + radius);
+    for (int x = min_x; x <= max_x; ++x)
+        for (int y = min_y; y <= max_y; ++y)
+            cells_[IndexToKey(x, y)].push_back(id);
+}
+
+ReflectorMapIndex::Cells ReflectorMapIndex::ExportCells() const
+{
+    Cells cells;
+    cells.keys.reserve(cells_.size());
+    for (const auto &cell : cells_)
+        cells.keys.push_back(cell.first);
+    std::sort(cells.keys.begin(), cells.keys.end());
+    cells.offsets.reserve(cells.keys.size() + 1);
+    cells.offsets.push_back(0);
+    for (const KeyType &key : cells.keys)
+    {
+        const auto &ids = cells_.at(key);
+        cells.ids.insert(cells.ids.end(), ids.begin(), ids.end());
+        cells.offsets.push_back(cells.ids.size());
+    }
+    cells.unbounded.assign(unbounded_.begin(), unbounded_.end());
+    return cells;
+}
+
+void ReflectorMapIndex::ImportCells(const Map &map, const double &gate, const Eigen::Matrix2d &noise, const Cells &cells)
+{
+    CHECK(map.reflector_map_.size() == map.reflector_map_coviarance_.size());
+    CHECK(cells.offsets.size() == cells.keys.size() + 1 && cells.offsets.back() == cells.ids.size());
+    gate_ = gate;
+    noise_ = noise;
+    information_.clear();
+    cells_.clear();
+    unbounded_.clear();
+    const int M = map.reflector_map_.size();
+    information_.reserve(M);
+    for (int id = 0; id < M; ++id)
+        information_.push_back(GateCoviarance(map, id).inverse());
+    cells_.reserve(cells.keys.size());
+    for (int i = 0; i < cells.keys.size(); ++i)
+    {
+        std::vector<int> &ids = cells_[cells.keys[i]];
+        ids.assign(cells.ids.begin() + cells.offsets[i], cells.ids.begin() + cells.offsets[i + 1]);
+        for (const int &id : ids)
+            CHECK(id >= 0 && id < M);
+    }
+    for (const int &id : cells.unbounded)
+    {
+        CHECK(id >= 0 && id < M);
+        unbounded_.push_back(id);
+    }
+    LOG(INFO) << "Reflector map index: " << Size() << " reflectors in " << cells_.size()
+              << " cells, " << unbounded_.size() << " always checked, loaded from file";
+}
+
+Eigen::Matrix2d ReflectorMapIndex::GateCoviarance(const Map &map, const int &id) const
+{
+    Eigen::Matrix2d coviarance = map.reflector_map_coviarance_[id] + noise_;
+    coviarance = 0.5 * (coviarance + coviarance.transpose());
+    const Eigen::SelfAdjointEigenSolver<Eigen::Matrix2d> solver(coviarance, Eigen::EigenvaluesOnly);
+    if (!(solver.eigenvalues()(0) > 0.))
+    {
+        LOG(WARNING) << "Coviarance of map reflector " << id << " is not positive definite, use noise only";
+        coviarance = noise_;
+    }
+    return coviarance;
+}
+
+int ReflectorMapIndex::Match(const Map &map, const Eigen::Vector2f &point, double *distance) const
+{
+    int best_id = -1;
+    double best_distance = std::numeric_limits<double>::max();
+    auto check = [&](const std::vector<int> &ids) {
+        for (const int id : ids)
+        {
+            const Eigen::Vector2d delta = (map.reflector_map_[id] - point).cast<double>();
+            const double dist = std::sqrt(delta.transpose() * information_[id] * delta);
+            if (dist < best_distance)
+            {
+                best_distance = dist;
+                best_id = id;
+            }
+        }
+    };
+    const auto it = cells_.find(IndexToKey(GetCellIndex(point.x()), GetCellIndex(point.y())));
+    if (it != cells_.end())
+        check(it->second);
+    check(unbounded_);
+    if (best_id < 0 || !(best_distance < gate_))
+        return -1;
+    if (distance != nullptr)
+        *distance = best_distance;
+    return best_id;
+}
+
+ReflectorMapIndex::KeyType ReflectorMapIndex::IndexToKey(const int &x, const int &y)
+{
+    return (static_cast<KeyType>(x) << 32) | static_cast<uint32_t>(y);
+}
+
+int ReflectorMapIndex::GetCellIndex(const double &value) const
+{
+    return static_cast<int>(std::floor(value / resolution_));
+}
+
+} // namespace sensor
@@ -0,0 +1,220 @@
+#include "reflector_ekf_slam/ekf_update.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <tuple>
+
+namespace ekf
+{
+namespace
+{
+constexpr int kLandmarks = 8;
+constexpr int kDimension = 3 + 2 * kLandmarks;
+
+// Innovation solver, Joseph form, mixed precision covariance
+typedef std::tuple<InnovationSolver, bool, bool> UpdateParam;
+
+class SparseUpdateTest : public ::testing::TestWithParam<UpdateParam>
+{
+protected:
+    SparseUpdateTest() : rng_(7), normal_(0., 1.)
+    {
+    }
+
+    Eigen::MatrixXd RandomMatrix(const int &rows, const int &cols)
+    {
+        Eigen::MatrixXd matrix(rows, cols);
+        for (int i = 0; i < rows; ++i)
+            for (int j = 0; j < cols; ++j)
+                matrix(i, j) = normal_(rng_);
+        return matrix;
+    }
+
+    // A * A^T / n + epsilon * I is well conditioned
+    Eigen::MatrixXd RandomCoviarance(const int &rows, const double &scale)
+    {
+        const Eigen::MatrixXd A = RandomMatrix(rows, 2 * rows);
+        return scale * (A * A.transpose() / (2 * rows) + 0.1 * Eigen::MatrixXd::Identity(rows, rows));
+    }
+
+    ObservationBlock RandomBlock(const int &rows, const int &landmark_index)
+    {
+        ObservationBlock block;
+        block.robot_jacobian = RandomMatrix(rows, 3);
+        block.landmark_index = landmark_index;
+        block.landmark_jacobian = landmark_index < 0 ? Eigen::MatrixXd::Zero(rows, 2) : RandomMatrix(rows, 2);
+        block.innovation = 0.1 * RandomMatrix(rows, 1);
+        block.noise = RandomCoviarance(rows, 0.01);
+        return block;
+    }
+
+    // Reflectors of some landmarks, one of them twice, and a robot only measurement
+    std::vector<ObservationBlock> RandomBlocks()
+    {
+        std::vector<ObservationBlock> blocks;
+        for (const int &id : {1, 4, 6, 4})
+            blocks.push_back(RandomBlock(2, 3 + 2 * id));
+        blocks.push_back(RandomBlock(3, -1));
+        return blocks;
+    }
+
+    std::mt19937 rng_;
+    std::normal_distribution<double> normal_;
+};
+
+// The update with the full jacobian over all state rows
+void DenseUpdate(const std::vector<ObservationBlock> &blocks, const EKFOptions &options, State *state)
+{
+    const int N = state->mu.rows();
+    int rows = 0;
+    for (const auto &block : blocks)
+        rows += block.innovation.rows();
+    Eigen::MatrixXd H = Eigen::MatrixXd::Zero(rows, N);
+    Eigen::MatrixXd Q = Eigen::MatrixXd::Zero(rows, rows);
+    Eigen::VectorXd innovation(rows);
+    int row = 0;
+    for (const auto &block : blocks)
+    {
+        const int r = block.innovation.rows();
+        H.block(row, 0, r, 3) = block.robot_jacobian;
+        if (block.landmark_index >= 0)
+            H.block(row, block.landmark_index, r, 2) = block.landmark_jacobian;
+        Q.block(row, row, r, r) = block.noise;
+        innovation.segment(row, r) = block.innovation;
+        row += r;
+    }
+    const Eigen::MatrixXd &sigma = state->sigma;
+    const Eigen::MatrixXd S = H * sigma * H.transpose() + Q;
+    const Eigen::MatrixXd K = sigma * H.transpose() * S.inverse();
+    state->mu += K * innovation;
+    const Eigen::MatrixXd I_KH = Eigen::MatrixXd::Identity(N, N) - K * H;
+    if (options.use_joseph_form)
+        state->sigma = I_KH * sigma * I_KH.transpose() + K * Q * K.transpose();
+    else
+        state->sigma = I_KH * sigma;
+}
+
+TEST_P(SparseUpdateTest, MatchesDenseUpdate)
+{
+    EKFOptions options;
+    options.innovation_solver = std::get<0>(GetParam());
+    options.use_joseph_form = std::get<1>(GetParam());
+    const bool mixed_precision = std::get<2>(GetParam());
+    // Float landmark blocks are rounded once per update
+    const double tolerance = mixed_precision ? 1e-6 : 1e-10;
+
+    for (int trial = 0; trial < 20; ++trial)
+    {
+        State prior;
+        prior.time = 0.;
+        prior.mu = RandomMatrix(kDimension, 1);
+        prior.sigma = RandomCoviarance(kDimension, 0.5);
+        StateBuffer state;
+        state.Assign(prior);
+        state.SetMixedPrecision(mixed_precision);
+        // The dense update starts from the same rounded covariance
+        State expected = state.ToState();
+        const std::vector<ObservationBlock> blocks = RandomBlocks();
+
+        DenseUpdate(blocks, options, &expected);
+        SparseUpdate(blocks, options, &state);
+        const State actual = state.ToState();
+        EXPECT_LT((actual.mu - expected.mu).lpNorm<Eigen::Infinity>(), tolerance) << "trial " << trial;
+        EXPECT_LT((actual.sigma - expected.sigma).lpNorm<Eigen::Infinity>(), tolerance) << "trial " << trial;
+
+        if (mixed_precision)
+            continue;
+        // Overload on plain matrices, which only writes the lower triangle
+        Eigen::VectorXd mu = prior.mu;
+        Eigen::MatrixXd sigma = prior.sigma;
+        SparseUpdate(blocks, options, mu, sigma);
+        EXPECT_LT((mu - expected.mu).lpNorm<Eigen::Infinity>(), tolerance) << "trial " << trial;
+        const Eigen::MatrixXd difference = sigma - expected.sigma;
+        EXPECT_LT(difference.triangularView<Eigen::Lower>().toDenseMatrix().lpNorm<Eigen::Infinity>(), tolerance)
+            << "trial " << trial;
+    }
+}
+
+TEST_P(SparseUpdateTest, SequentialMatchesSparse)
+{
+    EKFOptions options;
+    options.innovation_solver = std::get<0>(GetParam());
+    options.use_joseph_form = std::get<1>(GetParam());
+    const bool mixed_precision = std::get<2>(GetParam());
+    // Float landmark blocks are rounded once per block
+    const double tolerance = mixed_precision ? 1e-6 : 1e-10;
+
+    for (int trial = 0; trial < 20; ++trial)
+    {
+        State prior;
+        prior.time = 0.;
+        prior.mu = RandomMatrix(kDimension, 1);
+        prior.sigma = RandomCoviarance(kDimension, 0.5);
+        StateBuffer sparse;
+        sparse.Assign(prior);
+        sparse.SetMixedPrecision(mixed_precision);
+        StateBuffer sequential;
+        sequential.Assign(prior);
+        sequential.SetMixedPrecision(mixed_precision);
+        const std::vector<ObservationBlock> blocks = RandomBlocks();
+
+        SparseUpdate(blocks, options, &sparse);
+        // Small innovations pass the gate
+        EXPECT_EQ(SequentialUpdate(blocks, options, &sequential), 0) << "trial " << trial;
+        const State expected = sparse.ToState();
+        const State actual = sequential.ToState();
+        EXPECT_LT((actual.mu - expected.mu).lpNorm<Eigen::Infinity>(), tolerance) << "trial " << trial;
+        EXPECT_LT((actual.sigma - expected.sigma).lpNorm<Eigen::Infinity>(), tolerance) << "trial " << trial;
+    }
+}
+
+TEST_P(SparseUpdateTest, SequentialDropsOutlier)
+{
+    EKFOptions options;
+    options.innovation_solver = std::get<0>(GetParam());
+    options.use_joseph_form = std::get<1>(GetParam());
+    const bool mixed_precision = std::get<2>(GetParam());
+    const double tolerance = mixed_precision ? 1e-6 : 1e-10;
+
+    for (int trial = 0; trial < 20; ++trial)
+    {
+        State prior;
+        prior.time = 0.;
+        prior.mu = RandomMatrix(kDimension, 1);
+        prior.sigma = RandomCoviarance(kDimension, 0.5);
+        StateBuffer sparse;
+        sparse.Assign(prior);
+        sparse.SetMixedPrecision(mixed_precision);
+        StateBuffer sequential;
+        sequential.Assign(prior);
+        sequential.SetMixedPrecision(mixed_precision);
+        const std::vector<ObservationBlock> inliers = RandomBlocks();
+        // A reflector matched to the wrong landmark, tens of meters off
+        std::vector<ObservationBlock> blocks = inliers;
+        ObservationBlock outlier = RandomBlock(2, 3 + 2 * (trial % kLandmarks));
+        outlier.innovation << 30., -40.;
+        blocks.insert(blocks.begin() + trial % (blocks.size() + 1), outlier);
+
+        // The result is the update with the inliers only
+        SparseUpdate(inliers, options, &sparse);
+        EXPECT_EQ(SequentialUpdate(blocks, options, &sequential), 1) << "trial " << trial;
+        const State expected = sparse.ToState();
+        const State actual = sequential.ToState();
+        EXPECT_LT((actual.mu - expected.mu).lpNorm<Eigen::Infinity>(), tolerance) << "trial " << trial;
+        EXPECT_LT((actual.sigma - expected.sigma).lpNorm<Eigen::Infinity>(), tolerance) << "trial " << trial;
+    }
+}
+
+INSTANTIATE_TEST_CASE_P(Solvers, SparseUpdateTest,
+                        ::testing::Combine(::testing::Values(INVERSE, LLT, LDLT), ::testing::Bool(),
+                                           ::testing::Bool()));
+
+} // namespace
+} // namespace ekf
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,179 @@
+#include "reflector_detect/laser/laser_reflector_detect.h"
+#include "transform/transform.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <random>
+
+namespace
+{
+// Allocations through operator new while counting is on
+std::atomic<bool> counting(false);
+std::atomic<int> allocations(0);
+} // namespace
+
+void *operator new(std::size_t size)
+{
+    if (counting.load(std::memory_order_relaxed))
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    void *pointer = std::malloc(size > 0 ? size : 1);
+    if (!pointer)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+namespace reflector_detect
+{
+namespace
+{
+constexpr int kBeams = 1440;
+constexpr double kScanTime = 0.025;
+// First beam of the reflectors, the last one wraps around the end of the scan
+const int kReflectorBeams[] = {100, 400, 700, 1000, 1436};
+constexpr int kReflectorWidth = 8;
+
+ReflectorDetectOptions CreateOptions(const bool &use_tracking)
+{
+    ReflectorDetectOptions options;
+    options.intensity_min = 160.;
+    options.reflector_min_length = 0.1;
+    options.reflector_length_error = 0.06;
+    options.range_min = 0.1f;
+    options.range_max = 20.f;
+    options.use_tracking = use_tracking;
+    options.tracking_full_scan_interval = 20;
+    return options;
+}
+
+class LaserReflectorDetectTest : public ::testing::Test
+{
+protected:
+    LaserReflectorDetectTest() : rng_(1), noise_(0., 0.005)
+    {
+    }
+
+    void AddOdometry(LaserReflectorDetect *detector, const double &time)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            sensor::OdometryData odometry;
+            odometry.time = time - kScanTime + i * kScanTime / 2;
+            odometry.position = Eigen::Vector3d(0.5 * odometry.time, 0., 0.);
+            odometry.orientation =
+                Eigen::Quaterniond(Eigen::AngleAxisd(0.1 * odometry.time, Eigen::Vector3d::UnitZ()));
+            odometry.linear_velocity = Eigen::Vector3d(0.5, 0., 0.);
+            odometry.angular_velocity = Eigen::Vector3d(0., 0., 0.1);
+            detector->HandleOdometryData(odometry);
+        }
+    }
+
+    // 360 degree scan of a wall with 0.1 m reflectors at 3 m, or none
+    sensor_msgs::LaserScanConstPtr CreateScan(const double &time, const bool &with_reflectors)
+    {
+        sensor_msgs::LaserScanPtr scan(new sensor_msgs::LaserScan);
+        scan->header.stamp = ros::Time(time);
+        scan->angle_min = -M_PI;
+        scan->angle_max = M_PI;
+        scan->angle_increment = 2 * M_PI / kBeams;
+        scan->scan_time = kScanTime;
+        scan->range_min = 0.05;
+        scan->range_max = 30.;
+        scan->ranges.resize(kBeams);
+        scan->intensities.resize(kBeams);
+        for (int i = 0; i < kBeams; ++i)
+        {
+            scan->ranges[i] = i % 97 == 0 ? INFINITY : 5. + 2. * std::sin(i * 0.01) + noise_(rng_);
+            scan->intensities[i] = 50.;
+        }
+        if (!with_reflectors)
+            return scan;
+        for (const int &first : kReflectorBeams)
+        {
+            for (int i = first; i < first + kReflectorWidth; ++i)
+            {
+                scan->ranges[i % kBeams] = 3. + noise_(rng_);
+                scan->intensities[i % kBeams] = 200.;
+            }
+        }
+        return scan;
+    }
+
+    // Reflectors of CreateScan() in base_link
+    sensor::PointCloud Targets(const transform::Rigid3d &sensor_to_base_link)
+    {
+        const transform::Rigid2f sensor_to_base_link_2d = transform::Project2D(sensor_to_base_link).cast<float>();
+        sensor::PointCloud targets;
+        for (const int &first : kReflectorBeams)
+        {
+            const float angle = -M_PI + (first + 0.5f * (kReflectorWidth - 1)) * 2 * M_PI / kBeams;
+            targets.push_back(sensor_to_base_link_2d * Eigen::Vector2f(3.f * std::cos(angle), 3.f * std::sin(angle)));
+        }
+        return targets;
+    }
+
+    // Allocations of tracking and detecting reflectors in every scan after the warm up
+    void ExpectSteadyStateAllocations(const bool &use_tracking)
+    {
+        LaserReflectorDetect detector(CreateOptions(use_tracking));
+        const transform::Rigid3d sensor_to_base_link(
+            Eigen::Vector3d(0.3, -0.1, 0.), Eigen::Quaterniond(Eigen::AngleAxisd(0.2, Eigen::Vector3d::UnitZ())));
+        detector.SetSensorToBaseLinkTransform(sensor_to_base_link);
+        const sensor::PointCloud targets = Targets(sensor_to_base_link);
+        constexpr int kWarmUpScans = 3;
+        for (int k = 0; k < 60; ++k)
+        {
+            const double time = 1. + k * kScanTime;
+            AddOdometry(&detector, time);
+            // Every fifth scan has no reflector
+            const bool with_reflectors = k % 5 != 4;
+            const sensor_msgs::LaserScanConstPtr scan = CreateScan(time, with_reflectors);
+            allocations = 0;
+            counting = true;
+            detector.SetTrackingTargets(targets, 0.1f, 0.02f);
+            const sensor::Observation observation = detector.HandleLaserScan(scan);
+            counting = false;
+            if (k < kWarmUpScans)
+                continue;
+            EXPECT_EQ(observation.cloud_.size(), with_reflectors ? 5u : 0u) << "scan " << k;
+            // The only allocation is the returned reflector cloud, reserved once
+            EXPECT_EQ(allocations.load(), observation.cloud_.empty() ? 0 : 1) << "scan " << k;
+            EXPECT_EQ(observation.cloud_.capacity(), observation.cloud_.size()) << "scan " << k;
+        }
+    }
+
+    std::mt19937 rng_;
+    std::normal_distribution<double> noise_;
+};
+
+TEST_F(LaserReflectorDetectTest, FullScanSteadyStateAllocations)
+{
+    ExpectSteadyStateAllocations(false);
+}
+
+TEST_F(LaserReflectorDetectTest, TrackingSteadyStateAllocations)
+{
+    ExpectSteadyStateAllocations(true);
+}
+
+} // namespace
+} // namespace reflector_detect
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
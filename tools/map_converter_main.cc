@@ -0,0 +1,45 @@
+#include <glog/logging.h>
+
+#include <cstdlib>
+#include <string>
+
+#include "reflector_ekf_slam/ekf_slam_interface.h"
+#include "sensor/map_io.h"
+
+// Converts a reflector map between the txt and the binary format, the format
+// of the output is given by its extension: .txt for txt, binary otherwise.
+// The binary map gets the match index for the observation standard deviation
+// of the node, so it must be the 'obervation_cov' param the map is used with.
+int main(int argc, char **argv)
+{
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_logtostderr = true;
+    if (argc < 3)
+    {
+        LOG(ERROR) << "Usage: " << argv[0] << " input_map output_map [observation_std, default 0.05]";
+        return -1;
+    }
+    const std::string input = argv[1];
+    const std::string output = argv[2];
+    const double observation_std = argc > 3 ? std::atof(argv[3]) : 0.05;
+    const Eigen::Matrix2d noise = Eigen::Matrix2d::Identity() * observation_std * observation_std;
+
+    sensor::Map map;
+    sensor::ReflectorMapIndex index;
+    if (!sensor::LoadMap(input, ekf::kMapMatchGate, noise, &map, &index))
+    {
+        LOG(ERROR) << "Can not load map " << input;
+        return -1;
+    }
+    const bool to_txt = output.size() >= 4 && output.compare(output.size() - 4, 4, ".txt") == 0;
+    const bool saved = to_txt ? sensor::SaveMapToTxtFile(output, map) : sensor::SaveMapToBinaryFile(output, map, &index);
+    if (!saved)
+    {
+        LOG(ERROR) << "Can not save map " << output;
+        return -1;
+    }
+    LOG(INFO) << "Convert " << map.reflector_map_.size() << " reflectors from " << input << " to " << output;
+
+    google::ShutdownGoogleLogging();
+    return 0;
+}